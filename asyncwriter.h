@@ -0,0 +1,87 @@
+#ifndef asyncwriter_h
+#define asyncwriter_h
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "boundedqueue.h"
+#include "profiler.h"
+
+/* Output pipeline stage: a cv::VideoWriter driven by its own encoder thread, fed through a bounded handoff queue.
+ write() only waits when the encoder has fallen a full queue behind, so encoding overlaps with whatever produces the frames. */
+class AsyncVideoWriter {
+private:
+  cv::Ptr<cv::VideoWriter> writer;
+  BoundedQueue<cv::Mat> queue; // Frames waiting to be encoded
+  std::thread encoderThread;
+  std::atomic<long> encodeNanos; // Total time spent inside VideoWriter::write
+  std::atomic<long> framesWritten;
+
+  static void encode(cv::VideoWriter* writer, BoundedQueue<cv::Mat>* queue, std::atomic<long>* encodeNanos, std::atomic<long>* framesWritten) {
+    cv::Mat frame;
+    Profiler::nameThread("encoder");
+    while(queue->pop(frame)) {
+      auto start = std::chrono::steady_clock::now();
+      ProfileScope encoding(PROFILE_ENCODE);
+      writer->write(frame);
+      encoding.stop();
+      encodeNanos->fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+      framesWritten->fetch_add(1, std::memory_order_relaxed);
+      frame.release(); // Don't hold on to the frame's buffer while waiting for the next one
+    }
+  }
+
+public:
+  // Opens the output file (see cv::VideoWriter) and starts the encoder thread. queueFrames is the capacity of the handoff queue.
+  AsyncVideoWriter(const std::string& filename, int fourcc, double fps, cv::Size frameSize, int queueFrames = 8, bool isColor = true): AsyncVideoWriter(cv::makePtr<cv::VideoWriter>(filename, fourcc, fps, frameSize, isColor), queueFrames) {
+  }
+
+  // Drives an already opened writer (a RawVideoWriter, say)
+  AsyncVideoWriter(cv::Ptr<cv::VideoWriter> writer, int queueFrames = 8): writer(writer), queue(queueFrames) {
+    encodeNanos.store(0, std::memory_order_relaxed);
+    framesWritten.store(0, std::memory_order_relaxed);
+    encoderThread = std::thread(encode, this->writer.get(), &queue, &encodeNanos, &framesWritten);
+  }
+
+  ~AsyncVideoWriter() {
+    release();
+  }
+
+  bool isOpened() { return writer->isOpened(); }
+
+  // Sets a VideoWriter property. Only call this before the first write().
+  bool set(int propId, double value) {
+    return writer->set(propId, value);
+  }
+
+  // Queues a frame to be encoded. The frame's pixels must not be modified afterwards (it is shared, not copied).
+  // Waits only while the handoff queue is full.
+  void write(const cv::Mat& frame) {
+    cv::Mat item = frame;
+    ProfileScope waiting(PROFILE_ENCODE_WAIT);
+    queue.push(item);
+  }
+
+  // Encodes all queued frames, stops the encoder thread, and closes the output file.
+  void release() {
+    queue.close();
+    if(encoderThread.joinable())
+      encoderThread.join();
+    writer->release();
+  }
+
+  long getFramesWritten() { return framesWritten.load(std::memory_order_relaxed); }
+
+  // Total seconds spent encoding
+  double getEncodeSeconds() { return encodeNanos.load(std::memory_order_relaxed) / 1e9; }
+
+  // Total seconds the encoder thread sat idle, waiting for frames to be produced
+  double getEncoderWaitSeconds() { return queue.getPopWaitSeconds(); }
+
+  // Total seconds write() callers spent waiting for the encoder to make room in the queue
+  double getProducerWaitSeconds() { return queue.getPushWaitSeconds(); }
+};
+
+#endif
@@ -0,0 +1,106 @@
+// Benchmark: the motion estimation backends on the same input.
+// Without arguments, frames are synthesized by shifting a textured background by known sub-pixel offsets, and the error is measured
+// against those. Given "<video> <x> <y> <width> <height> [frames]", the reference rectangle is taken from the video's first frame,
+// and the error is measured against the full-frame template matcher instead.
+
+#include "../stabilizer.h"
+#include "syntheticvideo.h"
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+struct BenchInput {
+  std::vector<cv::Mat> frames;
+  std::vector<cv::Point2f> truth; // Where the reference is in each frame (empty if unknown)
+  cv::Mat refImg;
+  cv::Point refPos;
+};
+
+BenchInput synthesize(cv::Size size, int frameCount) {
+  BenchInput input;
+  SyntheticVideo video(size, frameCount);
+  input.refPos = video.refPos;
+  input.refImg = video.refImg;
+  input.truth = video.truth;
+  for(int i = 0; i < frameCount; ++i) {
+    cv::Mat frame;
+    video.render(i, frame);
+    input.frames.push_back(frame);
+  }
+  return input;
+}
+
+BenchInput readVideo(const char* file, cv::Rect refRect, int frameCount) {
+  BenchInput input;
+  cv::VideoCapture cap(file);
+  cv::Mat frame;
+  while((int) input.frames.size() < frameCount && cap.read(frame))
+    input.frames.push_back(frame.clone());
+  if(input.frames.empty()) {
+    std::cerr << "Could not read " << file << "\n";
+    exit(1);
+  }
+  input.refPos = refRect.tl();
+  input.refImg = input.frames[0](refRect).clone();
+  TemplateMatcher baseline(input.refImg);
+  for(cv::Mat& f : input.frames)
+    input.truth.push_back(baseline.estimate(f));
+  return input;
+}
+
+// Runs one backend over every frame, either over the whole frame or within radius pixels of the previous result
+void run(const char* name, const char* mode, MotionEstimator& estimator, BenchInput& input, int radius) {
+  std::vector<cv::Point2f> found;
+  found.reserve(input.frames.size());
+  long misses = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(size_t i = 0; i < input.frames.size(); ++i) {
+    cv::Point2f loc;
+    if(radius > 0 && i > 0 && estimator.estimateNear(input.frames[i], found.back(), radius, &loc)) {
+      found.push_back(loc);
+      continue;
+    }
+    if(radius > 0 && i > 0) ++misses;
+    found.push_back(estimator.estimate(input.frames[i]));
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double error = 0;
+  for(size_t i = 0; i < found.size(); ++i)
+    error += cv::norm(found[i] - input.truth[i]);
+  std::cout << name << "," << mode << "," << input.frames[0].cols << "x" << input.frames[0].rows << "," << input.frames.size() << ","
+            << 1000 * seconds / input.frames.size() << "," << error / found.size() << "," << misses << "\n";
+}
+
+int main(int argc, char** argv) {
+  std::vector<BenchInput> inputs;
+  if(argc >= 6) {
+    int frameCount = argc > 6 ? atoi(argv[6]) : 200;
+    inputs.push_back(readVideo(argv[1], cv::Rect(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5])), frameCount));
+  } else {
+    inputs.push_back(synthesize(cv::Size(1280, 720), 60));
+    inputs.push_back(synthesize(cv::Size(1920, 1080), 60));
+  }
+  std::cout << "estimator,mode,resolution,frames,ms_per_frame,mean_error_px,window_misses\n";
+  for(BenchInput& input : inputs) {
+    for(int levels : {0, 2}) {
+      TemplateMatcher matcher(input.refImg, levels);
+      run(levels == 0 ? "template" : "template-pyramid2", "full", matcher, input, 0);
+    }
+    TemplateMatcher windowed(input.refImg);
+    run("template", "window32", windowed, input, 32);
+    PhaseCorrelator phase(input.refImg, input.refPos);
+    run("phase", "full", phase, input, 0);
+    PhaseCorrelator phaseWindowed(input.refImg, input.refPos);
+    run("phase", "window32", phaseWindowed, input, 32);
+
+    // The same on grayscale, where small searches go through NccKernel instead of matchTemplate
+    BenchInput gray = input;
+    cv::cvtColor(input.refImg, gray.refImg, cv::COLOR_BGR2GRAY);
+    for(cv::Mat& frame : gray.frames)
+      cv::cvtColor(frame, frame, cv::COLOR_BGR2GRAY);
+    TemplateMatcher grayPyramid(gray.refImg, 2);
+    run("template-gray-pyramid2", "full", grayPyramid, gray, 0);
+    TemplateMatcher grayWindowed(gray.refImg);
+    run("template-gray", "window32", grayWindowed, gray, 32);
+  }
+}
@@ -0,0 +1,164 @@
+// Benchmark: the whole Stabilizer pipeline (decode, match, reorder, crop) on synthetic shaky clips with known motion, across thread
+// counts and matcher settings. Prints one CSV row per run: throughput, per-frame latency percentiles (from the start of decoding a
+// frame to the end of its cropping), peak resident memory, and the error of the match positions against the true motion.
+// Each run is a separate process (this program, re-run with "--run ..."), so that peak memory is measured per run.
+//
+// Usage: benchpipeline [frames] [heights], e.g. "benchpipeline 60 720,1080". Defaults to 90 frames at 720, 1080 and 2160 lines.
+
+#include "../stabilizer.h"
+#include "syntheticvideo.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char* settings[] = {"template", "template-pyramid2", "template-pyramid2-window32", "phase"};
+
+StabilizerOptions getOptions(const std::string& setting) {
+  StabilizerOptions options;
+  options.tracker = false; // Only the debugging view needs it
+  if(setting == "template-pyramid2" || setting == "template-pyramid2-window32")
+    options.pyramidLevels = 2;
+  if(setting == "template-pyramid2-window32")
+    options.searchRadius = 32;
+  if(setting == "phase")
+    options.estimator = "phase";
+  return options;
+}
+
+double percentile(std::vector<double>& values, double p) {
+  if(values.empty()) return 0;
+  size_t i = std::min((size_t) (p * values.size()), values.size() - 1);
+  std::nth_element(values.begin(), values.begin() + i, values.end());
+  return values[i];
+}
+
+long getPeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+  return usage.ru_maxrss; // Kilobytes on Linux
+#endif
+}
+
+// Stabilizes one clip, with the true match positions in a trajectory file, and prints its CSV row
+int runOne(const char* clipPath, const char* truthPath, const char* refPath, int threads, const std::string& setting) {
+  TrajectoryReader truth;
+  cv::Mat refImg = cv::imread(refPath);
+  cv::VideoCapture cap(clipPath);
+  if(! truth.open(truthPath) || refImg.empty() || ! cap.isOpened()) {
+    std::cerr << "Could not read " << clipPath << ", " << truthPath << " or " << refPath << "\n";
+    return 1;
+  }
+  const TrajectoryHeader& header = truth.getHeader();
+  cv::Point refPos(header.refX, header.refY);
+  cv::Rect viewRect(header.frameWidth / 8, header.frameHeight / 8, header.frameWidth * 3 / 4, header.frameHeight * 3 / 4);
+  Stabilizer stabilizer(&cap, viewRect, refPos, refImg, getOptions(setting));
+
+  std::vector<double> latencies;
+  latencies.reserve(truth.size());
+  double errorSum = 0, errorMax = 0;
+  long frames = 0;
+  auto start = std::chrono::steady_clock::now();
+  stabilizer.run(threads);
+  cv::Mat frame;
+  while(true) {
+    stabilizer >> frame;
+    if(frame.empty()) break;
+    latencies.push_back(stabilizer.getLastFrameLatency());
+    if(frames < (long) truth.size()) {
+      cv::Point2f expected(truth[frames].matchX, truth[frames].matchY);
+      double error = cv::norm(stabilizer.getLastMatchPos() - expected);
+      errorSum += error;
+      errorMax = std::max(errorMax, error);
+    }
+    ++frames;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << header.frameWidth << "x" << header.frameHeight << "," << setting << "," << threads << "," << frames << ","
+            << frames / seconds << "," << 1000 * percentile(latencies, 0.5) << "," << 1000 * percentile(latencies, 0.95) << ","
+            << 1000 * percentile(latencies, 0.99) << "," << getPeakRssKb() / 1024.0 << "," << (frames ? errorSum / frames : 0) << ","
+            << errorMax << "\n";
+  return 0;
+}
+
+// Writes a synthetic clip, its reference image, and its true match positions (as a trajectory file) to dir
+bool writeClip(cv::Size size, int frameCount, const std::string& dir, std::string* clipPath, std::string* truthPath, std::string* refPath) {
+  SyntheticVideo video(size, frameCount);
+  std::string name = dir + "/benchpipeline-" + std::to_string(size.height);
+  *clipPath = name + ".avi";
+  *truthPath = name + ".traj";
+  *refPath = name + "-ref.png";
+  TrajectoryHeader header = TrajectoryHeader();
+  header.refX = video.refPos.x;
+  header.refY = video.refPos.y;
+  header.refWidth = video.refImg.cols;
+  header.refHeight = video.refImg.rows;
+  header.frameWidth = size.width;
+  header.frameHeight = size.height;
+  header.fps = 30;
+  TrajectoryWriter writer;
+  if(! writer.open(*truthPath, header))
+    return false;
+  for(int i = 0; i < frameCount; ++i) {
+    TrajectoryRecord record = TrajectoryRecord();
+    record.number = i + 1;
+    record.matchX = video.truth[i].x;
+    record.matchY = video.truth[i].y;
+    writer.append(record);
+  }
+  return writer.close() && cv::imwrite(*refPath, video.refImg) && video.write(*clipPath, header.fps);
+}
+
+int main(int argc, char** argv) {
+  if(argc == 7 && std::string(argv[1]) == "--run")
+    return runOne(argv[2], argv[3], argv[4], atoi(argv[5]), argv[6]);
+
+  int frameCount = argc > 1 ? atoi(argv[1]) : 90;
+  std::vector<int> heights;
+  std::stringstream heightList(argc > 2 ? argv[2] : "720,1080,2160");
+  for(std::string height; std::getline(heightList, height, ',');)
+    heights.push_back(atoi(height.c_str()));
+  int cores = std::max((int) std::thread::hardware_concurrency(), 1);
+  std::vector<int> threadCounts;
+  for(int threads : {1, 2, 4, 8, 16})
+    if(threads < cores) threadCounts.push_back(threads);
+  threadCounts.push_back(cores);
+  std::string dir = std::filesystem::temp_directory_path().string();
+
+  std::cout << "resolution,setting,threads,frames,fps,latency_p50_ms,latency_p95_ms,latency_p99_ms,peak_rss_mb,mean_error_px,max_error_px" << std::endl;
+  for(int height : heights) {
+    cv::Size size(height * 16 / 9, height);
+    std::string clipPath, truthPath, refPath;
+    if(! writeClip(size, frameCount, dir, &clipPath, &truthPath, &refPath)) {
+      std::cerr << "Could not write the " << size.width << "x" << size.height << " clip to " << dir << "\n";
+      return 1;
+    }
+    for(const char* setting : settings) {
+      for(int threads : threadCounts) {
+        std::string cmd = std::string("\"") + argv[0] + "\" --run \"" + clipPath + "\" \"" + truthPath + "\" \"" + refPath + "\" "
+                          + std::to_string(threads) + " " + setting;
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if(! pipe) return 1;
+        char line[512];
+        while(fgets(line, sizeof(line), pipe))
+          std::cout << line << std::flush;
+        if(pclose(pipe) != 0) {
+          std::cerr << "Run failed: " << cmd << "\n";
+          return 1;
+        }
+      }
+    }
+    std::filesystem::remove(clipPath);
+    std::filesystem::remove(truthPath);
+    std::filesystem::remove(refPath);
+  }
+}
@@ -0,0 +1,124 @@
+// Microbenchmark: reassembling out-of-order frames with the old linked-list AtomicPriorityQueue versus the ReorderBuffer ring.
+// Each producer claims the next frame number, spends a little "work" on it, and publishes it; one consumer retires them in order.
+// The AtomicPriorityQueue has no synchronization between concurrent inserters, so its pushes are serialized with a mutex here
+// (this is the cheapest correct way to use it), and the consumer is woken on every push, as Stabilizer used to do.
+
+#include <iostream>
+#include "../AtomicPriorityQueue.h"
+#include "../reorderbuffer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+
+struct BenchFrame : Comparable<BenchFrame> {
+  long number = 0;
+  int compareTo(BenchFrame* other) {
+    return other->number - number;
+  }
+  friend std::ostream& operator<<(std::ostream& os, BenchFrame const& f) {
+    return os << f.number;
+  }
+};
+
+// Simulates matching work so that producers finish frames out of order
+static inline void spin(long number, int workIters) {
+  volatile long x = number;
+  int iters = workIters + (number * 7919) % (workIters + 1);
+  for(int i = 0; i < iters; ++i)
+    x = x * 31 + i;
+}
+
+double benchPriorityQueue(int threadCount, long frameCount, int workIters) {
+  AtomicPriorityQueue<BenchFrame> queue;
+  std::mutex pushMtx, popMtx;
+  std::condition_variable popNotify;
+  std::atomic<long> counter(0);
+  std::atomic<int> running(threadCount);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for(int t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&]() {
+      while(true) {
+        long n = counter.fetch_add(1) + 1;
+        if(n > frameCount) break;
+        spin(n, workIters);
+        BenchFrame f;
+        f.number = n;
+        {
+          std::scoped_lock l(pushMtx);
+          queue.push(f);
+        }
+        popNotify.notify_all();
+      }
+      running.fetch_sub(1);
+      popNotify.notify_all();
+    });
+  }
+  long retired = 0;
+  while(retired < frameCount) {
+    std::unique_lock<std::mutex> lk(popMtx);
+    while(true) {
+      BenchFrame* f;
+      {
+        std::scoped_lock l(pushMtx);
+        f = queue.peek();
+      }
+      if(f != nullptr && f->number == retired + 1) break;
+      popNotify.wait_for(lk, std::chrono::milliseconds(1));
+    }
+    std::scoped_lock l(pushMtx);
+    queue.pop();
+    ++retired;
+  }
+  for(std::thread& t : threads)
+    t.join();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double benchReorderBuffer(int threadCount, long frameCount, int workIters) {
+  ReorderBuffer<BenchFrame> buffer(4 * threadCount);
+  std::atomic<long> counter(0);
+  std::atomic<int> running(threadCount);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for(int t = 0; t < threadCount; ++t) {
+    threads.emplace_back([&]() {
+      while(true) {
+        long n = counter.fetch_add(1) + 1;
+        if(n > frameCount) break;
+        spin(n, workIters);
+        BenchFrame f;
+        f.number = n;
+        buffer.publish(n, f);
+      }
+      if(running.fetch_sub(1) == 1)
+        buffer.close();
+    });
+  }
+  BenchFrame f;
+  long retired = 0;
+  while(buffer.pop(f))
+    ++retired;
+  for(std::thread& t : threads)
+    t.join();
+  if(retired != frameCount) {
+    std::cerr << "ReorderBuffer retired " << retired << " of " << frameCount << " frames\n";
+    exit(1);
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+  long frameCount = argc > 1 ? atol(argv[1]) : 200000;
+  int workIters = argc > 2 ? atoi(argv[2]) : 200;
+  std::cout << "threads,priority_queue_frames_per_sec,reorder_buffer_frames_per_sec,speedup\n";
+  for(int threadCount : {1, 2, 4, 8, 16, 32, 64}) {
+    double pq = benchPriorityQueue(threadCount, frameCount, workIters);
+    double rb = benchReorderBuffer(threadCount, frameCount, workIters);
+    std::cout << threadCount << "," << frameCount / pq << "," << frameCount / rb << "," << pq / rb << "\n";
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef syntheticvideo_h
+#define syntheticvideo_h
+
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+/* A shaky clip with known motion: a blurred-noise background (textured everywhere, so every part of it matches unambiguously),
+ shifted by a random walk of sub-pixel offsets, like a shaky hand. truth[i] is where the reference rectangle cut from the
+ unshifted background is in frame i. */
+class SyntheticVideo {
+private:
+  cv::Mat background;
+
+public:
+  std::vector<cv::Point2f> shifts; // Offset of frame i from the background
+  std::vector<cv::Point2f> truth;
+  cv::Mat refImg;
+  cv::Point refPos;
+
+  SyntheticVideo(cv::Size size, int frameCount, cv::Size refSize = cv::Size(96, 64), float shake = 1.5f, unsigned seed = 1) {
+    cv::Mat noise(size, CV_8UC3);
+    cv::randu(noise, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+    cv::GaussianBlur(noise, background, cv::Size(0, 0), 2.5);
+    refPos = cv::Point(size.width / 2 - refSize.width / 2, size.height / 2 - refSize.height / 2);
+    refImg = background(cv::Rect(refPos, refSize)).clone();
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> step(0, shake);
+    cv::Point2f offset(0, 0);
+    for(int i = 0; i < frameCount; ++i) {
+      offset += cv::Point2f(step(rng), step(rng));
+      shifts.push_back(offset);
+      truth.push_back(cv::Point2f(refPos.x + offset.x, refPos.y + offset.y));
+    }
+  }
+
+  cv::Size getSize() { return background.size(); }
+
+  int getFrameCount() { return shifts.size(); }
+
+  // Renders frame i (counting from 0) into frame
+  void render(int i, cv::Mat& frame) {
+    cv::Matx23d shift(1, 0, shifts[i].x, 0, 1, shifts[i].y);
+    cv::warpAffine(background, frame, shift, background.size(), cv::INTER_LINEAR, cv::BORDER_REFLECT);
+  }
+
+  // Encodes the clip to a video file. Motion JPEG at high quality, which every OpenCV build can write and read back, and which
+  // costs the matchers little accuracy. Returns false if the file couldn't be written.
+  bool write(const std::string& path, double fps = 30) {
+    cv::VideoWriter writer(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps, background.size());
+    if(! writer.isOpened())
+      return false;
+    writer.set(cv::VIDEOWRITER_PROP_QUALITY, 95);
+    cv::Mat frame;
+    for(int i = 0; i < getFrameCount(); ++i) {
+      render(i, frame);
+      writer.write(frame);
+    }
+    return true;
+  }
+};
+
+#endif
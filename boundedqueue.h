@@ -0,0 +1,141 @@
+#ifndef boundedqueue_h
+#define boundedqueue_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+/* A fixed-capacity FIFO ring for handing items from one pipeline stage to the next. Items are moved into preallocated slots;
+ push() blocks while the ring is full, and pop() blocks while it is empty. Time spent blocked on either side is accumulated,
+ so that each stage can report how long it waited on the other. */
+template <typename generic>
+class BoundedQueue {
+private:
+  std::unique_ptr<generic[]> items;
+  long capacity;
+  long head; // Index of the next item to pop
+  long count; // Number of items currently queued
+  bool closed; // Set once no more items will be pushed
+  std::mutex mtx;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::atomic<long> pushWaitNanos; // Total time producers spent waiting for space
+  std::atomic<long> popWaitNanos; // Total time consumers spent waiting for items
+
+  static inline long nanosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+public:
+  BoundedQueue(long capacity = 1) {
+    reset(capacity);
+  }
+
+  /* Empties the queue and reallocates it with the given capacity. Not thread-safe; only call this while nothing is using the queue. */
+  void reset(long capacity) {
+    this->capacity = capacity < 1 ? 1 : capacity;
+    items = std::make_unique<generic[]>(this->capacity);
+    head = 0;
+    count = 0;
+    closed = false;
+    pushWaitNanos.store(0, std::memory_order_relaxed);
+    popWaitNanos.store(0, std::memory_order_relaxed);
+  }
+
+  /* Moves item into the back of the queue, waiting for space if it is full. Returns false (without queueing it) if the queue was closed. */
+  bool push(generic& item) {
+    {
+      std::unique_lock<std::mutex> lk(mtx);
+      if(count == capacity && ! closed) {
+        auto start = std::chrono::steady_clock::now();
+        while(count == capacity && ! closed)
+          notFull.wait(lk);
+        pushWaitNanos.fetch_add(nanosSince(start), std::memory_order_relaxed);
+      }
+      if(closed) return false;
+      items[(head + count) % capacity] = std::move(item);
+      ++count;
+    }
+    notEmpty.notify_one();
+    return true;
+  }
+
+  /* Moves item into the back of the queue only if there is space right away. Returns false (leaving item as it was) if the queue is
+   full or closed; for producers that would rather drop an item than wait. */
+  bool tryPush(generic& item) {
+    {
+      std::scoped_lock lk(mtx);
+      if(closed || count == capacity) return false;
+      items[(head + count) % capacity] = std::move(item);
+      ++count;
+    }
+    notEmpty.notify_one();
+    return true;
+  }
+
+  /* Moves the front item into item, waiting for one if the queue is empty. Returns false once the queue is closed and drained. */
+  bool pop(generic& item) {
+    {
+      std::unique_lock<std::mutex> lk(mtx);
+      if(count == 0 && ! closed) {
+        auto start = std::chrono::steady_clock::now();
+        while(count == 0 && ! closed)
+          notEmpty.wait(lk);
+        popWaitNanos.fetch_add(nanosSince(start), std::memory_order_relaxed);
+      }
+      if(count == 0) return false; // Closed and drained
+      item = std::move(items[head]);
+      head = (head + 1) % capacity;
+      --count;
+    }
+    notFull.notify_one();
+    return true;
+  }
+
+  /* Moves the front item into item only if there is one right away. Returns false if the queue is empty (or closed and drained); for
+   consumers that have other work to do than wait. */
+  bool tryPop(generic& item) {
+    {
+      std::scoped_lock lk(mtx);
+      if(count == 0) return false;
+      item = std::move(items[head]);
+      head = (head + 1) % capacity;
+      --count;
+    }
+    notFull.notify_one();
+    return true;
+  }
+
+  /* Whether the queue is closed and every item has been popped */
+  bool isDrained() {
+    std::scoped_lock lk(mtx);
+    return closed && count == 0;
+  }
+
+  /* Declares that no more items will be pushed. Items already queued can still be popped. */
+  void close() {
+    {
+      std::scoped_lock lk(mtx);
+      closed = true;
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+  long size() {
+    std::scoped_lock lk(mtx);
+    return count;
+  }
+
+  long getCapacity() { return capacity; }
+
+  /* Total seconds spent by producers waiting for space */
+  double getPushWaitSeconds() { return pushWaitNanos.load(std::memory_order_relaxed) / 1e9; }
+
+  /* Total seconds spent by consumers waiting for items */
+  double getPopWaitSeconds() { return popWaitNanos.load(std::memory_order_relaxed) / 1e9; }
+};
+
+#endif
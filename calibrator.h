@@ -1,24 +1,48 @@
 #ifndef calibrator_h
 #define calibrator_h
 
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
 #include "stabilizer.h"
 #include "pointcloudtracker.h"
+#include "hilloptimizer.h"
 
 /* Requirements:
  * Doesn't affect the passed-in VideoCapture
  * Has public instance variables for the calibration parameters
  * Autonomously minimizes an error metric on the point cloud to find the calibration parameters
  */
+/* Tunes the motion stretch (StabilizerOptions::stretchX and stretchY) for a video. A few short runs of consecutive frames, spread over
+ the video, are read and matched once, and kept as a downscaled grayscale proxy along with their smoothed match positions. Each
+ candidate stretch is then scored on the proxy alone: its frames are cropped with it, and a point cloud tracked through them. The loss
+ is how much the shape of the cloud (its points relative to their centroid) changes from one frame to the next, which stretching the
+ view by the right amount cancels. The hill optimizer's candidates of each round are scored in parallel. */
 class Calibrator {
 private:
-  cv::VideoCapture cap;
-  PointCloudTracker pct;
+  struct ProxyFrame {
+    cv::Mat image; // Downscaled, grayscale
+    cv::Point2f matchLoc; // Smoothed match position, in proxy pixels
+  };
+
+  cv::VideoCapture* cap;
+  cv::Mat refImg;
+  cv::Point refPos;
+  cv::Rect viewRect;
+  StabilizerOptions options;
+  std::vector<std::vector<ProxyFrame>> runs; // The sampled runs of consecutive frames
+  cv::Rect proxyView; // viewRect and refPos, scaled to the proxy
+  cv::Point proxyRefPos;
 
   // Reads the passed-in vector, and returns a unique_ptr to a vector of the same size, with each point in the new vector being positionally-independent from the original
   std::unique_ptr<std::vector<cv::Point2f>> getPositionalIndependent(const std::vector<cv::Point2f>& points) {
     // Find the average point
     cv::Point2f average;
-    for(int i = 0; i < points.size(); ++i) {
+    for(size_t i = 0; i < points.size(); ++i) {
       average += points[i];
     }
     average /= (float) points.size();
@@ -26,43 +50,177 @@ private:
     std::unique_ptr<std::vector<cv::Point2f>> relativePoints = std::make_unique<std::vector<cv::Point2f>>();
     relativePoints->reserve(points.size());
 
-    for (int i = 0; i < points.size(); ++i) {
+    for (size_t i = 0; i < points.size(); ++i) {
       relativePoints->push_back(points[i] - average);
     }
     return relativePoints;
   }
 
-protected:
-  cv::Mat getNextFrame() {
-    cv::Mat frame;
-    cap >> frame;
-    if(frame.empty()) {
-      cap.set(cv::CAP_PROP_POS_FRAMES, 0); // rewind to beginning
-      cap >> frame;
+  // Takes every smoothed position that is ready, scaled to the proxy
+  static void takeSmoothed(TrajectorySmoother& smoother, double scale, std::vector<cv::Point2f>& smoothed) {
+    while(smoother.ready()) {
+      double x, y;
+      smoother.next(&x, &y);
+      smoothed.push_back(cv::Point2f(x * scale, y * scale));
     }
-    return frame;
   }
 
-public:
-  Calibrator(cv::VideoCapture cap) {
-    this->cap = cap;
+  // Reads, matches and smooths the sampled runs into the proxy. Returns false if not even one run of two frames could be read.
+  bool sample() {
+    runs.clear();
+    std::unique_ptr<MotionEstimator> estimator = createMotionEstimator(options, refImg, refPos);
+    if(! estimator)
+      return false;
+    TrajectorySmoother::Method method = TrajectorySmoother::NONE;
+    TrajectorySmoother::parseMethod(options.smoothing, &method);
+    long frameCount = cap->get(cv::CAP_PROP_FRAME_COUNT);
+    double scale = 0;
+    for(int r = 0; r < sampleRuns; ++r) {
+      // Centered on equal parts of the video, and ending by its last frame, so that every run can be read through without wrapping
+      long start = std::clamp(frameCount * (2 * r + 1) / (2 * sampleRuns) - runLength / 2, 0L, std::max(frameCount - runLength, 0L));
+      cap->set(cv::CAP_PROP_POS_FRAMES, start);
+      TrajectorySmoother smoother(method, options.smoothingWindow, options.kalmanProcessNoise, options.motionLimit);
+      std::vector<ProxyFrame> run;
+      std::vector<cv::Point2f> smoothed;
+      cv::Point2f loc;
+      for(int i = 0; i < runLength; ++i) {
+        cv::Mat frame;
+        *cap >> frame;
+        if(frame.empty()) // The end of the video (if the frame count was overestimated): the run ends here, rather than wrapping
+          break;
+        if(scale == 0) {
+          scale = std::min(1.0, (double) proxyWidth / frame.cols);
+          proxyView = cv::Rect(cvRound(viewRect.x * scale), cvRound(viewRect.y * scale), std::max(cvRound(viewRect.width * scale), 1), std::max(cvRound(viewRect.height * scale), 1));
+          proxyRefPos = cv::Point(cvRound(refPos.x * scale), cvRound(refPos.y * scale));
+        }
+        if(i == 0 || options.searchRadius <= 0 || ! estimator->estimateNear(frame, loc, options.searchRadius, &loc))
+          loc = estimator->estimate(frame);
+        smoother.push(loc.x, loc.y);
+        takeSmoothed(smoother, scale, smoothed);
+        ProxyFrame proxy;
+        cv::resize(frame, proxy.image, cv::Size(), scale, scale, cv::INTER_AREA);
+        if(proxy.image.channels() == 3)
+          cv::cvtColor(proxy.image, proxy.image, cv::COLOR_BGR2GRAY);
+        run.push_back(proxy);
+      }
+      smoother.finish();
+      takeSmoothed(smoother, scale, smoothed);
+      for(size_t i = 0; i < run.size(); ++i)
+        run[i].matchLoc = smoothed[i];
+      if(run.size() >= 2)
+        runs.push_back(std::move(run));
+    }
+    return ! runs.empty();
   }
-    
 
-  void calibrate() {
-    int initialPos = cap.get(cv::CAP_PROP_POS_FRAMES); // Satisfy requirements: doesn't affect the passed-in VideoCapture
-    cv::Mat frame = getNextFrame();
-
-    std::unique_ptr<std::vector<cv::Point2f>> relativePrevPoints = getPositionalIndependent(*pct.getPoints());
-
-    
+  // Crops a run with the given stretch, tracking the point cloud through it. Returns the summed change in the cloud's shape between
+  // consecutive frames (mean squared change of its points' positions relative to their centroid), and counts those frames in pairs.
+  double getJitter(const std::vector<ProxyFrame>& run, cv::Point2d stretch, PointCloudTracker& tracker, cv::Mat& cropped, long* pairs) {
+    tracker.reset();
+    double total = 0;
+    std::vector<cv::Point2f> tracked;
+    for(size_t i = 0; i < run.size(); ++i) {
+      Stabilizer::cropView(run[i].image, run[i].matchLoc, run[i > 0 ? i - 1 : 0].matchLoc, stretch, proxyView, proxyRefPos, cropped);
+      tracker.update(cropped);
+      size_t count = tracker.getTrackedFrom()->size();
+      if(count < 3)
+        continue;
+      tracked.assign(tracker.getPoints()->begin(), tracker.getPoints()->begin() + count);
+      std::unique_ptr<std::vector<cv::Point2f>> before = getPositionalIndependent(*tracker.getTrackedFrom());
+      std::unique_ptr<std::vector<cv::Point2f>> after = getPositionalIndependent(tracked);
+      double change = 0;
+      for(size_t k = 0; k < count; ++k) {
+        cv::Point2f d = (*after)[k] - (*before)[k];
+        change += d.dot(d);
+      }
+      total += change / count;
+      ++*pairs;
+    }
+    return total;
+  }
 
+  // Scores every candidate (stretchX, stretchY) on every run, spreading the pairs of them over the threads
+  std::vector<double> evaluate(const std::vector<std::vector<double>>& candidates) {
+    size_t tasks = candidates.size() * runs.size();
+    std::vector<double> totals(tasks, 0);
+    std::vector<long> pairs(tasks, 0);
+    std::atomic<size_t> nextTask(0);
+    int threadCount = std::min((size_t) std::max(threads > 0 ? threads : (int) std::thread::hardware_concurrency(), 1), std::max(tasks, (size_t) 1));
+    std::vector<std::thread> workers;
+    for(int t = 0; t < threadCount; ++t) {
+      workers.emplace_back([&]() {
+        PointCloudTracker tracker; // Per-thread tracking state and scratch images
+        cv::Mat cropped;
+        for(size_t task = nextTask.fetch_add(1); task < tasks; task = nextTask.fetch_add(1)) {
+          const std::vector<double>& candidate = candidates[task / runs.size()];
+          totals[task] = getJitter(runs[task % runs.size()], cv::Point2d(candidate[0], candidate[1]), tracker, cropped, &pairs[task]);
+        }
+      });
+    }
+    for(std::thread& worker : workers)
+      worker.join();
+    std::vector<double> losses;
+    for(size_t c = 0; c < candidates.size(); ++c) {
+      double total = 0;
+      long count = 0;
+      for(size_t r = 0; r < runs.size(); ++r) {
+        total += totals[c * runs.size() + r];
+        count += pairs[c * runs.size() + r];
+      }
+      losses.push_back(count > 0 ? total / count : std::numeric_limits<double>::max());
+    }
+    return losses;
+  }
 
+public:
+  double stretchX; // The calibration parameters: where calibrate() starts from, and what it found
+  double stretchY;
+  int sampleRuns = 8; // Runs of consecutive frames sampled from the video
+  int runLength = 16; // Frames in each run
+  int proxyWidth = 480; // Width the sampled frames are scaled down to
+  int threads = 0; // Threads scoring candidates; 0 uses one per core
+  int maxRounds = 40; // Rounds of the optimizer to stop after, if it hasn't converged by then
+  double loss = 0; // The loss of the parameters found, and of the ones started from
+  double initialLoss = 0;
+  long evaluations = 0; // Candidates scored
 
+  // Calibrates for the video read by cap, stabilized by matching refImg, taken from refPos, and cropping to viewRect, with options
+  // (starting from its stretch)
+  Calibrator(cv::VideoCapture* cap, const cv::Mat& refImg, cv::Point refPos, cv::Rect viewRect, const StabilizerOptions& options) {
+    this->cap = cap;
+    this->refImg = refImg;
+    this->refPos = refPos;
+    this->viewRect = viewRect;
+    this->options = options;
+    stretchX = options.stretchX;
+    stretchY = options.stretchY;
+  }
 
+  // Finds the stretch with the least point cloud jitter, storing it in stretchX and stretchY. Returns false if the video couldn't be
+  // sampled, leaving them as they were.
+  bool calibrate() {
+    long initialPos = cap->get(cv::CAP_PROP_POS_FRAMES); // Satisfy requirements: doesn't affect the passed-in VideoCapture
+    bool sampled = sample();
     // Restore the original position of the video capture
-    cap.set(cv::CAP_PROP_POS_FRAMES, initialPos);
+    cap->set(cv::CAP_PROP_POS_FRAMES, initialPos);
+    if(! sampled)
+      return false;
+
+    HillOptimizer<double> optimizer;
+    optimizer.addParam(&stretchX, 0.25, 0.01, -2, 2);
+    optimizer.addParam(&stretchY, 0.25, 0.01, -2, 2);
+    for(int round = 0; round < maxRounds; ++round) {
+      std::vector<std::vector<double>> candidates = optimizer.getCandidates();
+      std::vector<double> losses = evaluate(candidates);
+      if(round == 0)
+        initialLoss = losses[0]; // The starting point
+      if(! optimizer.update(candidates, losses))
+        break;
+    }
+    loss = optimizer.getBestLoss();
+    evaluations = optimizer.getEvaluations();
+    return true;
   }
 };
 
-#endif
\ No newline at end of file
+#endif
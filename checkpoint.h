@@ -0,0 +1,91 @@
+#ifndef checkpoint_h
+#define checkpoint_h
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include "trajectorysmoother.h"
+
+/* A point that a long render can be resumed from: where the output segments finished so far end, and the stabilizer's state there.
+ Frames after it that were already decoded, matched or smoothed are simply done again. The file is a fixed-size header in the
+ machine's native layout (like the trajectory file), followed by the smoother's state, and is replaced atomically, so a run killed
+ while writing one leaves the previous checkpoint intact. */
+struct Checkpoint {
+  long outputFrames = 0; // Frames written to the finished output segments
+  long nextFrame = 1; // Number of the first frame not in them (counting from 1), to decode from when resuming
+  cv::Point2f lastMatchPos; // Match position, and smoothed match position, of the last frame written
+  cv::Point2f lastSmoothedPos;
+  TrajectorySmoother smoother; // Holding the positions of the frames before nextFrame that later ones are smoothed with
+  long segmentFrames = 0; // Frames per output segment
+  cv::Rect matchRect; // The rectangles the run was started with, which a resumed run must use too
+  cv::Rect viewRect;
+
+  // Writes the checkpoint to path, by way of a temporary file that replaces it once complete. Returns false if it can't be written.
+  bool write(const std::string& path) const {
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if(! file)
+      return false;
+    Header header = Header();
+    memcpy(header.magic, checkpointMagic, sizeof(checkpointMagic));
+    header.version = checkpointVersion;
+    header.outputFrames = outputFrames;
+    header.nextFrame = nextFrame;
+    header.segmentFrames = segmentFrames;
+    header.lastMatch[0] = lastMatchPos.x;
+    header.lastMatch[1] = lastMatchPos.y;
+    header.lastSmoothed[0] = lastSmoothedPos.x;
+    header.lastSmoothed[1] = lastSmoothedPos.y;
+    int32_t rects[8] = {matchRect.x, matchRect.y, matchRect.width, matchRect.height, viewRect.x, viewRect.y, viewRect.width, viewRect.height};
+    memcpy(header.rects, rects, sizeof(rects));
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && smoother.save(file);
+    ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok; // On disk before it replaces the previous checkpoint
+    ok = fclose(file) == 0 && ok;
+    if(ok)
+      ok = rename(temporary.c_str(), path.c_str()) == 0;
+    if(! ok)
+      remove(temporary.c_str());
+    return ok;
+  }
+
+  // Returns false if there is no checkpoint at path, or it isn't one of this version
+  bool read(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if(! file)
+      return false;
+    Header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, checkpointMagic, sizeof(checkpointMagic)) == 0
+      && header.version == checkpointVersion && smoother.load(file);
+    fclose(file);
+    if(! ok)
+      return false;
+    outputFrames = header.outputFrames;
+    nextFrame = header.nextFrame;
+    segmentFrames = header.segmentFrames;
+    lastMatchPos = cv::Point2f(header.lastMatch[0], header.lastMatch[1]);
+    lastSmoothedPos = cv::Point2f(header.lastSmoothed[0], header.lastSmoothed[1]);
+    matchRect = cv::Rect(header.rects[0], header.rects[1], header.rects[2], header.rects[3]);
+    viewRect = cv::Rect(header.rects[4], header.rects[5], header.rects[6], header.rects[7]);
+    return true;
+  }
+
+private:
+  struct Header {
+    char magic[8]; // "CVSCKPT" plus a terminating null
+    uint32_t version;
+    uint32_t reserved;
+    int64_t outputFrames, nextFrame, segmentFrames;
+    float lastMatch[2], lastSmoothed[2];
+    int32_t rects[8]; // The match rectangle, then the view rectangle, as x, y, width, height
+  };
+
+  static_assert(sizeof(Header) == 88, "Checkpoint header layout changed");
+
+  static constexpr char checkpointMagic[8] = "CVSCKPT";
+  static const uint32_t checkpointVersion = 1;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef ffmpegwriter_h
+#define ffmpegwriter_h
+
+#include <opencv2/opencv.hpp>
+#include <cctype>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "rawvideo.h"
+
+/* Writes the output video through a long-lived ffmpeg child process, which encodes the frames piped to it as Y4M and muxes them with
+ the audio of the source video as it goes, so the output file is written once, with its audio, instead of being written without
+ audio and then copied a second time to add it. */
+class FfmpegVideoWriter : public RawVideoWriter {
+private:
+  FILE* pipe;
+  int exitStatus;
+
+public:
+  FfmpegVideoWriter() {
+    pipe = nullptr;
+    exitStatus = 0;
+  }
+
+  ~FfmpegVideoWriter() {
+    release();
+  }
+
+  // Whether ffmpeg can be run at all
+  static bool isAvailable() {
+    return system("ffmpeg -version >/dev/null 2>&1") == 0;
+  }
+
+  // The ffmpeg encoder (and quality options) matching a fourcc that OpenCV reports for the source, or "" to let ffmpeg pick the
+  // output container's default
+  static std::string getEncoderOptions(int fourcc) {
+    std::string code;
+    for(int shift = 0; shift < 32; shift += 8)
+      code += (char) tolower((fourcc >> shift) & 255);
+    if(code == "avc1" || code == "h264" || code == "x264")
+      return "-c:v libx264 -crf 18"; // Close to transparent, as VIDEOWRITER_PROP_QUALITY 100 asks of OpenCV's writer
+    if(code == "hvc1" || code == "hev1" || code == "hevc")
+      return "-c:v libx265 -crf 20 -tag:v hvc1";
+    if(code == "mp4v")
+      return "-c:v mpeg4 -q:v 2";
+    if(code == "mjpg")
+      return "-c:v mjpeg -q:v 2";
+    if(code == "vp80")
+      return "-c:v libvpx -crf 10 -b:v 0";
+    if(code == "vp90")
+      return "-c:v libvpx-vp9 -crf 24 -b:v 0";
+    return "";
+  }
+
+  // Starts ffmpeg writing filename, from the frames written here and the first audio stream of audioSource (if it has one).
+  // encoderOptions are passed to ffmpeg as they are (see getEncoderOptions()).
+  bool open(const std::string& filename, const std::string& audioSource, const std::string& encoderOptions, cv::Size size, double fps) {
+    release();
+    std::string cmd = "ffmpeg -y -v error -f yuv4mpegpipe -i - -i \"" + audioSource + "\" -map 0:v:0 -map 1:a:0? " + encoderOptions + " -c:a copy \"" + filename + "\"";
+    signal(SIGPIPE, SIG_IGN); // If ffmpeg quits early, writes fail and release() reports its exit status, rather than the signal killing us
+    pipe = popen(cmd.c_str(), "w");
+    if(! pipe)
+      return false;
+    if(! RawVideoWriter::open(pipe, RAW_Y4M, size, fps)) {
+      pclose(pipe);
+      pipe = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // Closes the pipe, and waits for ffmpeg to finish writing the file
+  void release() override {
+    RawVideoWriter::release();
+    if(pipe) {
+      exitStatus = pclose(pipe);
+      pipe = nullptr;
+    }
+  }
+
+  // ffmpeg's exit status (as returned by pclose()) once released; 0 if it succeeded
+  int getExitStatus() const { return exitStatus; }
+};
+
+#endif
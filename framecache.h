@@ -0,0 +1,210 @@
+#ifndef framecache_h
+#define framecache_h
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "keyframeindex.h"
+
+/* Frames of a video for scrubbing through it interactively, without waiting on a seek for every slider move. A background thread,
+ with its own VideoCapture, indexes the keyframes and fills a cache of downscaled thumbnails spread over the whole video (coarsely
+ first, then filling in between), so that any position can be shown at once from the nearest thumbnail. The frame at the position
+ last asked for is then decoded at full resolution, by seeking to the keyframe before it and grabbing forward, which a newer request
+ interrupts, so only the position the slider settles on is decoded in full. */
+class FrameCache {
+private:
+  std::string path;
+  long frameCount;
+  int thumbnailWidth;
+  size_t maxThumbnails;
+  std::map<long, cv::Mat> thumbnails; // By frame index
+  std::vector<long> keyframes; // Empty until indexed (or if the video couldn't be indexed)
+  long requested; // Frame to decode at full resolution, or -1
+  long exactPos; // The frame last decoded at full resolution, or -1
+  cv::Mat exactFrame;
+  bool stopping;
+  std::atomic<bool> failed; // The background capture couldn't open the video
+  std::mutex mtx;
+  std::condition_variable requestNotify;
+  std::thread worker;
+
+  // Orders the thumbnail positions coarse to fine: every position at the largest power-of-two stride, then the ones halfway between,
+  // and so on, so that the whole video is covered early on
+  static std::vector<long> coarseToFine(const std::vector<long>& positions) {
+    std::vector<long> ordered;
+    std::vector<bool> taken(positions.size(), false);
+    size_t stride = 1;
+    while(stride * 2 < positions.size())
+      stride *= 2;
+    for(; stride > 0; stride /= 2) {
+      for(size_t i = 0; i < positions.size(); i += stride) {
+        if(taken[i]) continue;
+        taken[i] = true;
+        ordered.push_back(positions[i]);
+      }
+    }
+    return ordered;
+  }
+
+  // The keyframe at or before pos, to seek to for decoding it. Only call this while holding mtx.
+  long keyframeBefore(long pos) {
+    auto after = std::upper_bound(keyframes.begin(), keyframes.end(), pos);
+    return after == keyframes.begin() ? pos : *(after - 1);
+  }
+
+  // Decodes frame pos into frame, seeking to the keyframe before it (if known) and grabbing forward. Gives up (returning false) if
+  // interruptible and another frame is requested meanwhile.
+  bool decode(cv::VideoCapture& cap, long pos, cv::Mat& frame, bool interruptible) {
+    long start;
+    {
+      std::scoped_lock lk(mtx);
+      start = keyframeBefore(pos);
+    }
+    if(! cap.set(cv::CAP_PROP_POS_FRAMES, start))
+      return false;
+    for(long i = start; i < pos; ++i) {
+      if(interruptible) {
+        std::scoped_lock lk(mtx);
+        if(stopping || requested != pos)
+          return false;
+      }
+      if(! cap.grab())
+        return false;
+    }
+    return cap.read(frame) && ! frame.empty();
+  }
+
+  void shrink(const cv::Mat& frame, cv::Mat& thumbnail) {
+    int width = std::min(thumbnailWidth, frame.cols);
+    cv::resize(frame, thumbnail, cv::Size(width, std::max(1, frame.rows * width / frame.cols)), 0, 0, cv::INTER_AREA);
+  }
+
+  void run() {
+    cv::VideoCapture cap(path);
+    if(! cap.isOpened()) {
+      failed = true;
+      return;
+    }
+    KeyframeIndex index;
+    std::vector<long> positions;
+    if(index.probe(path)) {
+      std::scoped_lock lk(mtx);
+      keyframes = index.getKeyframes();
+      positions = keyframes; // Cheap to seek to
+    }
+    if(positions.size() > maxThumbnails || positions.empty()) { // Too many keyframes to keep, or none known: space them evenly
+      std::vector<long> spaced;
+      size_t count = std::min(maxThumbnails, (size_t) std::max(frameCount, 1L));
+      for(size_t i = 0; i < count; ++i)
+        spaced.push_back(positions.empty() ? (long) (i * frameCount / count) : positions[i * positions.size() / count]);
+      positions = spaced;
+    }
+    positions = coarseToFine(positions);
+    size_t next = 0;
+    cv::Mat frame, thumbnail;
+    while(true) {
+      long pos;
+      bool exact;
+      {
+        std::unique_lock<std::mutex> lk(mtx);
+        requestNotify.wait(lk, [&]() { return stopping || requested >= 0 || next < positions.size(); });
+        if(stopping)
+          return;
+        exact = requested >= 0;
+        pos = exact ? requested : positions[next++];
+        if(! exact && thumbnails.count(pos))
+          continue;
+      }
+      if(! decode(cap, pos, frame, exact)) {
+        std::scoped_lock lk(mtx);
+        if(exact && requested == pos) // The frame can't be decoded; don't retry it until asked again
+          requested = -1;
+        continue;
+      }
+      shrink(frame, thumbnail);
+      std::scoped_lock lk(mtx);
+      thumbnails[pos] = thumbnail.clone();
+      if(exact) {
+        exactFrame = frame.clone(); // A new buffer, as lookup() may have handed out the last one
+        exactPos = pos;
+        if(requested == pos)
+          requested = -1;
+      }
+    }
+  }
+
+public:
+  // Starts caching the video at path, of frameCount frames, keeping up to maxThumbnails thumbnails thumbnailWidth pixels wide
+  FrameCache(const std::string& path, long frameCount, int thumbnailWidth = 320, size_t maxThumbnails = 1000) {
+    this->path = path;
+    this->frameCount = frameCount;
+    this->thumbnailWidth = std::max(thumbnailWidth, 1);
+    this->maxThumbnails = std::max(maxThumbnails, (size_t) 1);
+    requested = -1;
+    exactPos = -1;
+    stopping = false;
+    failed = false;
+    worker = std::thread(&FrameCache::run, this);
+  }
+
+  ~FrameCache() {
+    {
+      std::scoped_lock lk(mtx);
+      stopping = true;
+    }
+    requestNotify.notify_all();
+    worker.join();
+  }
+
+  // Whether the background thread couldn't open the video, so nothing will ever be cached
+  bool hasFailed() { return failed; }
+
+  // Asks for frame pos to be decoded at full resolution, replacing any earlier request not yet done
+  void request(long pos) {
+    {
+      std::scoped_lock lk(mtx);
+      if(pos == exactPos)
+        return;
+      requested = pos;
+    }
+    requestNotify.notify_all();
+  }
+
+  // Puts the best frame available for pos right now into frame: pos itself at full resolution once decoded (returning true), or
+  // else the thumbnail nearest to it (returning false; frame is left empty if there are none yet). *shownPos is set to the position
+  // of the frame given.
+  bool lookup(long pos, cv::Mat& frame, long* shownPos) {
+    std::scoped_lock lk(mtx);
+    if(pos == exactPos) {
+      frame = exactFrame;
+      *shownPos = pos;
+      return true;
+    }
+    frame = cv::Mat();
+    *shownPos = -1;
+    if(thumbnails.empty())
+      return false;
+    auto after = thumbnails.lower_bound(pos);
+    auto nearest = after;
+    if(after == thumbnails.end() || (after != thumbnails.begin() && pos - std::prev(after)->first < after->first - pos))
+      nearest = std::prev(after);
+    frame = nearest->second;
+    *shownPos = nearest->first;
+    return false;
+  }
+
+  // Number of frames cached as thumbnails so far
+  size_t getThumbnailCount() {
+    std::scoped_lock lk(mtx);
+    return thumbnails.size();
+  }
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef framepool_h
+#define framepool_h
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/* A fixed set of image buffers that are handed out and recycled without reallocating. The pool keeps its own reference to every
+ buffer it creates, and a buffer is free again as soon as every other reference to it has been dropped, wherever that happens
+ (for frames, once the encoder thread has written the output, or retirement has cropped the decoded frame), so nothing has to
+ hand buffers back explicitly. Once the pool holds capacity buffers, and all are in use, acquire() allocates an unpooled one. */
+class FramePool {
+private:
+  std::vector<cv::Mat> buffers;
+  long capacity;
+  std::mutex mtx;
+  std::atomic<long> misses; // Buffers allocated outside the pool because it was exhausted
+
+  static bool isFree(const cv::Mat& buffer) {
+    return buffer.u != nullptr && CV_XADD(&buffer.u->refcount, 0) == 1; // Only the pool's own reference is left
+  }
+
+public:
+  FramePool(long capacity = 0) {
+    reset(capacity);
+  }
+
+  /* Drops every buffer and sets the capacity. Buffers already handed out stay valid. Not thread-safe. */
+  void reset(long capacity) {
+    this->capacity = capacity;
+    buffers.clear();
+    buffers.reserve(capacity);
+    misses.store(0, std::memory_order_relaxed);
+  }
+
+  long getCapacity() { return capacity; }
+
+  // Number of buffers handed out that had to be allocated outside the pool, because all were in use
+  long getMissCount() { return misses.load(std::memory_order_relaxed); }
+
+  // Returns a buffer of the given size and type, which the caller may overwrite. The contents are undefined.
+  cv::Mat acquire(cv::Size size, int type) {
+    std::scoped_lock lk(mtx);
+    for(cv::Mat& buffer : buffers) {
+      if(isFree(buffer)) {
+        buffer.create(size, type); // Only reallocates if the size or type changed
+        return buffer;
+      }
+    }
+    if((long) buffers.size() < capacity) {
+      buffers.emplace_back(size, type);
+      return buffers.back();
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return cv::Mat(size, type);
+  }
+};
+
+#endif
@@ -1,20 +1,120 @@
-#ifndef gdoptimizer_h
-#define gdoptimizer_h
+#ifndef hilloptimizer_h
+#define hilloptimizer_h
 
+#include <algorithm>
+#include <limits>
+#include <vector>
 
-// A simple hill-climbing optimizer.
+/* A simple hill-climbing optimizer. Each round tries a step up and a step down along each parameter from the best point so far
+ (the parameters' starting values, to begin with, which the first round tries too). It moves to the best of them if that lowers the
+ loss, and otherwise halves every step, until all of them are below their minimum.
+ The points of a round don't depend on each other, so they can be evaluated in parallel, with getCandidates() and
+ update(candidates, losses), or one at a time, with the parameters set to each in turn by update(loss). */
 template <typename floatlike>
 class HillOptimizer {
 private:
-  vector<floatlike*> params;
+  std::vector<floatlike*> params;
+  std::vector<floatlike> steps, minSteps, lower, upper;
+  std::vector<floatlike> best;
+  double bestLoss;
+  bool haveBest;
+  std::vector<std::vector<floatlike>> round; // For update(loss): the points of the current round, and the losses found so far
+  std::vector<double> roundLosses;
+  long evaluations;
+
+  void set(const std::vector<floatlike>& point) {
+    for(size_t i = 0; i < params.size(); ++i)
+      *params[i] = point[i];
+  }
 
 public:
-  void addParam(floatlike *p) {
+  HillOptimizer() {
+    bestLoss = 0;
+    haveBest = false;
+    evaluations = 0;
+  }
+
+  // Optimizes *p, starting from its current value, with steps of step at first and no smaller than minStep, within lower to upper
+  void addParam(floatlike* p, floatlike step = 0.1, floatlike minStep = 0.001, floatlike lower = std::numeric_limits<floatlike>::lowest(),
+                floatlike upper = std::numeric_limits<floatlike>::max()) {
     params.push_back(p);
+    steps.push_back(step);
+    minSteps.push_back(minStep);
+    this->lower.push_back(lower);
+    this->upper.push_back(upper);
+    *p = std::clamp(*p, lower, upper);
+    best.push_back(*p);
+  }
+
+  // The points to evaluate in this round, as values for each parameter in the order they were added
+  std::vector<std::vector<floatlike>> getCandidates() {
+    std::vector<std::vector<floatlike>> candidates;
+    if(! haveBest)
+      candidates.push_back(best);
+    for(size_t i = 0; i < params.size(); ++i) {
+      for(floatlike direction : {1, -1}) {
+        std::vector<floatlike> point = best;
+        point[i] = std::clamp((floatlike) (best[i] + direction * steps[i]), lower[i], upper[i]);
+        if(point[i] != best[i]) // Not already against the bound
+          candidates.push_back(point);
+      }
+    }
+    return candidates;
   }
 
-  void update(double loss) {
+  // Takes the losses of the points from getCandidates(), in the same order, and moves to the best of them (which the parameters are
+  // set to). Returns false once converged.
+  bool update(const std::vector<std::vector<floatlike>>& candidates, const std::vector<double>& losses) {
+    bool moved = false;
+    for(size_t i = 0; i < candidates.size() && i < losses.size(); ++i) {
+      ++evaluations;
+      if(! haveBest || losses[i] < bestLoss) {
+        moved = moved || haveBest;
+        best = candidates[i];
+        bestLoss = losses[i];
+        haveBest = true;
+      }
+    }
+    if(! moved)
+      for(floatlike& step : steps)
+        step /= 2;
+    set(best);
+    return ! isConverged();
   }
+
+  // Takes the loss of the parameters as they are now, and sets them to the next point to try: to the best point found, once
+  // converged (returning false)
+  bool update(double loss) {
+    if(round.empty())
+      round = getCandidates();
+    roundLosses.push_back(loss);
+    if(roundLosses.size() < round.size()) {
+      set(round[roundLosses.size()]);
+      return true;
+    }
+    bool converging = update(round, roundLosses);
+    round.clear();
+    roundLosses.clear();
+    while(converging && (round = getCandidates()).empty()) // Every step leads out of bounds: shrink them
+      converging = update(round, roundLosses);
+    if(converging)
+      set(round[0]);
+    return converging;
+  }
+
+  // Whether every step has shrunk below its minimum
+  bool isConverged() {
+    for(size_t i = 0; i < steps.size(); ++i)
+      if(steps[i] >= minSteps[i])
+        return false;
+    return true;
+  }
+
+  // The lowest loss found so far, which the parameters are set to after update(candidates, losses)
+  double getBestLoss() { return bestLoss; }
+
+  // Number of points evaluated so far
+  long getEvaluations() { return evaluations; }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,109 @@
+#ifndef keyframeindex_h
+#define keyframeindex_h
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A contiguous range of frame indices (counting from 0), from start up to but not including end
+struct FrameRange {
+  long start;
+  long end;
+};
+
+/* Index of the keyframes of a video's first video stream, built with a quick ffprobe prescan that reads only the packet headers
+ (nothing is decoded). Seeking to a keyframe is cheap, so the video can be split into keyframe-aligned ranges that separate
+ decoders each start on without decoding frames belonging to another range. */
+class KeyframeIndex {
+private:
+  std::vector<long> keyframes; // Indices of the keyframes, in presentation order
+  long frameCount;
+
+public:
+  KeyframeIndex() {
+    frameCount = 0;
+  }
+
+  // Runs ffprobe on the video. Returns false if it couldn't be run, or found no keyframes.
+  bool probe(const std::string& path) {
+    keyframes.clear();
+    frameCount = 0;
+    std::string cmd = "ffprobe -v error -select_streams v:0 -show_entries packet=pts,flags -of csv=p=0 \"" + path + "\" 2>/dev/null";
+    FILE* pipe = popen(cmd.c_str(), "r");
+    if(! pipe)
+      return false;
+    struct Packet {
+      long pts;
+      bool key;
+    };
+    std::vector<Packet> packets;
+    bool havePts = true;
+    char line[256];
+    while(fgets(line, sizeof(line), pipe)) { // Lines look like "1001,K__" (or "N/A,__" without a timestamp)
+      char* comma = strchr(line, ',');
+      if(! comma) continue;
+      char* end;
+      long pts = strtol(line, &end, 10);
+      if(end == line) havePts = false;
+      packets.push_back({pts, comma[1] == 'K'});
+    }
+    if(pclose(pipe) != 0)
+      return false;
+    if(havePts) // Packets come in decode order; number the frames in presentation order, as decoders return them
+      std::stable_sort(packets.begin(), packets.end(), [](const Packet& a, const Packet& b) { return a.pts < b.pts; });
+    for(size_t i = 0; i < packets.size(); ++i)
+      if(packets[i].key)
+        keyframes.push_back(i);
+    frameCount = packets.size();
+    return ! keyframes.empty();
+  }
+
+  const std::vector<long>& getKeyframes() { return keyframes; }
+
+  long getFrameCount() { return frameCount; }
+
+  // Splits the video into consecutive ranges that each start on a keyframe, merging keyframe intervals until each range is at least
+  // minFrames long (except maybe the last).
+  std::vector<FrameRange> split(long minFrames) {
+    std::vector<FrameRange> ranges;
+    long start = 0;
+    for(long keyframe : keyframes) {
+      if(keyframe - start >= minFrames) {
+        ranges.push_back({start, keyframe});
+        start = keyframe;
+      }
+    }
+    if(start < frameCount || ranges.empty())
+      ranges.push_back({start, frameCount});
+    return ranges;
+  }
+
+  // Splits frameCount frames into consecutive ranges of rangeFrames each, for when there is no keyframe index.
+  // The decoder then has to decode from the keyframe before each range start.
+  static std::vector<FrameRange> splitEvenly(long frameCount, long rangeFrames) {
+    std::vector<FrameRange> ranges;
+    rangeFrames = std::max(rangeFrames, 1L);
+    for(long start = 0; start < frameCount; start += rangeFrames)
+      ranges.push_back({start, std::min(start + rangeFrames, frameCount)});
+    if(ranges.empty())
+      ranges.push_back({0, 0});
+    return ranges;
+  }
+
+  // Drops the ranges (or the parts of them) before frame "first", to decode only from there on. The last range is always kept, as it
+  // runs on to the end of the video.
+  static std::vector<FrameRange> startAt(const std::vector<FrameRange>& ranges, long first) {
+    std::vector<FrameRange> kept;
+    for(size_t i = 0; i < ranges.size(); ++i) {
+      if(ranges[i].end <= first && i + 1 < ranges.size())
+        continue;
+      kept.push_back({std::max(ranges[i].start, first), std::max(ranges[i].end, first)});
+    }
+    return kept;
+  }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef matchhistory_h
+#define matchhistory_h
+
+#include <opencv2/opencv.hpp>
+#include <mutex>
+#include <vector>
+
+/* Thread-safe record of the match locations of recently matched frames, indexed by frame number in a fixed ring.
+ Worker threads finish frames out of order, so predict() works from whichever frames near the requested one are already known:
+ it interpolates between known frames on either side, or extrapolates the motion of the two closest earlier frames. */
+class MatchHistory {
+private:
+  struct Entry {
+    long number = 0; // Frame number this entry holds, or 0 if none
+    cv::Point2f loc;
+  };
+  std::vector<Entry> entries;
+  long capacity;
+  long lookback; // How many frame numbers away from the requested one predict() looks for known frames
+  std::mutex mtx;
+
+public:
+  MatchHistory(long capacity = 64) {
+    reset(capacity);
+  }
+
+  /* Forgets everything. Not thread-safe; only call this while nothing is using the history. */
+  void reset(long capacity) {
+    this->capacity = capacity < 2 ? 2 : capacity;
+    lookback = this->capacity / 2;
+    entries.assign(this->capacity, Entry());
+  }
+
+  void record(long number, cv::Point2f loc) {
+    std::scoped_lock l(mtx);
+    Entry& e = entries[number % capacity];
+    e.number = number;
+    e.loc = loc;
+  }
+
+  /* Predicts the match location of frame "number" from known nearby frames. Returns false if none are known. */
+  bool predict(long number, cv::Point2f* predicted) {
+    const Entry* before[2] = {nullptr, nullptr}; // The two closest known earlier frames, closest first
+    const Entry* after = nullptr; // The closest known later frame
+    {
+      std::scoped_lock l(mtx);
+      for(long d = 1; d <= lookback && (before[1] == nullptr || after == nullptr); ++d) {
+        const Entry& b = entries[(number - d + capacity) % capacity];
+        if(number - d > 0 && b.number == number - d && before[1] == nullptr)
+          before[before[0] == nullptr ? 0 : 1] = &b;
+        const Entry& a = entries[(number + d) % capacity];
+        if(a.number == number + d && after == nullptr)
+          after = &a;
+      }
+      if(before[0] != nullptr && after != nullptr) { // Interpolate between the neighbours on either side
+        double t = (double) (number - before[0]->number) / (after->number - before[0]->number);
+        *predicted = before[0]->loc + (after->loc - before[0]->loc) * t;
+      } else if(before[1] != nullptr) { // Continue the motion of the two closest earlier frames
+        double t = (double) (number - before[0]->number) / (before[0]->number - before[1]->number);
+        *predicted = before[0]->loc + (before[0]->loc - before[1]->loc) * t;
+      } else if(before[0] != nullptr) {
+        *predicted = before[0]->loc;
+      } else if(after != nullptr) {
+        *predicted = after->loc;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef motionestimator_h
+#define motionestimator_h
+
+#include <opencv2/opencv.hpp>
+
+/* Interface for the backends that locate the reference image within each video frame.
+ An estimator may keep per-frame scratch state, so each worker thread gets its own instance. */
+class MotionEstimator {
+public:
+  virtual ~MotionEstimator() {
+  }
+
+  // Returns the top-left position of the reference in image, searching as much of the frame as the backend can.
+  // If score is given, stores the backend's confidence in the result there (higher is better; the scale depends on the backend).
+  virtual cv::Point2f estimate(const cv::Mat& image, double* score = nullptr) = 0;
+
+  // Searches only within radius pixels of the predicted top-left position. Returns false if the reference wasn't confidently found
+  // there, in which case the caller should fall back to estimate(). Otherwise stores the position in loc, and the confidence in score.
+  virtual bool estimateNear(const cv::Mat& image, cv::Point2f predicted, int radius, cv::Point2f* loc, double* score = nullptr) = 0;
+
+  // Number of frames where the backend had to redo a low-confidence estimate with a slower, more thorough search
+  virtual long getFallbackCount() {
+    return 0;
+  }
+};
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef nccmatcher_h
+#define nccmatcher_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NCC_X86 1
+#define NCC_TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Instruction sets the kernel can correlate with
+enum NccPath {
+  NCC_SCALAR,
+  NCC_SSE41,
+  NCC_AVX2,
+  NCC_NEON
+};
+
+/* Normalized cross-correlation (the same scores as cv::matchTemplate with TM_CCOEFF_NORMED) of a small 8-bit single-channel
+ template against an 8-bit single-channel image, computed directly rather than through the DFT. For small templates and small search
+ areas (pyramid levels, search windows around a predicted position) that is faster than matchTemplate's general path.
+
+ The template's mean and norm are computed once, when it is set. The correlations are exact integer dot products, one template row
+ at a time, with SIMD (AVX2 or SSE4.1, picked at runtime, or NEON) and a scalar fallback; the common template widths are unrolled
+ at compile time. The window sums come from integral images. Each instance keeps its own scratch buffers, so use one per thread. */
+class NccKernel {
+public:
+  static const int maxArea = 32768; // Larger templates could overflow the 32-bit dot products (255 * 255 * area)
+
+private:
+  int width, height;
+  int templateStride; // Row stride of templ, in elements
+  std::vector<int16_t> templ; // The template's pixels, widened for the multiply-adds
+  double templateSum, templateNorm; // Sum of the pixels, and square root of the sum of squared deviations from their mean
+  NccPath path;
+  // Scratch, kept between calls
+  std::vector<int32_t> products; // Correlation of the template with the image at each position
+  std::vector<int64_t> sums, squareSums; // Integral images of the searched region
+
+  // Correlates the template with the image at every position, one row of outputs at a time. W is the template width if known at
+  // compile time, or 0.
+  template<int W>
+  static void correlateScalar(const NccKernel& k, const uint8_t* image, size_t stride, int cols, int rows, int32_t* out) {
+    const int w = W > 0 ? W : k.width;
+    for(int y = 0; y < rows; ++y) {
+      for(int x = 0; x < cols; ++x) {
+        int32_t sum = 0;
+        for(int r = 0; r < k.height; ++r) {
+          const uint8_t* pixels = image + (y + r) * stride + x;
+          const int16_t* t = k.templ.data() + r * k.templateStride;
+          for(int i = 0; i < w; ++i)
+            sum += pixels[i] * t[i];
+        }
+        out[y * cols + x] = sum;
+      }
+    }
+  }
+
+#ifdef NCC_X86
+  template<int W>
+  NCC_TARGET("sse4.1") static void correlateSse41(const NccKernel& k, const uint8_t* image, size_t stride, int cols, int rows, int32_t* out) {
+    const int w = W > 0 ? W : k.width;
+    const int vectorWidth = w & ~7;
+    for(int y = 0; y < rows; ++y) {
+      for(int x = 0; x < cols; ++x) {
+        __m128i acc = _mm_setzero_si128();
+        int32_t tail = 0;
+        for(int r = 0; r < k.height; ++r) {
+          const uint8_t* pixels = image + (y + r) * stride + x;
+          const int16_t* t = k.templ.data() + r * k.templateStride;
+          for(int i = 0; i < vectorWidth; i += 8) {
+            __m128i p = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) (pixels + i)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(p, _mm_loadu_si128((const __m128i*) (t + i))));
+          }
+          for(int i = vectorWidth; i < w; ++i)
+            tail += pixels[i] * t[i];
+        }
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+        acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+        out[y * cols + x] = _mm_cvtsi128_si32(acc) + tail;
+      }
+    }
+  }
+
+  template<int W>
+  NCC_TARGET("avx2") static void correlateAvx2(const NccKernel& k, const uint8_t* image, size_t stride, int cols, int rows, int32_t* out) {
+    const int w = W > 0 ? W : k.width;
+    const int vectorWidth = w & ~15;
+    for(int y = 0; y < rows; ++y) {
+      for(int x = 0; x < cols; ++x) {
+        __m256i acc = _mm256_setzero_si256();
+        int32_t tail = 0;
+        for(int r = 0; r < k.height; ++r) {
+          const uint8_t* pixels = image + (y + r) * stride + x;
+          const int16_t* t = k.templ.data() + r * k.templateStride;
+          for(int i = 0; i < vectorWidth; i += 16) {
+            __m256i p = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (pixels + i)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(p, _mm256_loadu_si256((const __m256i*) (t + i))));
+          }
+          for(int i = vectorWidth; i < w; ++i)
+            tail += pixels[i] * t[i];
+        }
+        __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+        out[y * cols + x] = _mm_cvtsi128_si32(half) + tail;
+      }
+    }
+  }
+#endif
+
+#ifdef __ARM_NEON
+  template<int W>
+  static void correlateNeon(const NccKernel& k, const uint8_t* image, size_t stride, int cols, int rows, int32_t* out) {
+    const int w = W > 0 ? W : k.width;
+    const int vectorWidth = w & ~7;
+    for(int y = 0; y < rows; ++y) {
+      for(int x = 0; x < cols; ++x) {
+        int32x4_t acc = vdupq_n_s32(0);
+        int32_t tail = 0;
+        for(int r = 0; r < k.height; ++r) {
+          const uint8_t* pixels = image + (y + r) * stride + x;
+          const int16_t* t = k.templ.data() + r * k.templateStride;
+          for(int i = 0; i < vectorWidth; i += 8) {
+            int16x8_t p = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pixels + i)));
+            int16x8_t tv = vld1q_s16(t + i);
+            acc = vmlal_s16(acc, vget_low_s16(p), vget_low_s16(tv));
+            acc = vmlal_s16(acc, vget_high_s16(p), vget_high_s16(tv));
+          }
+          for(int i = vectorWidth; i < w; ++i)
+            tail += pixels[i] * t[i];
+        }
+        int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+        out[y * cols + x] = vget_lane_s32(vpadd_s32(pair, pair), 0) + tail;
+      }
+    }
+  }
+#endif
+
+  template<int W>
+  void correlate(const uint8_t* image, size_t stride, int cols, int rows, int32_t* out) const {
+    switch(path) {
+#ifdef NCC_X86
+    case NCC_AVX2: correlateAvx2<W>(*this, image, stride, cols, rows, out); return;
+    case NCC_SSE41: correlateSse41<W>(*this, image, stride, cols, rows, out); return;
+#endif
+#ifdef __ARM_NEON
+    case NCC_NEON: correlateNeon<W>(*this, image, stride, cols, rows, out); return;
+#endif
+    default: correlateScalar<W>(*this, image, stride, cols, rows, out); return;
+    }
+  }
+
+public:
+  NccKernel() {
+    width = height = templateStride = 0;
+    templateSum = templateNorm = 0;
+    path = getBestPath();
+  }
+
+  // Whether this machine can run the given path
+  static bool isSupported(NccPath path) {
+    switch(path) {
+    case NCC_SCALAR: return true;
+#ifdef NCC_X86
+    case NCC_SSE41: return __builtin_cpu_supports("sse4.1");
+    case NCC_AVX2: return __builtin_cpu_supports("avx2");
+#endif
+#ifdef __ARM_NEON
+    case NCC_NEON: return true;
+#endif
+    default: return false;
+    }
+  }
+
+  static NccPath getBestPath() {
+    for(NccPath path : {NCC_AVX2, NCC_SSE41, NCC_NEON})
+      if(isSupported(path))
+        return path;
+    return NCC_SCALAR;
+  }
+
+  static const char* getPathName(NccPath path) {
+    static const char* const names[] = {"scalar", "sse4.1", "avx2", "neon"};
+    return names[path];
+  }
+
+  NccPath getPath() { return path; }
+
+  // Forces a path (falling back to scalar if this machine can't run it); for testing and benchmarking
+  void setPath(NccPath path) {
+    this->path = isSupported(path) ? path : NCC_SCALAR;
+  }
+
+  // Sets the template and precomputes its statistics. Returns false (leaving the kernel unusable) if it is empty or too large.
+  bool setTemplate(const uint8_t* data, size_t stride, int width, int height) {
+    templ.clear();
+    this->width = this->height = 0;
+    if(width <= 0 || height <= 0 || width * height > maxArea)
+      return false;
+    this->width = width;
+    this->height = height;
+    templateStride = (width + 15) & ~15;
+    templ.assign((size_t) templateStride * height, 0);
+    int64_t sum = 0, squareSum = 0;
+    for(int y = 0; y < height; ++y) {
+      for(int x = 0; x < width; ++x) {
+        uint8_t v = data[y * stride + x];
+        templ[y * templateStride + x] = v;
+        sum += v;
+        squareSum += v * v;
+      }
+    }
+    templateSum = sum;
+    templateNorm = std::sqrt(std::max(squareSum - (double) sum * sum / (width * height), 0.0));
+    return true;
+  }
+
+  bool isReady() { return ! templ.empty(); }
+
+  int getWidth() { return width; }
+  int getHeight() { return height; }
+
+  // Scores every position of the template in the image (whose width and height must be at least the template's) into result, a
+  // (imageWidth - width + 1) x (imageHeight - height + 1) array of floats with the given row stride in bytes
+  void match(const uint8_t* image, size_t stride, int imageWidth, int imageHeight, float* result, size_t resultStride) {
+    int cols = imageWidth - width + 1, rows = imageHeight - height + 1;
+    if(! isReady() || cols <= 0 || rows <= 0)
+      return;
+    if(templateNorm < 1e-9) { // A flat template correlates equally with everything; matchTemplate scores it 1 everywhere
+      for(int y = 0; y < rows; ++y)
+        std::fill((float*) ((uint8_t*) result + y * resultStride), (float*) ((uint8_t*) result + y * resultStride) + cols, 1.0f);
+      return;
+    }
+
+    products.resize((size_t) cols * rows);
+    switch(width) {
+    case 8: correlate<8>(image, stride, cols, rows, products.data()); break;
+    case 16: correlate<16>(image, stride, cols, rows, products.data()); break;
+    case 24: correlate<24>(image, stride, cols, rows, products.data()); break;
+    case 32: correlate<32>(image, stride, cols, rows, products.data()); break;
+    case 48: correlate<48>(image, stride, cols, rows, products.data()); break;
+    case 64: correlate<64>(image, stride, cols, rows, products.data()); break;
+    default: correlate<0>(image, stride, cols, rows, products.data()); break;
+    }
+
+    // Integral images of the pixels and their squares, for the sums over each window
+    size_t integralStride = imageWidth + 1;
+    sums.assign(integralStride * (imageHeight + 1), 0);
+    squareSums.assign(integralStride * (imageHeight + 1), 0);
+    for(int y = 0; y < imageHeight; ++y) {
+      int64_t rowSum = 0, rowSquareSum = 0;
+      const uint8_t* pixels = image + y * stride;
+      for(int x = 0; x < imageWidth; ++x) {
+        rowSum += pixels[x];
+        rowSquareSum += pixels[x] * pixels[x];
+        sums[(y + 1) * integralStride + x + 1] = sums[y * integralStride + x + 1] + rowSum;
+        squareSums[(y + 1) * integralStride + x + 1] = squareSums[y * integralStride + x + 1] + rowSquareSum;
+      }
+    }
+
+    // Normalize the same way matchTemplate does, including how it rounds scores just past +-1 and discards the rest
+    double invArea = 1.0 / (width * height);
+    double templateMean = templateSum * invArea;
+    for(int y = 0; y < rows; ++y) {
+      float* out = (float*) ((uint8_t*) result + y * resultStride);
+      const int64_t* top = sums.data() + y * integralStride;
+      const int64_t* bottom = sums.data() + (y + height) * integralStride;
+      const int64_t* squareTop = squareSums.data() + y * integralStride;
+      const int64_t* squareBottom = squareSums.data() + (y + height) * integralStride;
+      for(int x = 0; x < cols; ++x) {
+        double windowSum = (double) (bottom[x + width] - bottom[x] - top[x + width] + top[x]);
+        double windowSquareSum = (double) (squareBottom[x + width] - squareBottom[x] - squareTop[x + width] + squareTop[x]);
+        double num = products[y * cols + x] - windowSum * templateMean;
+        double t = std::sqrt(std::max(windowSquareSum - windowSum * windowSum * invArea, 0.0)) * templateNorm;
+        if(std::fabs(num) < t)
+          num /= t;
+        else if(std::fabs(num) < t * 1.125)
+          num = num > 0 ? 1 : -1;
+        else
+          num = 0;
+        out[x] = (float) num;
+      }
+    }
+  }
+};
+
+#endif
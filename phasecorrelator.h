@@ -0,0 +1,89 @@
+#ifndef phasecorrelator_h
+#define phasecorrelator_h
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include "motionestimator.h"
+#include "profiler.h"
+
+/* Locates the reference by FFT phase correlation on grayscale images, which costs O(N log N) in the size of the searched area
+ rather than (reference area x search area) like template matching.
+ The reference is placed on a canvas the size of the searched region, at the position it is expected in, with the rest filled with
+ its mean; cv::phaseCorrelate then measures the (sub-pixel) shift between that canvas and the frame region, under a Hanning window.
+ The score is phaseCorrelate's peak response, from 0 to 1. Each instance keeps its own scratch images, so use one per thread. */
+class PhaseCorrelator : public MotionEstimator {
+private:
+  cv::Mat refGray; // The reference, as 32-bit float grayscale
+  double refMean;
+  cv::Point refPos; // Where the reference was in its original frame; estimate() measures the shift from here
+  double minResponse; // estimateNear() rejects peaks weaker than this
+
+  // Scratch, reused while the searched region keeps the same size and placement
+  cv::Mat canvas;
+  cv::Point canvasOffset;
+  cv::Mat window; // Hanning window the size of canvas
+  cv::Mat gray; // The searched region of the frame, as grayscale
+  cv::Mat grayFloat;
+
+  // Measures where the reference is within region of image, expecting its top-left corner at offset (relative to region)
+  cv::Point2f correlate(const cv::Mat& image, cv::Rect region, cv::Point offset, double* response) {
+    if(canvas.size() != region.size() || canvasOffset != offset) { // Rebuild the reference canvas and window for this placement
+      canvas.create(region.size(), CV_32F);
+      canvas = cv::Scalar(refMean);
+      cv::Rect placed = cv::Rect(offset, refGray.size()) & cv::Rect(0, 0, region.width, region.height);
+      refGray(placed - offset).copyTo(canvas(placed));
+      canvasOffset = offset;
+      if(window.size() != region.size())
+        cv::createHanningWindow(window, region.size(), CV_32F);
+    }
+    if(image.channels() == 1)
+      gray = image(region);
+    else
+      cv::cvtColor(image(region), gray, cv::COLOR_BGR2GRAY);
+    gray.convertTo(grayFloat, CV_32F);
+    ProfileScope correlating(PROFILE_PHASE_CORRELATE);
+    cv::Point2d shift = cv::phaseCorrelate(canvas, grayFloat, window, response);
+    correlating.stop();
+    return cv::Point2f(region.x + offset.x + shift.x, region.y + offset.y + shift.y);
+  }
+
+public:
+  PhaseCorrelator(const cv::Mat& refImg, cv::Point refPos, double minResponse = 0.3) {
+    cv::Mat g;
+    if(refImg.channels() == 1)
+      g = refImg;
+    else
+      cv::cvtColor(refImg, g, cv::COLOR_BGR2GRAY);
+    g.convertTo(refGray, CV_32F);
+    refMean = cv::mean(refGray)[0];
+    this->refPos = refPos;
+    this->minResponse = minResponse;
+  }
+
+  // Correlates the whole frame against the reference placed where it was in its original frame
+  cv::Point2f estimate(const cv::Mat& image, double* score = nullptr) override {
+    double response;
+    cv::Point2f loc = correlate(image, cv::Rect(0, 0, image.cols, image.rows), refPos, &response);
+    if(score) *score = response;
+    return loc;
+  }
+
+  // Correlates a region of FFT-friendly size around the prediction. Shifts up to about radius pixels are recovered.
+  bool estimateNear(const cv::Mat& image, cv::Point2f predicted, int radius, cv::Point2f* loc, double* score = nullptr) override {
+    int width = std::min(cv::getOptimalDFTSize(refGray.cols + 2 * radius), image.cols);
+    int height = std::min(cv::getOptimalDFTSize(refGray.rows + 2 * radius), image.rows);
+    cv::Point expected(cvRound(predicted.x), cvRound(predicted.y));
+    // Center the region on the prediction, then slide it back inside the frame if needed
+    int x = std::clamp(expected.x - (width - refGray.cols) / 2, 0, image.cols - width);
+    int y = std::clamp(expected.y - (height - refGray.rows) / 2, 0, image.rows - height);
+    double response;
+    cv::Point2f found = correlate(image, cv::Rect(x, y, width, height), expected - cv::Point(x, y), &response);
+    if(response < minResponse || std::abs(found.x - predicted.x) > radius || std::abs(found.y - predicted.y) > radius)
+      return false;
+    *loc = found;
+    if(score) *score = response;
+    return true;
+  }
+};
+
+#endif
@@ -4,82 +4,139 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/core/ocl.hpp>
+#include <algorithm>
 #include <vector>
 #include <cassert>
 
+/* Tracks a cloud of feature points from frame to frame with pyramidal Lucas-Kanade optical flow. Each frame's pyramid is built once
+ and kept as the next frame's "old" one, and new points are only detected in the cells of a coarse grid that have lost most of
+ theirs, so that the points stay spread over the frame without redetecting the whole of it. */
 class PointCloudTracker {
 private:
-  // == For feature point tracking ==
-  cv::Mat old_gray; // The last image; used during pointcloud analysis
+  static const int gridColumns = 5;
+  static const int gridRows = 5;
+  static const int pointsPerCell = 4; // Target number of points in each grid cell
+  static const int maxLevel = 2; // Pyramid levels above the full-resolution image
+  static const int windowSize = 30; // Side of the search window at each pyramid level
+  static constexpr float minPointDistance = 7; // New points closer than this to a tracked one are left out
+
+  cv::Mat gray; // Scratch for converting colour frames
+  // This frame's and the last frame's pyramids. Swapped rather than rebuilt, so the old one's buffers are reused for the next frame.
+  std::vector<cv::Mat> oldPyramid, newPyramid;
   std::vector<cv::Point2f> oldPoints, newPoints; // Store point cloud points
+  std::vector<cv::Point2f> trackedFrom; // Where each point tracked into this frame (the first ones of newPoints) was in the last one
+  // Scratch kept between frames, so their capacity is reused rather than reallocated every frame
   std::vector<cv::KeyPoint> keypoints;
-  int lastRefreshPointCount;
+  std::vector<uchar> status;
+  std::vector<float> err;
+  int cellCounts[gridRows * gridColumns];
+  cv::Ptr<cv::FastFeatureDetector> fastDetector;
+
+  cv::Rect getCell(int index, cv::Size size) {
+    int column = index % gridColumns, row = index / gridColumns;
+    int x = column * size.width / gridColumns, y = row * size.height / gridRows;
+    return cv::Rect(x, y, (column + 1) * size.width / gridColumns - x, (row + 1) * size.height / gridRows - y);
+  }
+
+  int getCellIndex(cv::Point2f point, cv::Size size) {
+    int column = std::min(std::max((int) (point.x * gridColumns / size.width), 0), gridColumns - 1);
+    int row = std::min(std::max((int) (point.y * gridRows / size.height), 0), gridRows - 1);
+    return row * gridColumns + column;
+  }
+
+  // Detects points in the cells that have lost at least half of theirs, topping them back up with the strongest corners found there
+  void refill(const cv::Mat& image) {
+    cv::Size size = image.size();
+    std::fill(cellCounts, cellCounts + gridRows * gridColumns, 0);
+    for(const cv::Point2f& point : newPoints)
+      ++cellCounts[getCellIndex(point, size)];
+    size_t tracked = newPoints.size();
+    for(int cell = 0; cell < gridRows * gridColumns; ++cell) {
+      int missing = pointsPerCell - cellCounts[cell];
+      if(missing < pointsPerCell / 2) continue;
+      cv::Rect rect = getCell(cell, size);
+      if(rect.empty()) continue;
+      fastDetector->detect(image(rect), keypoints); // A header on the cell; nothing is copied
+      cv::KeyPointsFilter::retainBest(keypoints, pointsPerCell * 2); // Some may be dropped below for being too close to tracked ones
+      std::sort(keypoints.begin(), keypoints.end(), [](const cv::KeyPoint& a, const cv::KeyPoint& b) { return a.response > b.response; });
+      for(const cv::KeyPoint& keypoint : keypoints) {
+        if(missing == 0) break;
+        cv::Point2f point = keypoint.pt + cv::Point2f(rect.x, rect.y);
+        bool near = false;
+        for(size_t i = 0; i < tracked && ! near; ++i) {
+          cv::Point2f d = newPoints[i] - point;
+          near = d.dot(d) < minPointDistance * minPointDistance;
+        }
+        if(near) continue;
+        newPoints.push_back(point);
+        --missing;
+      }
+    }
+  }
+
 public:
 
-  PointCloudTracker(): oldPoints(), newPoints(), keypoints(), old_gray() {
-    lastRefreshPointCount = 0;
+  PointCloudTracker(): oldPoints(), newPoints(), keypoints() {
+    fastDetector = cv::FastFeatureDetector::create();
+  }
+
+  // Forgets the tracked points, to start over on an unrelated frame. Keeps the buffers.
+  void reset() {
+    oldPoints.clear();
+    newPoints.clear();
+    trackedFrom.clear();
   }
 
   // This will never be a nullptr
   const std::vector<cv::Point2f>* getPoints() {
-    return reinterpret_cast<const std::vector<cv::Point2f>*>(&newPoints);
+    return &newPoints;
+  }
+
+  // The last frame's positions of the points tracked into this one, which are the first getTrackedFrom()->size() of getPoints()
+  // (the rest were newly detected). This will never be a nullptr.
+  const std::vector<cv::Point2f>* getTrackedFrom() {
+    return &trackedFrom;
   }
 
+  // Tracks the points into frame. The frame isn't referenced after this returns.
   void update(cv::Mat& frame) {
     //// Preprocess for feature point tracking
-    cv::Mat gray;
-    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
-
-
-    // If first time, init variables and do inital setup
-    if(old_gray.empty()) {
-      old_gray = gray;
-      cv::cvtColor(frame, old_gray, cv::COLOR_BGR2GRAY);
-      cv::goodFeaturesToTrack(gray, newPoints, 100, 0.3, 7, cv::Mat(), 7, false, 0.04);
-      oldPoints = newPoints;
+    const cv::Mat* image = &frame;
+    if(frame.channels() != 1) {
+      cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+      image = &gray;
     }
 
-    // Update points on next frame
-    // https://docs.opencv.org/3.4/d4/dee/tutorial_optical_flow.html
-    std::vector<uchar> status;
-    std::vector<float> err;
-    cv::TermCriteria criteria = cv::TermCriteria((cv::TermCriteria::COUNT) + (cv::TermCriteria::EPS), 10, 0.03);
-    
-    calcOpticalFlowPyrLK(old_gray, gray, oldPoints, newPoints, status, err, cv::Size(30,30), 2, criteria);
-    
-    std::vector<cv::Point2f> good_new;
-    for(uint i = 0; i < newPoints.size(); i++) {
-      // Select good points
-      if(status[i] == 1) {
-        good_new.push_back(newPoints[i]);
-      }
-    }
-    newPoints = good_new;
-    // Check if we lost enough points and we need more
-    std::vector<cv::KeyPoint> keypoints;
-    if(newPoints.size() < lastRefreshPointCount - (lastRefreshPointCount / 4)) { // If we lost more than 25% of the points, add some more
-      lastRefreshPointCount = newPoints.size();
-      auto fastDetector = cv::FastFeatureDetector::create();
-       
-      fastDetector->detect(gray, keypoints); // detect points from "gray" image to keypoints vector
-
-      for(cv::KeyPoint p : keypoints) {
-        newPoints.push_back(p.pt);
-      }
+    // Build this frame's pyramid once; the last frame's is already built. The full-resolution level is copied rather than shared,
+    // so the frame may be reused once this returns.
+    oldPyramid.swap(newPyramid);
+    cv::Size winSize(windowSize, windowSize);
+    cv::buildOpticalFlowPyramid(*image, newPyramid, winSize, maxLevel, true, cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
 
-    }
+    oldPoints.swap(newPoints);
+    newPoints.clear();
+    trackedFrom.clear();
+    if(! oldPyramid.empty() && ! oldPoints.empty() && oldPyramid[0].size() == newPyramid[0].size()) {
+      // Update points on next frame
+      // https://docs.opencv.org/3.4/d4/dee/tutorial_optical_flow.html
+      cv::TermCriteria criteria = cv::TermCriteria((cv::TermCriteria::COUNT) + (cv::TermCriteria::EPS), 10, 0.03);
+      cv::calcOpticalFlowPyrLK(oldPyramid, newPyramid, oldPoints, newPoints, status, err, winSize, maxLevel, criteria);
 
-    // Roll-over data to next frame
-    cv::cvtColor(frame, old_gray, cv::COLOR_BGR2GRAY); // Update Grayscale image onto old_gray
-    
-    // deep-copy newPoints to oldPoints for next iteration
-    for (uint i = 0; i < newPoints.size(); ++i)  {
-      oldPoints[i] = cv::Point2f(newPoints[i].x, newPoints[i].y);
+      size_t kept = 0;
+      for(size_t i = 0; i < newPoints.size(); i++) {
+        // Select good points, compacting them in place
+        if(status[i] == 1) {
+          trackedFrom.push_back(oldPoints[i]);
+          newPoints[kept++] = newPoints[i];
+        }
+      }
+      newPoints.resize(kept);
     }
 
-
+    // Add points where they were lost (everywhere, on the first frame)
+    refill(*image);
   }
 
 
 };
-#endif
\ No newline at end of file
+#endif
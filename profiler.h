@@ -0,0 +1,239 @@
+#ifndef profiler_h
+#define profiler_h
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The pipeline stages that are timed. Keep profileStageNames in the same order.
+enum ProfileStage {
+  PROFILE_DECODE_WAIT, // Decoder waiting for room in the in-flight window
+  PROFILE_DECODE, // VideoCapture::read
+  PROFILE_PREFETCH_PUSH, // Decoder waiting for room in the prefetch ring
+  PROFILE_FRAME_WAIT, // Worker waiting for a decoded frame
+  PROFILE_GRAYSCALE,
+  PROFILE_MATCH_TEMPLATE, // cv::matchTemplate
+  PROFILE_MIN_MAX_LOC, // cv::minMaxLoc on the correlation scores
+  PROFILE_PHASE_CORRELATE,
+  PROFILE_PUBLISH, // Worker waiting to place its frame in the reorder buffer
+  PROFILE_RETIRE_WAIT, // Retire side waiting for the next frame in order
+  PROFILE_TRACK, // PointCloudTracker::update
+  PROFILE_CROP,
+  PROFILE_ENCODE_WAIT, // Retire side waiting for room in the encoder's queue
+  PROFILE_ENCODE, // VideoWriter::write
+  PROFILE_STAGE_COUNT
+};
+
+static const char* const profileStageNames[PROFILE_STAGE_COUNT] = {
+  "decode wait", "decode", "prefetch push", "frame wait", "grayscale", "matchTemplate", "minMaxLoc", "phaseCorrelate", "publish",
+  "retire wait", "track", "crop", "encode wait", "encode"
+};
+
+/* Times the pipeline stages, per thread, when enabled at runtime; always compiled in. Each thread records into its own log (a
+ histogram per stage, and optionally the individual events for a Chrome trace), so recording takes no locks. When disabled, timing a
+ stage costs one relaxed atomic load. Read the results (printHistograms, writeChromeTrace) only once the timed threads are done. */
+class Profiler {
+public:
+  // Durations are bucketed by their top three significant bits (a power of two, split into four), so percentiles come out within 25%
+  static const int bucketCount = 4 * 64;
+
+  static int getBucket(uint64_t nanos) {
+    if(nanos < 4) return nanos;
+    int exponent = 63 - __builtin_clzll(nanos);
+    return 4 * (exponent - 1) + ((nanos >> (exponent - 2)) & 3);
+  }
+
+  // The largest duration that falls in the bucket
+  static uint64_t getBucketLimit(int bucket) {
+    if(bucket < 4) return bucket;
+    int exponent = bucket / 4 + 1;
+    return ((uint64_t) (4 + bucket % 4 + 1) << (exponent - 2)) - 1;
+  }
+
+  struct Histogram {
+    uint64_t counts[bucketCount] = {};
+    uint64_t count = 0;
+    uint64_t totalNanos = 0;
+    uint64_t maxNanos = 0;
+
+    void add(uint64_t nanos) {
+      ++counts[getBucket(nanos)];
+      ++count;
+      totalNanos += nanos;
+      maxNanos = std::max(maxNanos, nanos);
+    }
+
+    void merge(const Histogram& other) {
+      for(int i = 0; i < bucketCount; ++i)
+        counts[i] += other.counts[i];
+      count += other.count;
+      totalNanos += other.totalNanos;
+      maxNanos = std::max(maxNanos, other.maxNanos);
+    }
+
+    // An upper bound on the fraction p of the durations
+    uint64_t getPercentile(double p) const {
+      uint64_t rank = std::max((uint64_t) (p * count + 0.5), (uint64_t) 1), seen = 0;
+      for(int i = 0; i < bucketCount; ++i) {
+        seen += counts[i];
+        if(seen >= rank)
+          return std::min(getBucketLimit(i), maxNanos);
+      }
+      return maxNanos;
+    }
+  };
+
+  struct Event {
+    int64_t start; // Nanoseconds since the profiler was enabled
+    int64_t duration;
+    int stage;
+  };
+
+  struct ThreadLog {
+    std::string name;
+    Histogram histograms[PROFILE_STAGE_COUNT];
+    std::vector<Event> events;
+    long droppedEvents = 0; // Events left out of the trace once maxEvents were recorded
+  };
+
+private:
+  inline static std::atomic<bool> enabled{false};
+  inline static bool tracing = false;
+  inline static size_t maxEvents = 0;
+  inline static std::chrono::steady_clock::time_point epoch;
+  inline static std::mutex logsMutex;
+  inline static std::vector<std::unique_ptr<ThreadLog>> logs;
+  inline static thread_local ThreadLog* threadLog = nullptr;
+
+  static ThreadLog* getThreadLog() {
+    if(! threadLog) {
+      std::scoped_lock lk(logsMutex);
+      logs.push_back(std::make_unique<ThreadLog>());
+      threadLog = logs.back().get();
+      threadLog->name = "thread";
+    }
+    return threadLog;
+  }
+
+public:
+  // Starts timing. With trace set, every event is also kept (up to maxEvents per thread) for writeChromeTrace.
+  static void enable(bool trace = false, size_t maxEvents = 1 << 20) {
+    epoch = std::chrono::steady_clock::now();
+    tracing = trace;
+    Profiler::maxEvents = maxEvents;
+    enabled.store(true, std::memory_order_release);
+  }
+
+  static void disable() {
+    enabled.store(false, std::memory_order_release);
+  }
+
+  static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+  }
+
+  // Names the calling thread's track in the trace ("worker", say). Does nothing when disabled.
+  static void nameThread(const std::string& name) {
+    if(isEnabled())
+      getThreadLog()->name = name;
+  }
+
+  // Records a stage that ran on the calling thread from start (see now()) until now
+  static void record(ProfileStage stage, int64_t start) {
+    int64_t duration = std::max(now() - start, (int64_t) 0);
+    ThreadLog* log = getThreadLog();
+    log->histograms[stage].add(duration);
+    if(tracing) {
+      if(log->events.size() < maxEvents)
+        log->events.push_back({start, duration, stage});
+      else
+        ++log->droppedEvents;
+    }
+  }
+
+  // The durations of one stage, over every thread
+  static Histogram getHistogram(ProfileStage stage) {
+    Histogram total;
+    std::scoped_lock lk(logsMutex);
+    for(const std::unique_ptr<ThreadLog>& log : logs)
+      total.merge(log->histograms[stage]);
+    return total;
+  }
+
+  // Prints a line per stage that ran: how often, for how long in total, and the mean, median, 90th and 99th percentile and maximum
+  // durations
+  static void printHistograms(std::ostream& out) {
+    char line[256];
+    snprintf(line, sizeof(line), "%-15s %9s %11s %9s %9s %9s %9s %9s\n", "stage", "count", "total_ms", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    out << line;
+    for(int stage = 0; stage < PROFILE_STAGE_COUNT; ++stage) {
+      Histogram h = getHistogram((ProfileStage) stage);
+      if(h.count == 0) continue;
+      snprintf(line, sizeof(line), "%-15s %9llu %11.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", profileStageNames[stage], (unsigned long long) h.count,
+               h.totalNanos / 1e6, h.totalNanos / 1e3 / h.count, h.getPercentile(0.5) / 1e3, h.getPercentile(0.9) / 1e3, h.getPercentile(0.99) / 1e3,
+               h.maxNanos / 1e3);
+      out << line;
+    }
+  }
+
+  // Writes the recorded events in Chrome's trace_event JSON format (load it in chrome://tracing or Perfetto), with one track per
+  // thread. Returns false if the file can't be written.
+  static bool writeChromeTrace(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if(! file)
+      return false;
+    std::scoped_lock lk(logsMutex);
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    bool first = true;
+    for(size_t tid = 0; tid < logs.size(); ++tid) {
+      const ThreadLog& log = *logs[tid];
+      fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s %zu\"}}", first ? "" : ",\n", tid, log.name.c_str(), tid);
+      first = false;
+      for(const Event& event : log.events)
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f}", profileStageNames[event.stage], tid, event.start / 1e3, event.duration / 1e3);
+    }
+    fputs("\n]}\n", file);
+    return fclose(file) == 0;
+  }
+
+  // Number of events left out of the trace because a thread recorded more than maxEvents
+  static long getDroppedEventCount() {
+    long dropped = 0;
+    std::scoped_lock lk(logsMutex);
+    for(const std::unique_ptr<ThreadLog>& log : logs)
+      dropped += log->droppedEvents;
+    return dropped;
+  }
+};
+
+/* Times a stage from construction until stop() or destruction, if profiling was enabled at construction. */
+class ProfileScope {
+private:
+  ProfileStage stage;
+  int64_t start; // -1 when not timing
+
+public:
+  ProfileScope(ProfileStage stage): stage(stage), start(Profiler::isEnabled() ? Profiler::now() : -1) {
+  }
+
+  ~ProfileScope() {
+    stop();
+  }
+
+  void stop() {
+    if(start >= 0)
+      Profiler::record(stage, start);
+    start = -1;
+  }
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef rawvideo_h
+#define rawvideo_h
+
+#include <opencv2/opencv.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Layouts of uncompressed frames on a stream, named as ffmpeg's -pix_fmt and -f options name them
+enum RawVideoFormat {
+  RAW_BGR24, // Packed 8-bit BGR, as OpenCV holds frames
+  RAW_YUV420P, // Planar 8-bit YUV with quarter-size chroma planes (I420)
+  RAW_Y4M // YUV4MPEG2: a text header with the size and frame rate, then "FRAME" lines each followed by a 4:2:0 (or gray) frame
+};
+
+// Parses "bgr24", "yuv420p" or "y4m". Returns false if the name is not one of them.
+static bool parseRawVideoFormat(const std::string& name, RawVideoFormat* format) {
+  if(name == "bgr24") *format = RAW_BGR24;
+  else if(name == "yuv420p") *format = RAW_YUV420P;
+  else if(name == "y4m") *format = RAW_Y4M;
+  else return false;
+  return true;
+}
+
+/* Reads uncompressed frames from a stream (stdin, typically fed by "ffmpeg ... -f rawvideo -" or "-f yuv4mpegpipe -"), as a
+ cv::VideoCapture, so that Stabilizer can decode from it like from a file. Frames come out as BGR.
+
+ A stream can't seek, but finding the reference image means reading up to the reference frame and then starting over from the first,
+ so the frames read are kept from the start of the stream until the first seek back, which replays them. Seeking forward reads and
+ discards frames. */
+class RawVideoReader : public cv::VideoCapture {
+private:
+  FILE* file;
+  RawVideoFormat format;
+  bool gray; // A Y4M stream of only the luma plane
+  cv::Size size;
+  double fps;
+  long position; // Index of the next frame read
+  cv::Mat raw; // Scratch for a frame before conversion to BGR
+  std::vector<cv::Mat> history; // Frames read from the start of the stream, while recording
+  bool recording;
+  size_t replayed; // Index within history of the next frame to replay
+
+  bool readLine(std::string& line) {
+    line.clear();
+    int c;
+    while((c = fgetc(file)) != EOF && c != '\n')
+      line += (char) c;
+    return c == '\n';
+  }
+
+  bool parseY4mHeader() {
+    std::string header;
+    if(! readLine(header) || header.compare(0, 10, "YUV4MPEG2 ") != 0)
+      return false;
+    size_t at = 9;
+    while(at < header.size()) {
+      size_t end = header.find(' ', at + 1);
+      std::string token = header.substr(at + 1, end == std::string::npos ? std::string::npos : end - at - 1);
+      at = end == std::string::npos ? header.size() : end;
+      if(token.empty()) continue;
+      if(token[0] == 'W') size.width = atoi(token.c_str() + 1);
+      else if(token[0] == 'H') size.height = atoi(token.c_str() + 1);
+      else if(token[0] == 'F') {
+        double num = 0, den = 1;
+        if(sscanf(token.c_str() + 1, "%lf:%lf", &num, &den) == 2 && den > 0)
+          fps = num / den;
+      } else if(token[0] == 'C') {
+        if(token == "C420" || token == "C420jpeg" || token == "C420paldv" || token == "C420mpeg2") // 8-bit 4:2:0, whatever the chroma siting
+          gray = false;
+        else if(token == "Cmono")
+          gray = true;
+        else {
+          fprintf(stderr, "Unsupported Y4M colour space %s; convert to 4:2:0 first (ffmpeg -pix_fmt yuv420p)\n", token.c_str());
+          return false;
+        }
+      }
+    }
+    return size.width > 0 && size.height > 0;
+  }
+
+  // Reads the next frame from the stream, as BGR, into image (reusing its buffer if it is the right size)
+  bool readFrame(cv::OutputArray image) {
+    if(format == RAW_Y4M) {
+      std::string line;
+      if(! readLine(line) || line.compare(0, 5, "FRAME") != 0)
+        return false;
+    }
+    if(format == RAW_BGR24) {
+      image.create(size, CV_8UC3);
+      cv::Mat frame = image.getMat();
+      for(int y = 0; y < size.height; ++y)
+        if(fread(frame.ptr(y), 3, size.width, file) != (size_t) size.width)
+          return false;
+      return true;
+    }
+    if(gray) {
+      raw.create(size, CV_8UC1);
+      if(fread(raw.data, 1, raw.total(), file) != raw.total())
+        return false;
+      cv::cvtColor(raw, image, cv::COLOR_GRAY2BGR);
+      return true;
+    }
+    raw.create(size.height * 3 / 2, size.width, CV_8UC1);
+    if(fread(raw.data, 1, raw.total(), file) != raw.total())
+      return false;
+    cv::cvtColor(raw, image, cv::COLOR_YUV2BGR_I420);
+    return true;
+  }
+
+public:
+  RawVideoReader() {
+    file = nullptr;
+    format = RAW_BGR24;
+    gray = false;
+    fps = 0;
+    position = 0;
+    recording = true;
+    replayed = 0;
+  }
+
+  ~RawVideoReader() {
+    release();
+  }
+
+  // Reads from file (which stays open on release). For Y4M, the size and frame rate come from the stream's header, and the given
+  // ones are ignored. Returns false if the format or size is unusable.
+  bool open(FILE* file, RawVideoFormat format, cv::Size size = cv::Size(), double fps = 30) {
+    release();
+    this->file = file;
+    this->format = format;
+    this->size = size;
+    this->fps = fps;
+    gray = false;
+    position = 0;
+    recording = true;
+    replayed = 0;
+    bool ok = format == RAW_Y4M ? parseY4mHeader() : size.width > 0 && size.height > 0;
+    if(ok && ! gray && format != RAW_BGR24 && (this->size.width % 2 != 0 || this->size.height % 2 != 0))
+      ok = false; // 4:2:0 needs even dimensions
+    if(! ok)
+      this->file = nullptr;
+    return ok;
+  }
+
+  bool isOpened() const override { return file != nullptr; }
+
+  void release() override {
+    file = nullptr;
+    history.clear();
+  }
+
+  bool read(cv::OutputArray image) override {
+    if(! file) {
+      image.release();
+      return false;
+    }
+    if(! recording && replayed < history.size()) {
+      history[replayed++].copyTo(image);
+      if(replayed == history.size())
+        history.clear(); // Done replaying
+      ++position;
+      return true;
+    }
+    if(! readFrame(image)) {
+      image.release();
+      return false;
+    }
+    if(recording)
+      history.push_back(image.getMat().clone());
+    ++position;
+    return true;
+  }
+
+  bool grab() override { return false; } // Frames are read whole; use read()
+
+  cv::VideoCapture& operator >> (cv::Mat& image) override {
+    read(image);
+    return *this;
+  }
+
+  using cv::VideoCapture::operator>>;
+
+  bool set(int propId, double value) override {
+    if(propId != cv::CAP_PROP_POS_FRAMES || ! file)
+      return false;
+    long index = (long) value;
+    if(index < position) { // Only possible by replaying the frames recorded since the start
+      if(! recording || index > (long) history.size())
+        return false;
+      recording = false;
+      replayed = index;
+      position = index;
+      if(replayed == history.size())
+        history.clear();
+      return true;
+    }
+    cv::Mat skipped;
+    while(position < index)
+      if(! read(skipped))
+        return false;
+    return true;
+  }
+
+  double get(int propId) const override {
+    switch(propId) {
+    case cv::CAP_PROP_FRAME_WIDTH: return size.width;
+    case cv::CAP_PROP_FRAME_HEIGHT: return size.height;
+    case cv::CAP_PROP_FPS: return fps;
+    case cv::CAP_PROP_POS_FRAMES: return position;
+    default: return 0; // The frame count and the codec are unknown
+    }
+  }
+};
+
+/* Writes frames to a stream (stdout, typically read by "ffmpeg -f rawvideo -pix_fmt ... -s WxH -i -" or "-f yuv4mpegpipe -i -") as
+ uncompressed BGR, I420, or Y4M, as a cv::VideoWriter. */
+class RawVideoWriter : public cv::VideoWriter {
+private:
+  FILE* file;
+  RawVideoFormat format;
+  cv::Size size;
+  cv::Mat yuv; // Scratch for the conversion to I420
+
+public:
+  RawVideoWriter() {
+    file = nullptr;
+    format = RAW_BGR24;
+  }
+
+  ~RawVideoWriter() {
+    release();
+  }
+
+  // Writes to file (which stays open on release). Returns false if the format can't hold frames of this size.
+  bool open(FILE* file, RawVideoFormat format, cv::Size size, double fps) {
+    release();
+    if(format != RAW_BGR24 && (size.width % 2 != 0 || size.height % 2 != 0))
+      return false; // 4:2:0 needs even dimensions
+    this->file = file;
+    this->format = format;
+    this->size = size;
+    if(format == RAW_Y4M) {
+      // Express the rate as a fraction; NTSC-style rates (29.97 and such) exactly
+      long num = lround(fps * 1000), den = 1000;
+      if(std::fabs(fps * 1.001 - std::round(fps * 1.001)) < 0.001) {
+        num = lround(fps * 1.001) * 1000;
+        den = 1001;
+      }
+      if(num <= 0) {
+        num = 30;
+        den = 1;
+      }
+      fprintf(file, "YUV4MPEG2 W%d H%d F%ld:%ld Ip A1:1 C420jpeg\n", size.width, size.height, num, den);
+    }
+    return true;
+  }
+
+  bool isOpened() const override { return file != nullptr; }
+
+  void release() override {
+    if(file)
+      fflush(file);
+    file = nullptr;
+  }
+
+  void write(cv::InputArray image) override {
+    if(! file) return;
+    cv::Mat frame = image.getMat();
+    if(format == RAW_BGR24) {
+      for(int y = 0; y < frame.rows; ++y)
+        fwrite(frame.ptr(y), frame.elemSize(), frame.cols, file);
+      return;
+    }
+    cv::cvtColor(frame, yuv, cv::COLOR_BGR2YUV_I420);
+    if(format == RAW_Y4M)
+      fputs("FRAME\n", file);
+    fwrite(yuv.data, 1, yuv.total(), file);
+  }
+};
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef reorderbuffer_h
+#define reorderbuffer_h
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+/* A fixed-capacity reorder buffer for items numbered consecutively (1, 2, 3, ...).
+ Any number of producers publish items in any order; each item goes directly into a preallocated ring slot indexed by its number,
+ so publishing is O(1) and never allocates. A single consumer retires the items strictly in order, and is only woken up when the
+ item it is waiting for lands (or when the buffer is closed).
+ A producer whose item is more than "capacity" ahead of the consumer waits until its slot has been retired; reserve() lets producers
+ do that wait before they produce the item at all, which bounds the number of items in flight to "capacity". */
+template <typename generic>
+class ReorderBuffer {
+private:
+  struct Slot {
+    std::atomic<long> number; // Number of the item currently published in this slot (stale numbers are simply never equal to the one wanted)
+    generic data;
+    std::condition_variable spaceNotify; // Notified when the item previously held here is retired while a producer waits for it
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  long capacity;
+  std::atomic<long> nextNumber; // Number of the next item the consumer will retire
+  std::atomic<int> spaceWaiters; // Number of producers waiting for their slot to free up (so the consumer can skip locking otherwise)
+  std::atomic<bool> closed; // Set once no more items will be published
+  std::atomic<long> queued; // Number of items published but not yet retired
+  std::atomic<long> peakQueued; // Highest value "queued" reached
+  std::atomic<long> peakInFlight; // Highest number of items reserved or published, but not yet retired
+  std::mutex mtx;
+  std::condition_variable readyNotify; // Notified only when the item numbered nextNumber is published, or on close()
+
+  inline Slot& slotFor(long number) {
+    return slots[number % capacity];
+  }
+
+  static inline void updatePeak(std::atomic<long>& peak, long value) {
+    long old = peak.load(std::memory_order_relaxed);
+    while(value > old && ! peak.compare_exchange_weak(old, value, std::memory_order_relaxed));
+  }
+
+  // Waits until number's slot is no longer held by an unretired item. Returns false if the buffer was closed first.
+  bool waitForSlot(Slot& slot, long number) {
+    if(number - nextNumber.load() >= capacity) {
+      std::unique_lock<std::mutex> lk(mtx);
+      spaceWaiters.fetch_add(1);
+      while(number - nextNumber.load() >= capacity && ! closed.load(std::memory_order_relaxed))
+        slot.spaceNotify.wait(lk);
+      spaceWaiters.fetch_sub(1);
+      if(number - nextNumber.load() >= capacity) return false; // Closed before the slot freed up
+    }
+    return true;
+  }
+
+public:
+  ReorderBuffer(long capacity = 1, long firstNumber = 1) {
+    reset(capacity, firstNumber);
+  }
+
+  /* Reallocates the ring and starts expecting firstNumber next. Not thread-safe; only call this while nothing is using the buffer. */
+  void reset(long capacity, long firstNumber = 1) {
+    this->capacity = capacity < 1 ? 1 : capacity;
+    slots = std::make_unique<Slot[]>(this->capacity);
+    for(long i = 0; i < this->capacity; ++i)
+      slots[i].number.store(firstNumber - 1, std::memory_order_relaxed); // Never equal to any number that can still be published
+    nextNumber.store(firstNumber, std::memory_order_relaxed);
+    spaceWaiters.store(0, std::memory_order_relaxed);
+    queued.store(0, std::memory_order_relaxed);
+    peakQueued.store(0, std::memory_order_relaxed);
+    peakInFlight.store(0, std::memory_order_relaxed);
+    closed.store(false, std::memory_order_release);
+  }
+
+  long getCapacity() { return capacity; }
+
+  /* Number of the next item to be retired. */
+  long getNextNumber() { return nextNumber.load(std::memory_order_acquire); }
+
+  /* Highest number of items that were published and waiting to be retired at once. */
+  long getPeakQueued() { return peakQueued.load(std::memory_order_relaxed); }
+
+  /* Highest number of items that were reserved (or published) and not yet retired at once. */
+  long getPeakInFlight() { return peakInFlight.load(std::memory_order_relaxed); }
+
+  /* Blocks until an item numbered "number" would fit in the ring, i.e. fewer than "capacity" items before it are unretired.
+   Call this before producing the item to apply backpressure. Returns false if the buffer was closed while waiting. */
+  bool reserve(long number) {
+    if(! waitForSlot(slotFor(number), number)) return false;
+    updatePeak(peakInFlight, number - nextNumber.load(std::memory_order_relaxed) + 1);
+    return true;
+  }
+
+  /* Moves item into the slot for its number. Blocks only if that slot is still held by an unretired item "capacity" numbers earlier.
+   Returns false (without publishing) if the buffer was closed while waiting. */
+  bool publish(long number, generic& item) {
+    Slot& slot = slotFor(number);
+    if(! waitForSlot(slot, number)) return false;
+    updatePeak(peakInFlight, number - nextNumber.load(std::memory_order_relaxed) + 1);
+    updatePeak(peakQueued, queued.fetch_add(1, std::memory_order_relaxed) + 1);
+    slot.data = std::move(item);
+    slot.number.store(number); // Sequentially consistent: pairs with the consumer's store to nextNumber, so one of the two sides sees the other
+    if(nextNumber.load() == number) { // Only wake the consumer when it is waiting on this exact item
+      std::scoped_lock lk(mtx);
+      readyNotify.notify_one();
+    }
+    return true;
+  }
+
+  /* Retires the next item in order into item, waiting for it if needed. Returns false once the buffer is closed and the next item
+   was never published. Only one thread may consume. */
+  bool pop(generic& item) {
+    long number = nextNumber.load(std::memory_order_relaxed);
+    Slot& slot = slotFor(number);
+    if(slot.number.load() != number) {
+      std::unique_lock<std::mutex> lk(mtx);
+      while(slot.number.load() != number) {
+        if(closed.load(std::memory_order_relaxed)) return false; // End of stream
+        readyNotify.wait(lk);
+      }
+    }
+    item = std::move(slot.data);
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    nextNumber.store(number + 1);
+    if(spaceWaiters.load() > 0) { // Somebody may be waiting for the slot just freed; only wake producers of that slot
+      std::scoped_lock lk(mtx);
+      slot.spaceNotify.notify_all();
+    }
+    return true;
+  }
+
+  /* Returns a pointer to the next item if it has already been published, or nullptr. Only call this from the consuming thread. */
+  generic* peek() {
+    long number = nextNumber.load(std::memory_order_relaxed);
+    Slot& slot = slotFor(number);
+    if(slot.number.load(std::memory_order_acquire) != number)
+      return nullptr;
+    return &slot.data;
+  }
+
+  /* Declares that no more items will be published. Wakes the consumer and any waiting producers. */
+  void close() {
+    std::scoped_lock lk(mtx);
+    closed.store(true, std::memory_order_release);
+    readyNotify.notify_all();
+    for(long i = 0; i < capacity; ++i)
+      slots[i].spaceNotify.notify_all();
+  }
+
+  bool isClosed() { return closed.load(std::memory_order_acquire); }
+};
+
+#endif
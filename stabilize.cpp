@@ -6,14 +6,25 @@
 #include <math.h>
 #include <thread>
 #include "stabilizer.h"
+#include "asyncwriter.h"
+#include "profiler.h"
+#include "rawvideo.h"
+#include "ffmpegwriter.h"
+#include "checkpoint.h"
+#include "workerpool.h"
+#include "framecache.h"
+#include "calibrator.h"
 #include <time.h>
+#include <chrono>
+#include <fstream>
+#include <map>
 
 #define RECTPOINTSIZE 15 // The size of the "knobs" for dragging the view and reference rectangles
 
 using namespace std;
 using namespace cv;
 
-
+#ifndef STABILIZE_HEADLESS
 void stabilize(VideoCapture& cap) {
   while(true) {
     Mat frame;
@@ -25,6 +36,7 @@ void stabilize(VideoCapture& cap) {
     waitKey(1);
   }
 }
+#endif
 
 // Takes the given variable, and updates it to the slider's position.
 //template <typename Integral>
@@ -149,25 +161,206 @@ void boolFlipMouseCallback(int event, int x, int y, int flags, void* data) {
   *b = !*b;
 }
 
-// Returns the rest of a string after the last [item] char (arguments as C-strings)
-string getAfterLast(char* inStr, char item) {
-  int dotPos = 0;
-  int i = 0;
-  while(inStr[i] != (char) 0) {
-    if(inStr[i] == item) // Find the last item
-      dotPos = i;
-    ++i;
+
+
+#ifndef STABILIZE_HEADLESS
+// Uses a very crude user interface to allow the user to select a reference (match) rectangle portion, and a view rectangle portion.
+// Returns once Enter is pressed, with cap positioned at the frame being displayed. Frames for the seek slider come from a FrameCache
+// of the video at path: the nearest thumbnail is shown at once, and replaced with the frame itself once that is decoded.
+void pickRectangles(cv::VideoCapture& cap, const string& path, unsigned long frameCount, RectFrameData* rectData) {
+  Mat frame;
+  cap >> frame;
+  //imshow("Video Output", frame);
+
+  rectData->viewRect = cv::Rect(cv::Point(frame.size().width / 3, frame.size().height / 3), cv::Point(frame.size().width / 2 - 5, frame.size().height * 2 / 3));
+  rectData->matchRect = cv::Rect(cv::Point(frame.size().width / 2 + 5, frame.size().height / 3), cv::Point(frame.size().width * 2 / 3, frame.size().height * 2 / 3));
+  rectData->selectedRect = nullptr;
+  rectData->selectedCorner = -1;
+  cv::Size frameSize = frame.size();
+  int seekPos = 0;
+  int frameIndex = 0; // Frame shown, which is the first one to begin with
+  bool frameExact = true; // Whether it is shown at full resolution, rather than scaled up from a thumbnail
+  int pollTime = 250;
+  FrameCache cache(path, frameCount);
+  std::pair<RectFrameData*, int*> mouseCallbackData(rectData, &pollTime);
+  setMouseCallback("Video Output", rectPairDrag_callback, (void*) &mouseCallbackData);
+  createTrackbar("Frame", "Video Output", nullptr, frameCount, slider_callback, &seekPos);
+  Mat drawOnFrame, cached, scaled;
+  RectFrameData drawn = *rectData; // What was last drawn, to only redraw when something changed
+  bool redraw = true;
+  while(true) { // Keep displaying the same frame; display a new one if the seek slider is changed.
+    int pos = min(seekPos, (int) (frameCount-1));
+    if(pos != frameIndex || ! frameExact) {
+      if(cache.hasFailed()) { // The cache can't read the video; seek in it directly instead
+        cap.set(CAP_PROP_POS_FRAMES, pos);
+        cap >> frame;
+        frameIndex = pos;
+        frameExact = true;
+        redraw = true;
+      } else {
+        cache.request(pos);
+        long cachedPos;
+        bool exact = cache.lookup(pos, cached, &cachedPos);
+        if(! cached.empty() && (cachedPos != frameIndex || exact != frameExact)) {
+          if(exact) {
+            frame = cached;
+          } else {
+            cv::resize(cached, scaled, frameSize, 0, 0, cv::INTER_LINEAR);
+            frame = scaled;
+          }
+          frameIndex = cachedPos;
+          frameExact = exact;
+          redraw = true;
+        }
+        if(! frameExact)
+          pollTime = min(pollTime, 20); // Check back soon for the frame itself
+      }
+    }
+    redraw = redraw || drawn.matchRect != rectData->matchRect || drawn.viewRect != rectData->viewRect || drawn.selectedRect != rectData->selectedRect
+      || drawn.selectedCorner != rectData->selectedCorner;
+
+    if(redraw) {
+      frame.copyTo(drawOnFrame);
+
+      // Draw rectangles
+      cv::Scalar mRectColor = cv::Scalar(255, 0, 0);
+      cv::Scalar vRectColor = cv::Scalar(0, 0, 255);
+
+      // Highlight the corner of the selected rectangle
+      int matchCorner = -1;
+      int viewCorner = -1;
+      if(rectData->selectedRect == &rectData->matchRect)
+        matchCorner = rectData->selectedCorner;
+      else if(rectData->selectedRect == &rectData->viewRect)
+        viewCorner = rectData->selectedCorner;
+      drawRect(&drawOnFrame, rectData->matchRect, &mRectColor, matchCorner, "Reference"); // Draw match rect
+      drawRect(&drawOnFrame, rectData->viewRect, &vRectColor, viewCorner, "View Window"); // Draw view rect
+
+      cv::imshow("Video Output", drawOnFrame);
+      drawn = *rectData;
+      redraw = false;
+    }
+    pollTime = min(1000, pollTime+3);
+    if(cv::waitKey(pollTime) == 13) break; // "Enter" key to continue
   }
-  return string(&inStr[dotPos]);
+  int pos = min(seekPos, (int) (frameCount-1));
+  if(! frameExact) { // Only a thumbnail was shown; show the frame itself behind the message
+    cap.set(CAP_PROP_POS_FRAMES, pos);
+    cap >> frame;
+  }
+  cap.set(CAP_PROP_POS_FRAMES, pos);
+  cv::putText(frame, "Processing... Click to toggle live video output", cv::Point(0,0), cv::FONT_HERSHEY_DUPLEX, 1.0, CV_RGB(0, 225, 0), 3);
+  cv::imshow("Video Output", frame);
 }
-
+#endif
 
 void show_help(string progName) {
-  cerr << "Usage: " << progName << " <Video File> <Output Video File> [--copy-audio, --motion-limit <n>]\n\n";
+  cerr << "Usage: " << progName << " <Video File> <Output Video File> [--copy-audio, --motion-limit <n>, --max-inflight <n>, --prefetch <n>, --write-queue <n>, --decoders <n>, --segment-frames <n>, --pyramid-levels <n>, --pyramid-min-score <s>, --search-radius <px>, --search-min-score <s>, --estimator <template|phase>, --phase-min-response <r>, --headless, --match-rect <x,y,w,h>, --view-rect <x,y,w,h>, --ref-frame <n>, --job <file>, --analyze, --trajectory <file>, --smoothing <none|average|gaussian|kalman>, --smoothing-window <n>, --kalman-noise <q>, --tracker, --no-tracker, --tracker-scale <s>, --tracker-every <n>, --profile, --trace <file>, --workers <n>, --cv-threads <n>, --pin-threads, --auto-tune, --auto-tune-frames <n>, --input-format <y4m|bgr24|yuv420p>, --input-size <WxH>, --input-fps <f>, --output-format <y4m|bgr24|yuv420p>, --checkpoint-every <n>, --resume, --stretch <x,y>, --calibrate]\n\n";
+  cerr << "   or: " << progName << " --jobs <Job List> [--concurrent-jobs <n>, --workers <n>, ...]\n\n";
   cerr << "When picking a view and reference image portion, click to toggle dragging each corner of the rectangles to position them accordingly. The \"View Window\" rectangle corresponds to the cropped portion of the frame you want to see in the final output, offset from the \"Reference\" rectangle, which the algorithm searches for in each video frame. Try picking differernt reference images to obtain better results.\n";
   cerr << "After picking a view and reference image portion, press Enter to begin stabilizing. While processing, you may click the screen to toggle faster updating of the video output (decreased performance).\n";
-  cerr << "--copy-audio: run the ffmpeg copy audio command when complete, rather than only displaying it. This must be specified after all positional parameters.\n";
-  cerr << "--motion-limit: prevent updating the frame if the euclidian distnace between the same point and the last frame is greater than n pixels. Helps to reduce frame blur and mispredicted frames.\n";
+  cerr << "Either file may be \"-\", to stream uncompressed frames through stdin or stdout instead, for example: ffmpeg -i in.mp4 -f yuv4mpegpipe - | " << progName << " - - --match-rect ... --view-rect ... | ffmpeg -f yuv4mpegpipe -i - -c:v libx264 out.mp4\n";
+  cerr << "--input-format: the format of frames on stdin: \"y4m\" (default; the size and frame rate come from its header), or headerless \"bgr24\" or \"yuv420p\", which need --input-size and --input-fps (default: 30).\n";
+  cerr << "--output-format: the format of frames on stdout: \"y4m\" (default), \"bgr24\" or \"yuv420p\". The 4:2:0 formats need an even view size.\n";
+  cerr << "--checkpoint-every: write the output in segments of n frames, keeping a checkpoint (<Output Video File>.checkpoint) after each one finished, and join them (without re-encoding, with ffmpeg) at the end (default with --resume: 1800).\n";
+  cerr << "--resume: continue a checkpointed run that was stopped, from its last checkpoint, keeping the segments already written; starts from the beginning if there is no checkpoint. Give the same rectangles and settings as before.\n";
+  cerr << "--jobs: stabilize every clip of a job list, one per line as input=<file> output=<file> match-rect=<x,y,w,h> view-rect=<x,y,w,h> [ref-frame=<n>], several at a time, matching all of their frames on one shared set of worker threads. Other flags apply to every clip. Prints a line as each job finishes, and totals at the end.\n";
+  cerr << "--concurrent-jobs: with --jobs, how many clips to stabilize at once (default: a quarter of the workers, at least 2).\n";
+  cerr << "--stretch: how far the view window is stretched along the motion between frames, horizontally and vertically, as a multiple of half of it (default: 0,0.25).\n";
+  cerr << "--calibrate: before stabilizing, tune --stretch on a few short runs of frames sampled from the video, minimizing how much tracked feature points jitter relative to each other in the output, and print what it found.\n";
+  cerr << "--copy-audio: encode the output through an ffmpeg child process that copies in the audio of the source video as it writes, in a single pass (needs ffmpeg installed). Without it, the output has no audio.\n";
+  cerr << "--motion-limit: leave match positions that jump more than n pixels from the last one out of the smoothing, as mispredicted frames, unless they stay there for longer than the smoothing window. Turns on gaussian smoothing unless --smoothing picks another method.\n";
+  cerr << "--smoothing: smooth the match positions over neighbouring frames before cropping, to remove jitter: \"none\" (default), \"average\", \"gaussian\" or \"kalman\" (a constant-velocity Kalman filter with backward smoothing).\n";
+  cerr << "--smoothing-window: the number of frames on either side of each one that smoothing uses (default: 15). Output is delayed by this many frames, which are held in memory meanwhile.\n";
+  cerr << "--kalman-noise: with --smoothing kalman, how much the motion may change between frames, relative to the matching noise; lower is smoother (default: 0.01).\n";
+  cerr << "--tracker, --no-tracker: track feature points across frames on a separate thread, for the points drawn on the live video output, and the tracked point counts in --analyze trajectories (default: on, except headless without --analyze). Stabilizing doesn't need it; when it falls behind, frames are skipped rather than waited for. --analyze instead tracks every frame, in order, so that each frame's count is its own.\n";
+  cerr << "--tracker-scale: track points on frames scaled by s (default: 0.5).\n";
+  cerr << "--tracker-every: only track every n-th frame (default: 2). --analyze tracks every frame regardless.\n";
+  cerr << "--profile: time each pipeline stage (decoding, matching, waiting on each queue, cropping, encoding...) and print a histogram of each at the end.\n";
+  cerr << "--trace: with or without --profile, also write every timed stage to a Chrome trace_event JSON file, with a track per thread (open it in chrome://tracing or https://ui.perfetto.dev).\n";
+  cerr << "--workers: the number of worker threads matching frames (default: one per core).\n";
+  cerr << "--cv-threads: the size of OpenCV's internal thread pool, which is shared by all the workers and parallelizes within each OpenCV call (default: 1, running OpenCV calls on the thread that makes them, as the workers already keep every core busy; 0 leaves it to OpenCV).\n";
+  cerr << "--pin-threads: pin each worker thread to its own core (Linux only).\n";
+  cerr << "--auto-tune: before stabilizing, time a few combinations of --workers and --cv-threads on the first frames of the video, and use the fastest. Overrides --workers and --cv-threads.\n";
+  cerr << "--auto-tune-frames: the number of frames each combination is timed on, after 15 warm-up frames that aren't (default: 100).\n";
+  cerr << "--max-inflight: the maximum number of decoded frames waiting to be written out at once (default: 4 per thread, plus a segment per decoder with --decoders, up to 120 frames each). Worker threads wait rather than decode more frames once it is reached, which bounds memory use when writing is slower than matching.\n";
+  cerr << "--prefetch: the number of frames the decode thread decodes ahead of the worker threads (default: 2 per thread).\n";
+  cerr << "--write-queue: the number of finished frames that may wait for the encoder thread (default: 8).\n";
+  cerr << "--decoders: decode with n threads, each with its own decoder, working on consecutive segments of the video that start on keyframes (found with a quick ffprobe prescan). Scales decoding of long H.264/HEVC files across cores, at the cost of holding up to a segment per decoder (at most 120 frames each) in memory; decoders of segments longer than that overlap only in part (default: 1, a single decoder).\n";
+  cerr << "--segment-frames: with --decoders, the minimum length of a segment, in frames; keyframe intervals are merged until they are at least this long (default: 60).\n";
+  cerr << "--pyramid-levels: find the reference in a frame downscaled n times by half first, then refine the match in a small window at each finer level (default: 0, search the whole full-resolution frame). Much faster on large frames with well-textured references.\n";
+  cerr << "--pyramid-min-score: pyramid matches with a correlation score below s (from -1 to 1) are redone as a full search (default: 0.5).\n";
+  cerr << "--search-radius: first search for the reference only within px pixels of where the surrounding frames predict it to be, and search wider only when that misses (default: 0, always search wider). Works well for fixed cameras, where the reference moves little between frames.\n";
+  cerr << "--search-min-score: search-window matches with a correlation score below s, or on the edge of the window, are redone with a wider search (default: 0.7).\n";
+  cerr << "--estimator: how to locate the reference in each frame. \"template\" (default) uses normalized cross-correlation template matching on the color frame; \"phase\" uses FFT phase correlation on grayscale, which scales better to large search areas.\n";
+  cerr << "--headless: skip the interactive picker and the live video output, taking the rectangles from --match-rect and --view-rect (or --job) instead, and print progress lines (\"progress frame=<n> total=<n> elapsed=<s> fps=<f>\", then \"done ...\") to stderr. Implied when both rectangles are given.\n";
+  cerr << "--match-rect, --view-rect: the reference and view rectangles, as x,y,width,height in pixels.\n";
+  cerr << "--ref-frame: the frame to take the reference image from when headless (default: 0).\n";
+  cerr << "--job: read settings from a file of \"name value\" lines, such as \"match-rect 640,300,96,64\"; accepts match-rect, view-rect and ref-frame. Flags on the command line take precedence.\n";
+  cerr << "--analyze: analysis pass only. Instead of a video, write each frame's match location, score and tracker stats to <Output Video File> as a trajectory file, matching on grayscale. No view rectangle is needed.\n";
+  cerr << "--trajectory: render from a trajectory file written by --analyze, only decoding, cropping and encoding, rather than matching again. The reference rectangle comes from the trajectory; only the view rectangle is picked.\n";
+  cerr << "--phase-min-response: with --estimator phase, search-window estimates with a peak response below r (from 0 to 1) are redone over the whole frame (default: 0.3).\n";
+}
+
+// Prints the stage timings, and writes the Chrome trace if traceFile is set, when profiling is on. Call once the pipeline has stopped.
+void reportProfile(const char* traceFile) {
+  if(! Profiler::isEnabled())
+    return;
+  Profiler::disable();
+  Profiler::printHistograms(cerr);
+  if(traceFile != NULL) {
+    if(Profiler::writeChromeTrace(traceFile))
+      cerr << "Wrote the stage trace to " << traceFile << (Profiler::getDroppedEventCount() > 0 ? " (truncated)" : "") << "\n";
+    else
+      cerr << "Could not write the stage trace to " << traceFile << "\n";
+  }
+}
+
+// Stabilizes the first frames of the video with each candidate thread budget in turn, and returns the fastest. Only the frames after
+// the first warmUpFrames of each run are timed, so that opening the video, starting the threads and filling the pipeline don't count;
+// the video is read through once before any candidate, so that the first one doesn't pay for a cold disk cache either.
+ThreadBudget tuneThreadBudget(const char* path, cv::Rect viewRect, cv::Point refPos, cv::Mat refImg, StabilizerOptions options, long frames, bool pin, long warmUpFrames = 15) {
+  options.tracker = false;
+  options.pinThreads = pin;
+  {
+    VideoCapture warmCap(path);
+    Mat frame;
+    for(long i = 0; i < warmUpFrames + frames; ++i)
+      if(! warmCap.read(frame)) break;
+  }
+  ThreadBudget best;
+  double bestFps = 0;
+  for(ThreadBudget candidate : ThreadBudget::getCandidates()) {
+    candidate.pin = pin;
+    candidate.apply();
+    VideoCapture trialCap(path);
+    if(! trialCap.isOpened())
+      break;
+    Stabilizer trial(&trialCap, viewRect, refPos, refImg, options);
+    trial.run(candidate.getWorkers());
+    Mat output;
+    long warmed = 0;
+    while(warmed < warmUpFrames) {
+      trial >> output;
+      if(output.empty()) break;
+      ++warmed;
+    }
+    auto start = chrono::steady_clock::now();
+    long done = 0;
+    while(warmed == warmUpFrames && done < frames) {
+      trial >> output;
+      if(output.empty()) break;
+      ++done;
+    }
+    double fps = done / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    trial.stop();
+    cerr << "auto-tune: " << candidate.describe() << ": " << fps << " fps\n";
+    if(fps > bestFps) {
+      bestFps = fps;
+      best = candidate;
+    }
+  }
+  return best;
 }
 
 // Returns whether the given flag is specified after the input and output file arguments
@@ -189,65 +382,449 @@ char* getFlagValue(const char arg[], int argc, char** argv) {
 }
 
 
+// Parses a rectangle given as "x,y,width,height". Returns false if it isn't in that form.
+bool parseRect(const char* str, cv::Rect& rect) {
+  char trailing;
+  return sscanf(str, "%d,%d,%d,%d%c", &rect.x, &rect.y, &rect.width, &rect.height, &trailing) == 4;
+}
+
+// Reads a job file of "name value" (or "name=value") lines into settings, where names are the long flags without their leading
+// dashes, such as "match-rect 640,300,96,64". Blank lines and lines starting with # are skipped. Returns false if it can't be opened.
+bool readJobFile(const char* path, map<string, string>& settings) {
+  ifstream in(path);
+  if(! in.is_open())
+    return false;
+  string line;
+  while(getline(in, line)) {
+    size_t start = line.find_first_not_of(" \t");
+    if(start == string::npos || line[start] == '#')
+      continue;
+    size_t split = line.find_first_of(" \t=", start);
+    if(split == string::npos)
+      continue;
+    size_t valueStart = line.find_first_not_of(" \t=", split);
+    size_t valueEnd = line.find_last_not_of(" \t\r");
+    if(valueStart == string::npos || valueEnd < valueStart)
+      continue;
+    settings[line.substr(start, split - start)] = line.substr(valueStart, valueEnd - valueStart + 1);
+  }
+  return true;
+}
+
+// Gets a setting from the "--name" flag if specified, else from the job file's settings. Else, returns NULL
+const char* getSetting(const char name[], int argc, char** argv, map<string, string>& job) {
+  char* value = getFlagValue(("--" + string(name)).c_str(), argc, argv);
+  if(value != NULL)
+    return value;
+  auto it = job.find(name);
+  if(it != job.end())
+    return it->second.c_str();
+  return NULL;
+}
+
+// Prints a machine-readable progress line to stderr, such as "progress frame=120 total=900 elapsed=4.02 fps=29.85"
+void printProgress(long frames, unsigned long total, chrono::steady_clock::time_point start, long firstFrame = 0) {
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  cerr << "progress frame=" << frames << " total=" << total << " elapsed=" << elapsed << " fps=" << (frames - firstFrame) / elapsed << "\n";
+}
+
+// Name of output segment "index" of a checkpointed render: out.mp4's segments are out.part00000.mp4, out.part00001.mp4, and so on
+string getSegmentPath(const string& outfile, long index) {
+  size_t dot = outfile.find_last_of('.');
+  if(dot == string::npos || (outfile.find_last_of('/') != string::npos && dot < outfile.find_last_of('/')))
+    dot = outfile.size();
+  char part[32];
+  snprintf(part, sizeof(part), ".part%05ld", index);
+  return outfile.substr(0, dot) + part + outfile.substr(dot);
+}
+
+// Joins the segments of a checkpointed render into outfile with ffmpeg's concat demuxer, without re-encoding them, also copying in
+// the audio of source if copyAudio. Removes the segments and the list of them once joined. Returns false if ffmpeg failed.
+bool joinSegments(const string& outfile, long segments, const string& source, bool copyAudio) {
+  if(segments == 1 && ! copyAudio) // Nothing to join
+    return rename(getSegmentPath(outfile, 0).c_str(), outfile.c_str()) == 0;
+  string listPath = outfile + ".parts.txt";
+  ofstream list(listPath);
+  for(long i = 0; i < segments; ++i) {
+    string path = getSegmentPath(outfile, i);
+    list << "file '" << path.substr(path.find_last_of('/') + 1) << "'\n"; // Relative to the list, which is in the same directory
+  }
+  list.close();
+  string cmd = "ffmpeg -y -v error -f concat -safe 0 -i \"" + listPath + "\"";
+  if(copyAudio)
+    cmd += " -i \"" + source + "\" -map 0:v:0 -map 1:a:0?";
+  cmd += " -c copy \"" + outfile + "\"";
+  cerr << "Joining " << segments << " segments: " << cmd << "\n";
+  if(system(cmd.c_str()) != 0)
+    return false;
+  for(long i = 0; i < segments; ++i)
+    remove(getSegmentPath(outfile, i).c_str());
+  remove(listPath.c_str());
+  return true;
+}
+
+// Reads the matching and smoothing settings given on the command line into options
+void readStabilizerOptions(int argc, char** argv, StabilizerOptions& options) {
+  char* inflightArg = getFlagValue("--max-inflight", argc, argv);
+  if(inflightArg != NULL)
+    options.maxInFlight = stoi(inflightArg);
+  char* prefetchArg = getFlagValue("--prefetch", argc, argv);
+  if(prefetchArg != NULL)
+    options.prefetchFrames = stoi(prefetchArg);
+  char* levelsArg = getFlagValue("--pyramid-levels", argc, argv);
+  if(levelsArg != NULL)
+    options.pyramidLevels = stoi(levelsArg);
+  char* minScoreArg = getFlagValue("--pyramid-min-score", argc, argv);
+  if(minScoreArg != NULL)
+    options.pyramidMinScore = stod(minScoreArg);
+  char* estimatorArg = getFlagValue("--estimator", argc, argv);
+  if(estimatorArg != NULL)
+    options.estimator = estimatorArg;
+  char* responseArg = getFlagValue("--phase-min-response", argc, argv);
+  if(responseArg != NULL)
+    options.phaseMinResponse = stod(responseArg);
+  char* radiusArg = getFlagValue("--search-radius", argc, argv);
+  if(radiusArg != NULL)
+    options.searchRadius = stoi(radiusArg);
+  char* windowScoreArg = getFlagValue("--search-min-score", argc, argv);
+  if(windowScoreArg != NULL)
+    options.searchMinScore = stod(windowScoreArg);
+  char* distArg = getFlagValue("--motion-limit", argc, argv);
+  if(distArg != NULL) {
+    options.motionLimit = stod(distArg);
+    options.smoothing = "gaussian"; // Mismatches are left out of the smoothing, so some is needed
+  }
+  char* smoothingArg = getFlagValue("--smoothing", argc, argv);
+  TrajectorySmoother::Method smoothingMethod;
+  if(smoothingArg != NULL) {
+    if(! TrajectorySmoother::parseMethod(smoothingArg, &smoothingMethod)) {
+      cerr << "Unknown smoothing method \"" << smoothingArg << "\"\n";
+      exit(1);
+    }
+    options.smoothing = smoothingArg;
+  }
+  char* smoothingWindowArg = getFlagValue("--smoothing-window", argc, argv);
+  if(smoothingWindowArg != NULL)
+    options.smoothingWindow = stoi(smoothingWindowArg);
+  char* kalmanNoiseArg = getFlagValue("--kalman-noise", argc, argv);
+  if(kalmanNoiseArg != NULL)
+    options.kalmanProcessNoise = stod(kalmanNoiseArg);
+  char* stretchArg = getFlagValue("--stretch", argc, argv);
+  char trailing;
+  if(stretchArg != NULL && sscanf(stretchArg, "%lf,%lf%c", &options.stretchX, &options.stretchY, &trailing) != 2) {
+    cerr << "--stretch takes the horizontal and vertical stretch as x,y\n";
+    exit(1);
+  }
+}
+
+// One clip of a job list
+struct ListedJob {
+  string input;
+  string output;
+  cv::Rect matchRect;
+  cv::Rect viewRect;
+  long refFrame = 0;
+};
+
+// Reads a job list: one clip per line, as "name=value" settings separated by spaces, named as in a job file: input, output,
+// match-rect, view-rect, and optionally ref-frame. Blank lines and lines starting with # are skipped. Says what is wrong and returns
+// false if the list can't be read, or a line is incomplete.
+bool readJobList(const char* path, vector<ListedJob>& jobs) {
+  ifstream in(path);
+  if(! in.is_open()) {
+    cerr << "Could not read job list " << path << "\n";
+    return false;
+  }
+  string line;
+  for(int lineNumber = 1; getline(in, line); ++lineNumber) {
+    istringstream words(line);
+    string word;
+    map<string, string> settings;
+    while(words >> word && word[0] != '#') {
+      size_t split = word.find('=');
+      if(split != string::npos)
+        settings[word.substr(0, split)] = word.substr(split + 1);
+    }
+    if(settings.empty())
+      continue;
+    ListedJob job;
+    job.input = settings["input"];
+    job.output = settings["output"];
+    if(job.input.empty() || job.output.empty() || ! parseRect(settings["match-rect"].c_str(), job.matchRect) || ! parseRect(settings["view-rect"].c_str(), job.viewRect)) {
+      cerr << path << ":" << lineNumber << ": each job needs input=, output=, match-rect=x,y,w,h and view-rect=x,y,w,h\n";
+      return false;
+    }
+    if(settings.count("ref-frame"))
+      job.refFrame = stol(settings["ref-frame"]);
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+// How one job of a job list went
+struct JobResult {
+  bool ok = false;
+  long frames = 0;
+  double seconds = 0;
+  string error;
+};
+
+// Stabilizes one clip of a job list, matching on the shared pool. Counts each frame written into framesDone as it goes.
+JobResult runListedJob(const ListedJob& job, StabilizerOptions options, WorkerPool& pool, int writeQueueFrames, bool copyAudio, atomic<long>* framesDone) {
+  JobResult result;
+  auto start = chrono::steady_clock::now();
+  cv::VideoCapture cap(job.input);
+  if(! cap.isOpened()) {
+    result.error = "could not open " + job.input;
+    return result;
+  }
+  cv::Size frameSize(cap.get(CAP_PROP_FRAME_WIDTH), cap.get(CAP_PROP_FRAME_HEIGHT));
+  cv::Rect frameRect(cv::Point(0, 0), frameSize);
+  if((job.matchRect & frameRect) != job.matchRect || (job.viewRect & frameRect) != job.viewRect || job.matchRect.empty() || job.viewRect.empty()) {
+    result.error = "the rectangles must lie within the " + to_string(frameSize.width) + "x" + to_string(frameSize.height) + " frame";
+    return result;
+  }
+  Mat frame;
+  cap.set(CAP_PROP_POS_FRAMES, job.refFrame);
+  cap >> frame;
+  if(frame.empty()) {
+    result.error = "could not read reference frame " + to_string(job.refFrame);
+    return result;
+  }
+  Mat refImg = frame(job.matchRect).clone();
+  cap.set(CAP_PROP_POS_FRAMES, 0);
+
+  int fourcc = cap.get(CAP_PROP_FOURCC);
+  double fps = cap.get(CAP_PROP_FPS);
+  cv::Ptr<cv::VideoWriter> writer;
+  cv::Ptr<FfmpegVideoWriter> muxer;
+  if(copyAudio) {
+    muxer = cv::makePtr<FfmpegVideoWriter>();
+    muxer->open(job.output, job.input, FfmpegVideoWriter::getEncoderOptions(fourcc), job.viewRect.size(), fps > 0 ? fps : 30);
+    writer = muxer;
+  } else {
+    writer = cv::makePtr<cv::VideoWriter>(job.output, cv::VideoWriter::fourcc(fourcc & 255, (fourcc >> 8) & 255, (fourcc >> 16) & 255, (fourcc >> 24) & 255), fps, job.viewRect.size(), true);
+  }
+  if(! writer->isOpened()) {
+    result.error = "could not write " + job.output;
+    return result;
+  }
+  AsyncVideoWriter output(writer, writeQueueFrames);
+  output.set(cv::VIDEOWRITER_PROP_QUALITY, 100);
+  cv::Rect viewRect = job.viewRect;
+  cv::Point refPos(job.matchRect.x, job.matchRect.y);
+  Stabilizer stabilizer(&cap, viewRect, refPos, refImg, options);
+  stabilizer.run(pool);
+  while(true) {
+    stabilizer >> frame;
+    if(frame.empty()) break;
+    output.write(frame);
+    ++result.frames;
+    framesDone->fetch_add(1, memory_order_relaxed);
+  }
+  output.release();
+  stabilizer.stop();
+  if(muxer && muxer->getExitStatus() != 0) {
+    result.error = "ffmpeg failed writing " + job.output;
+    return result;
+  }
+  result.ok = true;
+  result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+// Runs every clip of a job list, several at once, with all of their frames matched on one shared pool of worker threads. Each clip
+// still has its own decoder, retire loop and encoder. Returns the exit status: 1 if any job failed.
+int runJobList(const char* listPath, int argc, char** argv) {
+  vector<ListedJob> jobs;
+  if(! readJobList(listPath, jobs))
+    return 1;
+  StabilizerOptions options;
+  readStabilizerOptions(argc, argv, options);
+  if(! isKnownEstimator(options.estimator)) {
+    cerr << "Unknown estimator \"" << options.estimator << "\"\n";
+    return 1;
+  }
+  options.tracker = false;
+  char* writeQueueArg = getFlagValue("--write-queue", argc, argv);
+  int writeQueueFrames = writeQueueArg != NULL ? stoi(writeQueueArg) : 8;
+  options.outputBuffers = writeQueueFrames + 3;
+  bool copyAudio = containsFlagArg("--copy-audio", argc, argv);
+  if(copyAudio && ! FfmpegVideoWriter::isAvailable()) {
+    cerr << "--copy-audio needs ffmpeg, which could not be run\n";
+    return 1;
+  }
+  ThreadBudget budget;
+  budget.pin = containsFlagArg("--pin-threads", argc, argv);
+  char* workersArg = getFlagValue("--workers", argc, argv);
+  if(workersArg != NULL)
+    budget.workers = stoi(workersArg);
+  char* cvThreadsArg = getFlagValue("--cv-threads", argc, argv);
+  if(cvThreadsArg != NULL)
+    budget.cvThreads = stoi(cvThreadsArg);
+  budget.apply();
+  // A job's decoder rarely keeps more than a few workers busy, so by default there are enough jobs at once for the decoders between
+  // them to keep every worker busy
+  char* concurrentArg = getFlagValue("--concurrent-jobs", argc, argv);
+  int concurrent = concurrentArg != NULL ? stoi(concurrentArg) : max(2, budget.getWorkers() / 4);
+  concurrent = max(1, min(concurrent, (int) jobs.size()));
+  // Each job only gets its share of the workers, so it needs no more frames in flight than its share keeps busy
+  int share = max(budget.getWorkers() / concurrent, 1);
+  if(options.maxInFlight == 0)
+    options.maxInFlight = 4 * share + 4;
+  if(options.prefetchFrames == 0)
+    options.prefetchFrames = 2 * share + 2;
+  cerr << "Threads: " << budget.describe() << ", shared by " << concurrent << " jobs at a time, of " << jobs.size() << "\n";
+  char* traceArg = getFlagValue("--trace", argc, argv);
+  if(traceArg != NULL || containsFlagArg("--profile", argc, argv))
+    Profiler::enable(traceArg != NULL);
+
+  vector<JobResult> results(jobs.size());
+  atomic<long> framesDone(0);
+  atomic<size_t> nextJob(0);
+  atomic<int> runnersLeft(concurrent);
+  auto startTime = chrono::steady_clock::now();
+  {
+    WorkerPool pool(budget.getWorkers(), budget.pin);
+    vector<thread> runners;
+    for(int i = 0; i < concurrent; ++i) {
+      runners.emplace_back([&]() {
+        Profiler::nameThread("job");
+        for(size_t j = nextJob.fetch_add(1); j < jobs.size(); j = nextJob.fetch_add(1)) {
+          results[j] = runListedJob(jobs[j], options, pool, writeQueueFrames, copyAudio, &framesDone);
+          if(results[j].ok)
+            cerr << "job " << j + 1 << " done: " << jobs[j].output << " frames=" << results[j].frames << " elapsed=" << results[j].seconds << " fps=" << results[j].frames / max(results[j].seconds, 1e-9) << "\n";
+          else
+            cerr << "job " << j + 1 << " failed: " << jobs[j].input << ": " << results[j].error << "\n";
+        }
+        runnersLeft.fetch_sub(1);
+      });
+    }
+    time_t oldTime = time(NULL);
+    while(runnersLeft.load() > 0) {
+      this_thread::sleep_for(chrono::milliseconds(100));
+      if(time(NULL) - oldTime >= 1) {
+        oldTime = time(NULL);
+        size_t started = min(nextJob.load(), jobs.size());
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+        cerr << "progress jobs=" << started << "/" << jobs.size() << " frames=" << framesDone.load() << " elapsed=" << elapsed << " fps=" << framesDone.load() / elapsed << "\n";
+      }
+    }
+    for(thread& t : runners)
+      t.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+    int failed = 0;
+    for(const JobResult& result : results)
+      failed += result.ok ? 0 : 1;
+    cerr << "done jobs=" << jobs.size() << " failed=" << failed << " frames=" << framesDone.load() << " elapsed=" << elapsed << " fps=" << framesDone.load() / elapsed
+         << " worker_idle=" << 100 * pool.getIdleSeconds() / (elapsed * pool.getSize()) << "%\n";
+    reportProfile(traceArg);
+    return failed > 0 ? 1 : 0;
+  }
+}
+
+// Opens the input video: the file named by the first argument, or with "-", uncompressed frames from stdin in the --input-format
+// given (y4m by default)
+cv::Ptr<cv::VideoCapture> openInput(int argc, char** argv) {
+  if(string(argv[1]) != "-")
+    return cv::makePtr<cv::VideoCapture>(argv[1]);
+  RawVideoFormat format = RAW_Y4M;
+  char* formatArg = getFlagValue("--input-format", argc, argv);
+  if(formatArg != NULL && ! parseRawVideoFormat(formatArg, &format)) {
+    cerr << "Unknown --input-format " << formatArg << "\n";
+    exit(1);
+  }
+  cv::Size size;
+  char* sizeArg = getFlagValue("--input-size", argc, argv);
+  if(sizeArg != NULL && sscanf(sizeArg, "%dx%d", &size.width, &size.height) != 2) {
+    cerr << "--input-size must be WIDTHxHEIGHT\n";
+    exit(1);
+  }
+  char* fpsArg = getFlagValue("--input-fps", argc, argv);
+  cv::Ptr<RawVideoReader> reader = cv::makePtr<RawVideoReader>();
+  if(! reader->open(stdin, format, size, fpsArg != NULL ? stod(fpsArg) : 30)) {
+    if(format == RAW_Y4M)
+      cerr << "Could not read a YUV4MPEG2 header from stdin\n";
+    else
+      cerr << "Raw input on stdin needs --input-size WIDTHxHEIGHT (even, for yuv420p)\n";
+    exit(1);
+  }
+  return reader;
+}
+
 // First, use a very crude user interface to allow the user to select a reference (match) rectangle portion, and a view rectangle portion.
 int main(int argc, char** argv) {
+  if(argc > 2 && string(argv[1]) == "--jobs")
+    exit(runJobList(argv[2], argc, argv));
   if(argc <= 2) {
     show_help(argv[0]);
     exit(0);
   }
-  cv::VideoCapture cap(argv[1]);
+  cv::Ptr<cv::VideoCapture> capture = openInput(argc, argv);
+  cv::VideoCapture& cap = *capture;
   unsigned long frameCount = cap.get(CAP_PROP_FRAME_COUNT);
+  bool fromStdin = string(argv[1]) == "-";
+  bool toStdout = string(argv[2]) == "-";
+  bool copyAudio = containsFlagArg("--copy-audio", argc, argv);
+  if(copyAudio && (fromStdin || toStdout)) {
+    cerr << "Ignoring --copy-audio: audio is up to whatever produces or consumes the streamed frames\n";
+    copyAudio = false;
+  }
   
+  // --- Pick the reference and view rectangles: from the command line or a job file when headless, otherwise interactively ---
   RectFrameData rectData;
-  {
-    Mat frame;
-    cap >> frame;
-    //imshow("Video Output", frame);
-
-    rectData.viewRect = cv::Rect(cv::Point(frame.size().width / 3, frame.size().height / 3), cv::Point(frame.size().width / 2 - 5, frame.size().height * 2 / 3));
-    rectData.matchRect = cv::Rect(cv::Point(frame.size().width / 2 + 5, frame.size().height / 3), cv::Point(frame.size().width * 2 / 3, frame.size().height * 2 / 3));
-    rectData.selectedRect = nullptr;
-    rectData.selectedCorner = -1;
-    int seekPos = 0;
-    int frameIndex = 1;
-    int pollTime = 250;
-    cv::Mat refImg;
-    while(true) { // Keep displaying the same frame; display a new one if the seek slider is changed.
-      if(frameIndex != seekPos) {
-        //cout << "Update to " << seekPos << "\n";
-        frameIndex = seekPos;
-        auto pos = min(seekPos, (int) (frameCount-1));
-        cap.set(CAP_PROP_POS_FRAMES, pos);
-        cap >> frame;
-        cap.set(CAP_PROP_POS_FRAMES, pos); // Rewind that frame again
-      }
-      
-      std::pair<RectFrameData*, int*> mouseCallbackData(&rectData, &pollTime);
-      setMouseCallback("Video Output", rectPairDrag_callback, (void*) &mouseCallbackData);
-      createTrackbar("Frame", "Video Output", nullptr, frameCount, slider_callback, &seekPos);
-      Mat drawOnFrame;
-      frame.copyTo(drawOnFrame);
-
-      // Draw rectangles
-      cv::Scalar mRectColor = cv::Scalar(255, 0, 0);
-      cv::Scalar vRectColor = cv::Scalar(0, 0, 255);
-      
-      // Highlight the corner of the selected rectangle
-      int matchCorner = -1;
-      int viewCorner = -1;
-      if(rectData.selectedRect == &rectData.matchRect)
-        matchCorner = rectData.selectedCorner;
-      else if(rectData.selectedRect == &rectData.viewRect)
-        viewCorner = rectData.selectedCorner;
-      drawRect(&drawOnFrame, rectData.matchRect, &mRectColor, matchCorner, "Reference"); // Draw match rect
-      drawRect(&drawOnFrame, rectData.viewRect, &vRectColor, viewCorner, "View Window"); // Draw view rect
-     
-      cv::imshow("Video Output", drawOnFrame);
-      pollTime = min(1000, pollTime+3);
-      if(cv::waitKey(pollTime) == 13) break; // "Enter" key to continue
+  rectData.selectedRect = nullptr;
+  rectData.selectedCorner = -1;
+  map<string, string> job;
+  char* jobArg = getFlagValue("--job", argc, argv);
+  if(jobArg != NULL && ! readJobFile(jobArg, job)) {
+    cerr << "Could not read job file " << jobArg << "\n";
+    exit(1);
+  }
+  const char* matchRectArg = getSetting("match-rect", argc, argv, job);
+  const char* viewRectArg = getSetting("view-rect", argc, argv, job);
+  const char* refFrameArg = getSetting("ref-frame", argc, argv, job);
+  bool analyze = containsFlagArg("--analyze", argc, argv);
+  TrajectoryReader trajectory;
+  char* trajectoryArg = getFlagValue("--trajectory", argc, argv);
+  if(trajectoryArg != NULL) {
+    if(! trajectory.open(trajectoryArg)) {
+      cerr << "Could not read trajectory file " << trajectoryArg << "\n";
+      exit(1);
     }
-    cv::putText(frame, "Processing... Click to toggle live video output", cv::Point(0,0), cv::FONT_HERSHEY_DUPLEX, 1.0, CV_RGB(0, 225, 0), 3);
-    cv::imshow("Video Output", frame);
+    const TrajectoryHeader& header = trajectory.getHeader();
+    rectData.matchRect = cv::Rect(header.refX, header.refY, header.refWidth, header.refHeight); // The trajectory is relative to its reference
+  }
+#ifdef STABILIZE_HEADLESS
+  bool headless = true; // Built without HighGUI
+#else
+  bool headless = fromStdin || containsFlagArg("--headless", argc, argv) || ((matchRectArg != NULL || trajectory.isOpened()) && viewRectArg != NULL);
+#endif
+  if(headless) {
+    cv::Size frameSize(cap.get(CAP_PROP_FRAME_WIDTH), cap.get(CAP_PROP_FRAME_HEIGHT));
+    cv::Rect frameRect(cv::Point(0, 0), frameSize);
+    if(! trajectory.isOpened() && (matchRectArg == NULL || ! parseRect(matchRectArg, rectData.matchRect))) {
+      cerr << "Running headless requires --match-rect (or --trajectory), as x,y,width,height\n";
+      exit(1);
+    }
+    if(! analyze && (viewRectArg == NULL || ! parseRect(viewRectArg, rectData.viewRect))) {
+      cerr << "Running headless requires --view-rect, as x,y,width,height\n";
+      exit(1);
+    }
+    if(analyze) // Nothing is cropped, so any view rectangle will do
+      rectData.viewRect = rectData.matchRect;
+    if((rectData.matchRect & frameRect) != rectData.matchRect || (rectData.viewRect & frameRect) != rectData.viewRect || rectData.matchRect.empty() || rectData.viewRect.empty()) {
+      cerr << "The reference and view rectangles must lie within the " << frameSize.width << "x" << frameSize.height << " frame\n";
+      exit(1);
+    }
+    cap.set(CAP_PROP_POS_FRAMES, refFrameArg != NULL ? stoi(refFrameArg) : 0);
+  } else {
+#ifndef STABILIZE_HEADLESS
+    cv::Rect analyzedRect = rectData.matchRect;
+    pickRectangles(cap, argv[1], frameCount, &rectData);
+    if(trajectory.isOpened())
+      rectData.matchRect = analyzedRect;
+#endif
   }
   
   // --- Done picking reference and view frames via highGui ---
@@ -263,13 +840,158 @@ int main(int argc, char** argv) {
   {
     const char* outfile = argv[2];
     cv::Point refPos = cv::Point(rectData.matchRect.x, rectData.matchRect.y);
-    Stabilizer stabilizer(&cap, rectData.viewRect, refPos, refImg);
-    stabilizer.run(std::thread::hardware_concurrency());
+    StabilizerOptions options;
+    readStabilizerOptions(argc, argv, options);
+    if(! isKnownEstimator(options.estimator)) {
+      cerr << "Unknown estimator \"" << options.estimator << "\"\n";
+      exit(1);
+    }
+    options.grayscale = analyze; // Colour is only needed for the cropped output
+    options.tracker = (! headless || analyze || containsFlagArg("--tracker", argc, argv)) && ! containsFlagArg("--no-tracker", argc, argv);
+    char* trackerScaleArg = getFlagValue("--tracker-scale", argc, argv);
+    if(trackerScaleArg != NULL)
+      options.trackerScale = stod(trackerScaleArg);
+    char* trackerEveryArg = getFlagValue("--tracker-every", argc, argv);
+    if(trackerEveryArg != NULL)
+      options.trackerDecimation = stoi(trackerEveryArg);
+    char* writeQueueArg = getFlagValue("--write-queue", argc, argv);
+    int writeQueueFrames = writeQueueArg != NULL ? stoi(writeQueueArg) : 8;
+    options.outputBuffers = writeQueueFrames + 3; // The queue, plus the frame being encoded, the one held here, and the next one being cropped
+    ThreadBudget budget;
+    budget.pin = containsFlagArg("--pin-threads", argc, argv);
+    if(containsFlagArg("--auto-tune", argc, argv) && fromStdin) {
+      cerr << "Ignoring --auto-tune: stdin can't be read more than once\n";
+    } else if(containsFlagArg("--auto-tune", argc, argv)) {
+      char* tuneFramesArg = getFlagValue("--auto-tune-frames", argc, argv);
+      budget = tuneThreadBudget(argv[1], rectData.viewRect, refPos, refImg, options, tuneFramesArg != NULL ? stol(tuneFramesArg) : 100, budget.pin);
+    } else {
+      char* workersArg = getFlagValue("--workers", argc, argv);
+      if(workersArg != NULL)
+        budget.workers = stoi(workersArg);
+      char* cvThreadsArg = getFlagValue("--cv-threads", argc, argv);
+      if(cvThreadsArg != NULL)
+        budget.cvThreads = stoi(cvThreadsArg);
+    }
+    budget.apply();
+    options.pinThreads = budget.pin;
+    cerr << "Threads: " << budget.describe() << "\n";
+    if(containsFlagArg("--calibrate", argc, argv) && (analyze || fromStdin)) {
+      cerr << "Ignoring --calibrate: it needs a video file to sample, and a view to crop\n";
+    } else if(containsFlagArg("--calibrate", argc, argv)) {
+      auto calibrationStart = chrono::steady_clock::now();
+      Calibrator calibrator(&cap, refImg, refPos, rectData.viewRect, options);
+      calibrator.threads = budget.getWorkers();
+      if(calibrator.calibrate()) {
+        options.stretchX = calibrator.stretchX;
+        options.stretchY = calibrator.stretchY;
+        cerr << "Calibrated: --stretch " << options.stretchX << "," << options.stretchY << " (jitter " << calibrator.initialLoss << " -> " << calibrator.loss
+             << ", " << calibrator.evaluations << " candidates in " << chrono::duration<double>(chrono::steady_clock::now() - calibrationStart).count() << "s)\n";
+      } else {
+        cerr << "Could not calibrate: no frames could be sampled; keeping --stretch " << options.stretchX << "," << options.stretchY << "\n";
+      }
+    }
+    // With checkpoints, the output is written in segments, and a checkpoint is kept after the last one finished, to --resume from
+    string checkpointPath = string(outfile) + ".checkpoint";
+    char* checkpointArg = getFlagValue("--checkpoint-every", argc, argv);
+    Checkpoint resumePoint;
+    bool resuming = false;
+    if((checkpointArg != NULL || containsFlagArg("--resume", argc, argv)) && (analyze || fromStdin || toStdout)) {
+      cerr << "Ignoring --checkpoint-every and --resume: only rendering to a file can be checkpointed\n";
+    } else if(checkpointArg != NULL || containsFlagArg("--resume", argc, argv)) {
+      options.checkpointFrames = checkpointArg != NULL ? stol(checkpointArg) : 1800;
+      if(containsFlagArg("--resume", argc, argv) && resumePoint.read(checkpointPath)) {
+        if(resumePoint.matchRect != rectData.matchRect || resumePoint.viewRect != rectData.viewRect) {
+          cerr << "The checkpoint " << checkpointPath << " was made with different rectangles; resume with the same ones, or delete it to start over\n";
+          exit(1);
+        }
+        options.checkpointFrames = resumePoint.segmentFrames; // Segment boundaries have to carry on from the segments already written
+        resuming = true;
+        cerr << "Resuming from frame " << resumePoint.nextFrame << ", after the " << resumePoint.outputFrames << " frames already written\n";
+      } else if(containsFlagArg("--resume", argc, argv)) {
+        cerr << "No checkpoint at " << checkpointPath << " to resume from; starting from the beginning\n";
+      }
+    }
+    Stabilizer stabilizer(&cap, rectData.viewRect, refPos, refImg, options);
+    if(trajectory.isOpened())
+      stabilizer.setTrajectory(&trajectory);
+    char* decodersArg = getFlagValue("--decoders", argc, argv);
+    if(decodersArg != NULL && stoi(decodersArg) > 1 && fromStdin) {
+      cerr << "Ignoring --decoders: stdin can only be read in order\n";
+    } else if(decodersArg != NULL && stoi(decodersArg) > 1) { // Decode keyframe-aligned segments of the video in parallel
+      char* segmentFramesArg = getFlagValue("--segment-frames", argc, argv);
+      long segmentFrames = segmentFramesArg != NULL ? stol(segmentFramesArg) : 60;
+      KeyframeIndex keyframes;
+      vector<FrameRange> segments;
+      if(keyframes.probe(argv[1])) {
+        segments = keyframes.split(segmentFrames);
+        cerr << "Split " << keyframes.getFrameCount() << " frames into " << segments.size() << " segments at " << keyframes.getKeyframes().size() << " keyframes\n";
+      } else {
+        segments = KeyframeIndex::splitEvenly(frameCount, segmentFrames);
+        cerr << "Could not index keyframes with ffprobe; split " << frameCount << " frames evenly into " << segments.size() << " segments instead\n";
+      }
+      if(resuming)
+        segments = KeyframeIndex::startAt(segments, resumePoint.nextFrame - 1);
+      stabilizer.setSegments(argv[1], segments, stoi(decodersArg));
+    }
+    if(resuming) {
+      stabilizer.resumeFrom(resumePoint);
+      if(! Stabilizer::seekTo(cap, argv[1], resumePoint.nextFrame - 1)) {
+        cerr << "Could not seek to frame " << resumePoint.nextFrame << " to resume from\n";
+        exit(1);
+      }
+    }
     Mat frame;
     int seekPos = 0;
     bool liveUpdate = false;
     time_t oldTime = time(NULL);
-    Mat newFrame = frame;
+    auto startTime = chrono::steady_clock::now();
+    char* traceArg = getFlagValue("--trace", argc, argv);
+    if(traceArg != NULL || containsFlagArg("--profile", argc, argv)) {
+      Profiler::enable(traceArg != NULL);
+      Profiler::nameThread("retire");
+    }
+
+    if(analyze) { // Analysis pass: record each frame's match to the trajectory file, instead of cropping and encoding
+      TrajectoryHeader header = TrajectoryHeader();
+      header.refX = rectData.matchRect.x;
+      header.refY = rectData.matchRect.y;
+      header.refWidth = rectData.matchRect.width;
+      header.refHeight = rectData.matchRect.height;
+      header.frameWidth = cap.get(CAP_PROP_FRAME_WIDTH);
+      header.frameHeight = cap.get(CAP_PROP_FRAME_HEIGHT);
+      header.fps = cap.get(CAP_PROP_FPS);
+      TrajectoryWriter trajectoryWriter;
+      if(! trajectoryWriter.open(outfile, header)) {
+        cerr << "Could not write trajectory file " << outfile << "\n";
+        exit(1);
+      }
+      stabilizer.run(budget.getWorkers());
+      TrajectoryRecord record;
+      while(stabilizer.analyze(record)) {
+        if(! trajectoryWriter.append(record)) {
+          cerr << "Could not write trajectory file " << outfile << "\n";
+          exit(1);
+        }
+        ++seekPos;
+        time_t seconds = time(NULL);
+        if(seconds - oldTime >= 1) {
+          oldTime = seconds;
+          printProgress(seekPos, frameCount, startTime);
+        }
+      }
+      if(! trajectoryWriter.close()) {
+        cerr << "Could not write trajectory file " << outfile << "\n";
+        exit(1);
+      }
+      double elapsed = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+      cerr << "done frames=" << seekPos << " elapsed=" << elapsed << " fps=" << seekPos / elapsed << "\n";
+      cerr << "Decoding took " << stabilizer.getDecodeSeconds() << "s; worker threads stalled " << stabilizer.getDecodeStallSeconds() << "s in total waiting for decoded frames\n";
+      cerr << "Wrote the trajectory of " << seekPos << " frames to " << outfile << ". Render it with: " << argv[0] << " " << argv[1] << " <Output Video File> --trajectory " << outfile << "\n";
+      stabilizer.stop();
+      reportProfile(traceArg);
+      cap.release();
+      exit(0);
+    }
 
     // Get fourcc of input video and initialize for video output
     // https://answers.opencv.org/question/77558/get-fourcc-after-openning-a-video-file/
@@ -277,26 +999,76 @@ int main(int argc, char** argv) {
     double fps = cap.get(CAP_PROP_FPS);
     cv::Size newSize = Size(rectData.viewRect.width, rectData.viewRect.height);
     int origcc = cv::VideoWriter::fourcc(fourcc & 255, (fourcc >> 8) & 255, (fourcc >> 16) & 255, (fourcc >> 24) & 255);
-    VideoWriter outputWriter(outfile, origcc, fps, newSize, true); // Enable ffmpeg; Source for obtaining fourcc data: Link above
-    //int pixelFormat = cap.get(cv::CAP_PROP_CODEC_PIXEL_FORMAT);
-    outputWriter.set(cv::VIDEOWRITER_PROP_QUALITY, 100); // Preserve full original quality if possible
+    bool checkpointing = options.checkpointFrames > 0;
+    cv::Ptr<FfmpegVideoWriter> muxer;
+    // Opens the whole output, or one segment of it when checkpointing
+    auto openOutput = [&](const string& path) {
+      cv::Ptr<cv::VideoWriter> writer;
+      if(toStdout) { // Uncompressed frames, for another program to encode
+        RawVideoFormat outputFormat = RAW_Y4M;
+        char* outputFormatArg = getFlagValue("--output-format", argc, argv);
+        if(outputFormatArg != NULL && ! parseRawVideoFormat(outputFormatArg, &outputFormat)) {
+          cerr << "Unknown --output-format " << outputFormatArg << "\n";
+          exit(1);
+        }
+        cv::Ptr<RawVideoWriter> rawWriter = cv::makePtr<RawVideoWriter>();
+        if(! rawWriter->open(stdout, outputFormat, newSize, fps > 0 ? fps : 30)) {
+          cerr << "The view rectangle must have an even width and height for 4:2:0 output\n";
+          exit(1);
+        }
+        writer = rawWriter;
+      } else if(copyAudio && ! checkpointing) { // Encoded and muxed with the source's audio by ffmpeg, in one pass (segments get it when joined)
+        if(! FfmpegVideoWriter::isAvailable()) {
+          cerr << "--copy-audio needs ffmpeg, which could not be run\n";
+          exit(1);
+        }
+        muxer = cv::makePtr<FfmpegVideoWriter>();
+        if(! muxer->open(path, argv[1], FfmpegVideoWriter::getEncoderOptions(fourcc), newSize, fps > 0 ? fps : 30)) {
+          cerr << "Could not start ffmpeg; the view rectangle must also have an even width and height for it\n";
+          exit(1);
+        }
+        writer = muxer;
+      } else {
+        writer = cv::makePtr<cv::VideoWriter>(path, origcc, fps, newSize, true); // Enable ffmpeg; Source for obtaining fourcc data: Link above
+      }
+      unique_ptr<AsyncVideoWriter> asyncWriter = make_unique<AsyncVideoWriter>(writer, writeQueueFrames);
+      //int pixelFormat = cap.get(cv::CAP_PROP_CODEC_PIXEL_FORMAT);
+      asyncWriter->set(cv::VIDEOWRITER_PROP_QUALITY, 100); // Preserve full original quality if possible
+      return asyncWriter;
+    };
+    unique_ptr<AsyncVideoWriter> outputWriter;
+    double encodeSeconds = 0, encoderWaitSeconds = 0, producerWaitSeconds = 0;
+    // Finishes writing the output (or the current segment)
+    auto closeOutput = [&]() {
+      outputWriter->release();
+      encodeSeconds += outputWriter->getEncodeSeconds();
+      encoderWaitSeconds += outputWriter->getEncoderWaitSeconds();
+      producerWaitSeconds += outputWriter->getProducerWaitSeconds();
+      outputWriter.reset();
+      if(muxer && muxer->getExitStatus() != 0) {
+        cerr << "ffmpeg failed writing " << outfile << " (exit status " << muxer->getExitStatus() << ")\n";
+        exit(1);
+      }
+    };
+    long segment = resuming ? resumePoint.outputFrames / options.checkpointFrames : 0; // Index of the segment being written
+    long firstFrame = resuming ? resumePoint.outputFrames : 0;
+    seekPos = firstFrame;
+    if(! checkpointing)
+      outputWriter = openOutput(outfile);
+    stabilizer.run(budget.getWorkers()); // From here on, the stabilizer's decode thread owns cap
 
 
 
-    char* distArg = getFlagValue("--motion-limit", argc, argv);
-    int maxDistance = 0;
-    if(distArg != NULL)
-      maxDistance = stoi(distArg);
     while(true) {
-      cv::Point oldMatchPos = stabilizer.getLastMatchPos();
-      stabilizer >> newFrame;
-      if(newFrame.empty()) break;
-      cv::Point newMatchPos = stabilizer.getLastMatchPos();
-      int dist = norm(newMatchPos - oldMatchPos);
-      if(distArg == NULL || frame.empty() || dist <= maxDistance)
-        frame = newFrame;
+      stabilizer >> frame;
+      if(frame.empty()) break;
       time_t seconds = time(NULL);
-      if(seconds - oldTime >= 1) {
+      if(seconds - oldTime >= 1 && headless) {
+        oldTime = seconds;
+        printProgress(seekPos, frameCount, startTime, firstFrame);
+      }
+#ifndef STABILIZE_HEADLESS
+      if(! headless && seconds - oldTime >= 1) {
         oldTime = seconds;
         createTrackbar("Frame", "Video Output", nullptr, frameCount, nullptr, nullptr);
         setTrackbarPos("Frame", "Video Output", min(frameCount-1, (unsigned long) seekPos));
@@ -315,34 +1087,62 @@ int main(int argc, char** argv) {
         }
         cv::waitKey(1);
       }
-      outputWriter.write(frame); // Write to output file
+#endif
+      if(! outputWriter)
+        outputWriter = openOutput(getSegmentPath(outfile, segment));
+      outputWriter->write(frame); // Hand off to the encoder thread to write to the output file
       ++seekPos;
+      Checkpoint checkpoint;
+      if(checkpointing && stabilizer.takeCheckpoint(checkpoint)) { // The segment is complete; once it is written, record that it is
+        closeOutput();
+        ++segment;
+        checkpoint.segmentFrames = options.checkpointFrames;
+        checkpoint.matchRect = rectData.matchRect;
+        checkpoint.viewRect = rectData.viewRect;
+        if(! checkpoint.write(checkpointPath))
+          cerr << "Could not write checkpoint " << checkpointPath << "\n";
+      }
+    }
+    if(outputWriter) {
+      closeOutput();
+      ++segment;
+    }
+    if(headless) {
+      double elapsed = chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
+      cerr << "done frames=" << seekPos << " elapsed=" << elapsed << " fps=" << (seekPos - firstFrame) / elapsed << "\n";
+    }
+    cerr << "Encoding took " << encodeSeconds << "s; the encoder waited " << encoderWaitSeconds << "s for frames, and the retire loop waited " << producerWaitSeconds << "s for the encoder\n";
+    cerr << "Decoding took " << stabilizer.getDecodeSeconds() << "s; worker threads stalled " << stabilizer.getDecodeStallSeconds() << "s in total waiting for decoded frames, and the decoder waited " << stabilizer.getPrefetchFullSeconds() << "s for free workers\n";
+    if(options.pyramidLevels > 0)
+      cerr << "Pyramid matches redone as full searches: " << stabilizer.getMatchFallbackCount() << "\n";
+    if(options.searchRadius > 0)
+      cerr << "Search window missed on " << stabilizer.getWindowFallbackCount() << " of " << stabilizer.getWindowPredictionCount() << " predicted frames\n";
+    if(stabilizer.getPoolMissCount() > 0)
+      cerr << "Frame buffers allocated outside the pools: " << stabilizer.getPoolMissCount() << "\n";
+    if(stabilizer.getDroppedFrameCount() > 0)
+      cerr << "Frames the segment decoders could not read, and skipped: " << stabilizer.getDroppedFrameCount() << "\n";
+    if(options.tracker)
+      cerr << "Frames tracked: " << stabilizer.getTrackedFrameCount() << ", skipped because the tracker was busy: " << stabilizer.getTrackerDroppedCount() << "\n";
+    if(options.motionLimit > 0)
+      cerr << "Match positions left out of the smoothing as mismatches: " << stabilizer.getSmoothingRejectedCount() << "\n";
+    cerr << "Peak frames in flight: " << stabilizer.getPeakInFlight() << " (limit " << stabilizer.getMaxInFlight() << "), peak reorder queue depth: " << stabilizer.getPeakQueueDepth() << "\n";
+    stabilizer.stop();
+    reportProfile(traceArg);
+    if(checkpointing) {
+      if(! joinSegments(outfile, segment, argv[1], copyAudio)) {
+        cerr << "Could not join the segments with ffmpeg. They are kept as " << getSegmentPath(outfile, 0) << " and so on, listed in " << outfile << ".parts.txt\n";
+        exit(1);
+      }
+      remove(checkpointPath.c_str());
     }
-    outputWriter.release();
   }
-  cv::destroyAllWindows();
+#ifndef STABILIZE_HEADLESS
+  if(! headless)
+    cv::destroyAllWindows();
+#endif
   cap.release();
-  // ffmpeg -i example_stabilized.MOV -i example.MOV -c:v:a copy -map 0:v:0 -map 1:a:0 example_stabilized.MOV\n;
-  string outAsStr = string(argv[2]);
-  int lastFileDelimPos = outAsStr.find_last_of("/");
-  string outParDir = "";
-  if(lastFileDelimPos != string::npos)
-    outParDir = outAsStr.substr(0, lastFileDelimPos) + "/";
-  string outName = getAfterLast(argv[2], '/'); // File name without extension
-  string outLabel = outName.substr(0, outName.find_last_of('.'));
-  string outFile = outParDir + outLabel + "_audio-copied" + getAfterLast(argv[2], '.'); // Add path, name, extra string, and file extension
-  
-  string audioCmd = "ffmpeg -y -i \"" + string(argv[2]) + "\" -i \"" + string(argv[1]) + "\" -c copy -map 0:v -map 1:a \"" + outFile + "\"";
-  if(containsFlagArg("--copy-audio", argc, argv)) {
-    cerr << "Copying audio to output...:\n\n";
-    cerr << "Running: " << audioCmd << "\n\n";
-    int ret = system(audioCmd.c_str());
-    exit(ret);
-  } else {
-    cerr << "Completed. Video was generated without audio. To copy audio to the new stabilized video, run:\n\n";
-    cerr << audioCmd << "\n";
-  }
-  
+  if(! copyAudio && ! fromStdin && ! toStdout)
+    cerr << "Completed. Video was generated without audio; pass --copy-audio to encode it with the source's audio.\n";
   exit(0);
 }
 
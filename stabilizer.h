@@ -3,71 +3,174 @@
 
 #include <opencv2/opencv.hpp>
 #include <thread>
-#include "AtomicPriorityQueue.h"
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "reorderbuffer.h"
+#include "boundedqueue.h"
 #include <opencv2/core/ocl.hpp>
-#include "pointcloudtracker.h"
-
-#include "calibrator.h"
+#include "trackerstage.h"
+#include "motionestimator.h"
+#include "templatematcher.h"
+#include "phasecorrelator.h"
+#include "matchhistory.h"
+#include "trajectory.h"
+#include "trajectorysmoother.h"
+#include "keyframeindex.h"
+#include "framepool.h"
+#include "profiler.h"
+#include "threadbudget.h"
+#include "checkpoint.h"
+#include "workerpool.h"
 
 
 using namespace std; // TODO: Header / cpp separation...
 
-class Stabilizer {
+// Tunable settings for a Stabilizer run
+struct StabilizerOptions {
+  int maxInFlight = 0; // Maximum number of decoded frames not yet retired via ">>"; decoding waits instead of running past it. 0 picks 4 per worker.
+  int prefetchFrames = 0; // Number of decoded frames buffered ahead of the worker threads. 0 picks 2 per worker.
+  int pyramidLevels = 0; // Downscaled levels for coarse-to-fine matching; 0 searches the whole full-resolution frame
+  double pyramidMinScore = 0.5; // Pyramid matches scoring below this are redone with a full search
+  int searchRadius = 0; // If nonzero, first search only this many pixels around the location predicted from nearby frames
+  double searchMinScore = 0.7; // Search-window matches scoring below this are redone with a wider search
+  std::string estimator = "template"; // Motion estimation backend: "template" (matchTemplate with TM_CCOEFF_NORMED) or "phase" (FFT phase correlation)
+  double phaseMinResponse = 0.3; // Phase-correlation search-window estimates with a weaker peak response are redone over the whole frame
+  bool grayscale = false; // Match on grayscale copies of the frames, which then replace the colour ones; for analysis passes that never crop
+  std::string smoothing = "none"; // How the match positions are smoothed before cropping: "none", "average", "gaussian" or "kalman"
+  int smoothingWindow = 15; // Frames on either side of each one that smoothing uses. Output lags the reorder buffer by this many frames, which are held meanwhile.
+  double kalmanProcessNoise = 0.01; // Kalman smoothing only: lower values trust the constant-velocity motion model more, smoothing harder
+  double motionLimit = 0; // Match positions jumping further than this many pixels are left out of the smoothing as mismatches; 0 keeps them all
+  bool tracker = true; // Track feature points for the debugging view, on a separate thread. Not needed to stabilize.
+  double trackerScale = 0.5; // Tracking is done on frames scaled by this
+  int trackerDecimation = 2; // Only every this many frames are tracked
+  bool pinThreads = false; // Pin each worker thread to its own core (Linux only); see ThreadBudget
+  long checkpointFrames = 0; // Make a checkpoint (see Stabilizer::takeCheckpoint()) every this many output frames; 0 never does
+  double stretchX = 0; // How far the view window's source region is stretched along the motion since the last frame, horizontally and
+  double stretchY = 0.25; // vertically, as a multiple of half of it, before being scaled back to the view size; see Calibrator
+  int outputBuffers = 16; // Number of cropped frames that may be in use downstream of ">>" at once (in the encoder's queue, say) before the output pool has to allocate
+};
+
+// Whether createMotionEstimator() knows the backend called name
+static bool isKnownEstimator(const std::string& name) {
+  return name == "template" || name == "phase";
+}
+
+// Creates the motion estimation backend named by options.estimator, or returns nullptr if there is no such backend.
+// refPos is where refImg was taken from in its original frame.
+static std::unique_ptr<MotionEstimator> createMotionEstimator(const StabilizerOptions& options, const cv::Mat& refImg, cv::Point refPos) {
+  if(options.estimator == "template")
+    return std::make_unique<TemplateMatcher>(refImg, options.pyramidLevels, options.pyramidMinScore, options.searchMinScore);
+  if(options.estimator == "phase")
+    return std::make_unique<PhaseCorrelator>(refImg, refPos, options.phaseMinResponse);
+  return nullptr;
+}
+
+class Stabilizer : public WorkerPool::Source {
   private:
-    unsigned long frameCount; // Count of the frames used
-    cv::VideoCapture* cap;
+    unsigned long frameCount; // Count of the frames decoded
+    cv::VideoCapture* cap; // Only read by the decode thread while running
     std::mutex popMutex;
-    std::mutex frameMtx;
-    std::condition_variable popNotify; // Notified each time an item is inserted into the list, for the popper to check if the right item is available next
     std::atomic<int> dispatchCount; // Number of threads currently running
     std::thread* threads;
+    WorkerPool* pool; // Shared workers to match frames on instead of threads of our own, if set
+    std::vector<std::unique_ptr<MotionEstimator>> poolEstimators; // Matching state of each pool worker, created on its first frame
+    cv::Mat poolRefImg; // refImg, as the pool workers match with it
+    std::atomic<int> poolActive; // Number of pool workers inside tryRun()
+    std::atomic<bool> poolFinished; // Set by the pool worker that closes the reorder buffer at the end of the stream
+    std::vector<std::thread> decodeThreads; // Producer stage: decodes ahead into the prefetch ring, with cap, or one capture each per segment decoder
+    std::string segmentSource; // With segment decoders, the video each of them opens
+    std::vector<FrameRange> segments; // Consecutive frame ranges, claimed in order by the segment decoders
+    int segmentDecoders; // Number of segment decoders, or 0 to decode everything with cap
+    long segmentSpan; // Typical (median) segment length
+    std::atomic<int> nextSegment; // Index of the next segment to claim
+    std::atomic<int> decodersLeft; // Number of segment decoders still running
+    std::atomic<long> droppedFrames; // Frames a segment decoder couldn't read, which are skipped
+    std::atomic<long> decodeNanos; // Total time spent inside the decoder
+    std::atomic<long> matchFallbacks; // Frames where the pyramid match was redone as a full search
+    std::atomic<long> windowPredictions; // Frames searched first within a predicted search window
+    std::atomic<long> windowFallbacks; // Frames where the search window missed, and a wider search was needed
+    MatchHistory matchHistory; // Match locations of recent frames, for predicting where to search next
     int processorCount;
     std::atomic<bool> emergencyStop; // Tells running threads to stop
     unsigned long retiredCount; // Count of the frames retired via the ">>" operator
     cv::Rect viewRect; // The view portion you want to keep within the stabilizing frame
     cv::Mat refImg; // The "match" image to lock onto throughout the video
     cv::Point refPos; // The upper-left corner of the reference image within the larger frame
-    PointCloudTracker pct;
+    TrackerStage tracker; // Point cloud tracking for the debugging view, off the retire path
+    std::vector<cv::Point2f> debugPoints; // Scratch for getDebuggingFrame()
+    PointCloudTracker analysisTracker; // Tracks every frame retired by analyze(), in order, for the trajectory's per-frame stats
+    cv::Mat analysisScaled; // Scratch: the frame analyzed, scaled for analysisTracker
     cv::Rect heuristic_viewRect;
     cv::Rect heuristic_refRect;
+    StabilizerOptions options;
+    const TrajectoryReader* trajectory; // Match locations from an earlier analysis pass, used instead of matching if set
+    TrajectorySmoother smoother;
+    long pushedCount; // Frames pushed into the smoother, counting those before the checkpoint resumed from
+    long outputCount; // Frames cropped by ">>", counting those before the checkpoint resumed from
+    long firstOutput; // Frames output before this run, by the run resumed from
+    Checkpoint resumeState; // Where run() starts from, if resuming
+    bool resuming;
+    std::deque<Checkpoint> checkpoints; // Checkpoints at frames pushed into the smoother, filled in and taken once those frames are cropped
 
-    class Frame : Comparable<Frame> {
+    class Frame {
       private:
       public:
-      cv::Point matchLoc; // The match position of the reference point on the original frame
+      cv::Point2f matchLoc; // The match position of the reference point on the original frame, at sub-pixel precision
+      float score = 0; // The estimator's confidence in matchLoc
+      uint32_t flags = 0; // TrajectoryFlags
+      std::chrono::steady_clock::time_point decodedAt; // When decoding of the frame started
       long number;
       cv::Mat image;
 
       Frame() {
       }
-
-      // Constructor: uses mtx synchronization to initialize this object by grabbing the next frame from cap and incrementing frameCount
-      Frame(unsigned long* frameCount, mutex* mtx, cv::VideoCapture* cap) {
-        std::scoped_lock l(*mtx);
-        *frameCount = *frameCount + 1; // I don't know why the ++ operator doesn't work with this...
-        number = *frameCount;
-        *cap >> image;
-      }
-      int compareTo(Frame* other) { // compareTo method for AtomicPriorityQueue. Reverse its order to prefer sooner frames first.
-        return other->number - number;
-        //return number - other->number;
-      }
       friend std::ostream& operator<<(std::ostream& os, Frame const& f) { // Make printable via cout
         return os << "<Frame #" << f.number << ">";
       }
     };
     
-    cv::Point lastMatchPos;
-    AtomicPriorityQueue<Frame> outputQueue;
+    cv::Point2f lastMatchPos;
+    cv::Point2f lastSmoothedPos;
+    double lastLatency; // Seconds from the start of decoding the last frame retired to the end of its retirement
+    std::vector<Frame> pending; // Ring of frames retired from the reorder buffer, waiting for the smoother to see enough frames after them
+    size_t pendingHead; // Index within pending of the oldest frame
+    size_t pendingCount;
+    FramePool framePool; // Decoded frames, recycled once retired
+    FramePool grayPool; // Grayscale copies of the decoded frames, when matching on grayscale
+    FramePool outputPool; // Cropped frames, recycled once the caller (and the encoder) are done with them
+    bool retiredAll; // The reorder buffer reached the end of the stream
+    BoundedQueue<Frame> prefetchQueue; // Decoded frames, in order, waiting for a worker thread
+    ReorderBuffer<Frame> outputQueue; // Reassembles frames finished out of order by the worker threads, indexed by frame number
 
   public:
-  Stabilizer(cv::VideoCapture* cap, cv::Rect& viewRect, cv::Point& refPos, cv::Mat& refImg): pct(), cap(cap), outputQueue(), popMutex(), frameMtx(), popNotify() {
+  Stabilizer(cv::VideoCapture* cap, cv::Rect& viewRect, cv::Point& refPos, cv::Mat& refImg, const StabilizerOptions& options = StabilizerOptions()): cap(cap), prefetchQueue(), outputQueue(), popMutex(), options(options) {
     frameCount = 0;
     dispatchCount.store(false, std::memory_order_relaxed);
     threads = nullptr;
+    pool = nullptr;
+    poolActive.store(0);
+    poolFinished.store(false);
     processorCount = 0;
     emergencyStop.store(false, std::memory_order_relaxed);
+    decodeNanos.store(0, std::memory_order_relaxed);
+    matchFallbacks.store(0, std::memory_order_relaxed);
+    windowPredictions.store(0, std::memory_order_relaxed);
+    windowFallbacks.store(0, std::memory_order_relaxed);
     retiredCount = 0;
+    pushedCount = 0;
+    outputCount = 0;
+    firstOutput = 0;
+    resuming = false;
+    lastLatency = 0;
+    trajectory = nullptr;
+    segmentDecoders = 0;
+    segmentSpan = 0;
+    droppedFrames.store(0, std::memory_order_relaxed);
     this->viewRect = viewRect;
     this->refImg = refImg;
     this->refPos = refPos;
@@ -76,36 +179,262 @@ class Stabilizer {
   }
 
   ~Stabilizer() {
-    emergencyStop.store(true, std::memory_order_release);
-    for(int i = 0; i < processorCount; ++i) {
-      threads[i].join();
-    }
+    stop();
     if(threads != nullptr)
       delete[] threads;
   }
 
+  // Stops every thread (decoders, workers and the tracker) and waits for them to exit. Frames not yet retired are discarded.
+  void stop() {
+    tracker.stop();
+    emergencyStop.store(true, std::memory_order_release);
+    outputQueue.close(); // Release the decoder and any workers waiting for space in the reorder buffer
+    prefetchQueue.close(); // Release the decoder and any workers waiting on the prefetch ring
+    for(std::thread& t : decodeThreads)
+      if(t.joinable())
+        t.join();
+    for(int i = 0; threads != nullptr && i < processorCount; ++i) {
+      if(threads[i].joinable())
+        threads[i].join();
+    }
+    if(pool) {
+      pool->detach(this);
+      dispatchCount.store(0, std::memory_order_release);
+    }
+  }
+
+  // Takes match locations from the given trajectory instead of matching, for the frames it covers. Call before run().
+  // The reader must stay open until the stabilizer is destroyed.
+  void setTrajectory(const TrajectoryReader* trajectory) {
+    this->trajectory = trajectory;
+  }
+
+  // Decodes with "decoders" threads, each with its own capture of the video at path, instead of with the single shared capture.
+  // The segments are claimed in order, one at a time, by whichever decoder is free; each decoder seeks to the start of its segment.
+  // Segments should start on keyframes (see KeyframeIndex) so seeking doesn't decode frames another decoder also decodes.
+  // Call before run(). Decoders more than the in-flight limit ahead of the oldest unretired frame wait, so it should cover a segment per
+  // decoder (which the default limit does, for segments up to maxSegmentShare frames).
+  void setSegments(const std::string& path, const std::vector<FrameRange>& segments, int decoders) {
+    segmentSource = path;
+    this->segments = segments;
+    segmentDecoders = segments.empty() ? 0 : decoders;
+    std::vector<long> lengths;
+    for(const FrameRange& range : segments)
+      lengths.push_back(range.end - range.start);
+    if(lengths.empty()) {
+      segmentSpan = 0;
+    } else {
+      std::nth_element(lengths.begin(), lengths.begin() + lengths.size() / 2, lengths.end());
+      segmentSpan = lengths[lengths.size() / 2];
+    }
+  }
+
+  // Starts the next run() from a checkpoint, continuing the smoothing from its state. Call before run(), with the capture (or the
+  // segments) positioned to read frame number checkpoint.nextFrame first.
+  void resumeFrom(const Checkpoint& checkpoint) {
+    resumeState = checkpoint;
+    resuming = true;
+  }
+
+  // Moves cap so that the next frame it reads is frame "index" (counting from 0). Returns false if the video is shorter.
+  static bool seekTo(cv::VideoCapture& cap, const std::string& path, long index) {
+    cap.set(cv::CAP_PROP_POS_FRAMES, index);
+    long position = cap.get(cv::CAP_PROP_POS_FRAMES);
+    if(position > index) { // Seeking overshot, which some containers do; read up to it from the start instead
+      cap.open(path);
+      position = 0;
+    }
+    while(position < index && cap.grab())
+      ++position;
+    return position == index;
+  }
+
+  // Starts decoding, and matching on processorCount worker threads of its own
   bool run(int processorCount) {
+    return start(processorCount, nullptr);
+  }
+
+  // Starts decoding, and matching on the workers of a pool, which may be shared with other stabilizers. The pool must outlive the run
+  // (or stop()).
+  bool run(WorkerPool& pool) {
+    return start(pool.getSize(), &pool);
+  }
+
+  // WorkerPool::Source: matches the next decoded frame, if there is one, on a pool worker
+  int tryRun(int worker) override {
+    poolActive.fetch_add(1);
+    Frame frame;
+    bool took = prefetchQueue.tryPop(frame);
+    if(took) {
+      std::unique_ptr<MotionEstimator>& estimator = poolEstimators[worker]; // Only ever used by this worker
+      if(! estimator)
+        estimator = createMotionEstimator(options, poolRefImg, refPos);
+      long fallbacks = estimator->getFallbackCount(), predictions = 0, misses = 0;
+      if(! frame.image.empty())
+        matchFrame(frame, estimator.get(), &matchHistory, &grayPool, options, trajectory, &predictions, &misses);
+      matchFallbacks.fetch_add(estimator->getFallbackCount() - fallbacks, std::memory_order_relaxed);
+      windowPredictions.fetch_add(predictions, std::memory_order_relaxed);
+      windowFallbacks.fetch_add(misses, std::memory_order_relaxed);
+      ProfileScope publishing(PROFILE_PUBLISH);
+      outputQueue.publish(frame.number, frame); // Fails only once stopped
+    }
+    // Whoever is last out once the decoders are done marks the end of the stream. Drained is checked before leaving: a worker that
+    // came in before that may still be holding the last frame, and then it isn't last out; one that came in after finds nothing to pop.
+    bool drained = prefetchQueue.isDrained();
+    if(poolActive.fetch_sub(1) == 1 && drained && ! poolFinished.exchange(true)) {
+      outputQueue.close();
+      dispatchCount.store(0, std::memory_order_release);
+    }
+    if(poolFinished.load())
+      return -1;
+    return took ? 1 : 0;
+  }
+
+  private:
+  bool start(int processorCount, WorkerPool* pool) {
     if(dispatchCount.load(std::memory_order_relaxed) != 0) return false; // Already running
+    if(this->pool)
+      this->pool->detach(this); // From a previous run
+    this->pool = pool;
     this->processorCount = processorCount;
     emergencyStop.store(false, std::memory_order_release);
-    frameCount = 0;
-    retiredCount = 0;
+    frameCount = resuming ? resumeState.nextFrame - 1 : 0;
+    retiredCount = resuming ? resumeState.outputFrames : 0;
+    pushedCount = retiredCount;
+    outputCount = retiredCount;
+    firstOutput = retiredCount;
+    checkpoints.clear();
+    decodeNanos.store(0, std::memory_order_relaxed);
+    matchFallbacks.store(0, std::memory_order_relaxed);
+    windowPredictions.store(0, std::memory_order_relaxed);
+    windowFallbacks.store(0, std::memory_order_relaxed);
+    droppedFrames.store(0, std::memory_order_relaxed);
+    TrajectorySmoother::Method method = TrajectorySmoother::NONE;
+    TrajectorySmoother::parseMethod(options.smoothing, &method);
+    if(resuming) {
+      smoother = resumeState.smoother;
+      lastMatchPos = resumeState.lastMatchPos;
+      lastSmoothedPos = resumeState.lastSmoothedPos;
+      resuming = false;
+    } else {
+      smoother.reset(method, options.smoothingWindow, options.kalmanProcessNoise, options.motionLimit);
+    }
+    pending.assign(smoother.getWindow() + 1, Frame());
+    pendingHead = 0;
+    pendingCount = 0;
+    retiredAll = false;
+    outputQueue.reset(getMaxInFlight(), frameCount + 1); // The ring doubles as the in-flight window, so it never needs more slots than that
+    matchHistory.reset(2 * getMaxInFlight()); // Enough to cover every frame in flight, plus the retired ones just before them
+    prefetchQueue.reset(options.prefetchFrames > 0 ? options.prefetchFrames : 2 * processorCount);
+    // Every decoded frame is somewhere between the decoder and the end of retirement: in flight, in the prefetch ring, in a decoder's
+    // hands, held for smoothing, or waiting for the tracker (plus the one the tracker may keep for the next frame)
+    if(options.tracker)
+      tracker.start(options.trackerScale, options.trackerDecimation);
+    analysisTracker.reset();
+    long framesHeld = getMaxInFlight() + prefetchQueue.getCapacity() + std::max(segmentDecoders, 1) + pending.size() + 2 + (options.tracker ? tracker.getQueueCapacity() : 0);
+    framePool.reset(framesHeld);
+    grayPool.reset(options.grayscale ? framesHeld : 0);
+    outputPool.reset(options.outputBuffers);
     dispatchCount.store(processorCount, std::memory_order_release);
+    for(std::thread& t : decodeThreads)
+      if(t.joinable())
+        t.join();
+    decodeThreads.clear();
     if(threads != nullptr) {
       delete[] threads;
       threads = nullptr;
     }
+    if(pool) {
+      poolEstimators.clear();
+      poolEstimators.resize(processorCount);
+      poolRefImg = refImg;
+      if(options.grayscale && refImg.channels() == 3)
+        cv::cvtColor(refImg, poolRefImg, cv::COLOR_BGR2GRAY);
+      poolActive.store(0);
+      poolFinished.store(false);
+      dispatchCount.store(1, std::memory_order_release); // Running until the pool worker last out resets it
+    }
+    if(segmentDecoders > 0) {
+      nextSegment.store(0, std::memory_order_relaxed);
+      decodersLeft.store(segmentDecoders, std::memory_order_relaxed);
+      for(int i = 0; i < segmentDecoders; ++i)
+        decodeThreads.emplace_back(decodeSegments, segmentSource, &segments, &nextSegment, &decodersLeft, &framePool, &prefetchQueue, &outputQueue, &emergencyStop, &decodeNanos, &droppedFrames, pool);
+    } else {
+      decodeThreads.emplace_back(decode, cap, &frameCount, &framePool, &prefetchQueue, &outputQueue, &emergencyStop, &decodeNanos, pool);
+    }
+    if(pool) {
+      pool->attach(this);
+      return true;
+    }
     threads = new std::thread[processorCount];
     for(int i = 0; i < processorCount; ++i) {
-      threads[i] = std::thread(stabilize, &frameCount, &frameMtx, cap, &outputQueue, &popNotify, &dispatchCount, &emergencyStop, viewRect, refImg, refPos);
+      threads[i] = std::thread(stabilize, &prefetchQueue, &outputQueue, &dispatchCount, &emergencyStop, &matchHistory, &matchFallbacks, &windowPredictions, &windowFallbacks, &grayPool, options, trajectory, refImg, refPos);
+      if(options.pinThreads)
+        ThreadBudget::pinThread(threads[i], i);
     }
     return true;
   }
 
-  cv::Point getLastMatchPos() {
+  public:
+
+  static constexpr long maxSegmentShare = 120; // Most frames of the default in-flight window given to each segment decoder
+
+  // The effective limit on decoded-but-unretired frames
+  int getMaxInFlight() {
+    if(options.maxInFlight > 0) return options.maxInFlight;
+    // Room for each worker to run a few frames ahead of the oldest unfinished one, and for each segment decoder to hold a segment of
+    // its own, so that all of them decode at once. A decoder's share is capped at maxSegmentShare frames, which bounds memory on
+    // long-GOP sources; segments longer than that overlap only in part, a decoder waiting in reserve() for the frames of the segments
+    // before its own to be retired.
+    int workerShare = 4 * std::max(processorCount, 1);
+    return workerShare + segmentDecoders * (int) std::min(segmentSpan, maxSegmentShare);
+  }
+
+  // Highest number of decoded frames that were not yet retired at once
+  long getPeakInFlight() { return outputQueue.getPeakInFlight(); }
+
+  // Highest number of finished frames that waited in the reorder buffer at once
+  long getPeakQueueDepth() { return outputQueue.getPeakQueued(); }
+
+  // Number of frames that segment decoders failed to read (when seeking was inaccurate, or the frame count was overestimated)
+  long getDroppedFrameCount() { return droppedFrames.load(std::memory_order_relaxed); }
+
+  // Total seconds the decode threads spent decoding frames (summed over all decoders)
+  double getDecodeSeconds() { return decodeNanos.load(std::memory_order_relaxed) / 1e9; }
+
+  // Total seconds worker threads spent idle, waiting for the decoder (summed over all workers)
+  double getDecodeStallSeconds() { return prefetchQueue.getPopWaitSeconds(); }
+
+  // Total seconds the decoder spent waiting for a worker to take a frame off a full prefetch ring
+  double getPrefetchFullSeconds() { return prefetchQueue.getPushWaitSeconds(); }
+
+  // Number of frames where a low-scoring pyramid match fell back to a full search
+  long getMatchFallbackCount() { return matchFallbacks.load(std::memory_order_relaxed); }
+
+  // Number of frames first searched within a predicted search window
+  long getWindowPredictionCount() { return windowPredictions.load(std::memory_order_relaxed); }
+
+  // Number of frames where the predicted search window missed and a wider search was done
+  long getWindowFallbackCount() { return windowFallbacks.load(std::memory_order_relaxed); }
+
+  // Number of frame buffers that had to be allocated because a pool was exhausted (0 once the pools are sized right)
+  long getPoolMissCount() { return framePool.getMissCount() + grayPool.getMissCount() + outputPool.getMissCount(); }
+
+  // Number of frames the tracker stage tracked, and dropped because it was still busy
+  long getTrackedFrameCount() { return tracker.getTrackedCount(); }
+  long getTrackerDroppedCount() { return tracker.getDroppedCount(); }
+
+  // Number of match positions the smoother left out as mismatches (see StabilizerOptions::motionLimit)
+  long getSmoothingRejectedCount() { return smoother.getRejectedCount(); }
+
+  cv::Point2f getLastMatchPos() {
     return lastMatchPos;
   }
 
+  // Seconds the last frame retired took from the start of its decoding until it was cropped (or recorded, by analyze()), including
+  // the time spent waiting in queues and held for smoothing
+  double getLastFrameLatency() { return lastLatency; }
+
   cv::Rect getLastViewRect() { return heuristic_viewRect; }
   cv::Rect getLastRefRect() { return heuristic_refRect; }
 
@@ -114,16 +443,15 @@ class Stabilizer {
   // Returns an empty Mat if any errors occurred
   cv::Mat getDebuggingFrame() {
     std::scoped_lock lock(popMutex);
-    Frame* frame = outputQueue.peek(std::memory_order_acquire);
+    Frame* frame = outputQueue.peek();
     if(! frame) {
       return cv::Mat();
     }
-    cv::Mat image = frame->image;
+    cv::Mat image = frame->image.clone(); // Draw on a copy: the frame itself is still to be cropped and encoded
 
-    vector<cv::Point2f> const * newPoints = pct.getPoints();
-    if(! newPoints) return image;
-    // Add points from newPoints to the frame
-    for(cv::Point2f point : *newPoints) {
+    // Add the latest tracked points to the frame
+    tracker.getPoints(debugPoints);
+    for(cv::Point2f point : debugPoints) {
       cv::circle(image, point, 10, cv::Scalar(0, 255, 0), -1);
     }
     return image;
@@ -134,93 +462,322 @@ class Stabilizer {
 
   }
 
+  // Retires the next frame in order, without cropping it, and describes it in record. Use this instead of ">>" for analysis passes.
+  // If options.tracker is set, every frame is tracked here, in order and at options.trackerScale, so that its tracked point count is
+  // its own (rather than the asynchronous tracker's latest, which skips frames); otherwise the record is flagged TRAJECTORY_UNTRACKED.
+  // Returns false at the end of the video.
+  bool analyze(TrajectoryRecord& record) {
+    Frame r;
+    if(! retire(r))
+      return false;
+    heuristic_refRect = cv::Rect(cv::Point(cvRound(r.matchLoc.x), cvRound(r.matchLoc.y)), refImg.size());
+    record = TrajectoryRecord();
+    record.number = r.number;
+    record.matchX = r.matchLoc.x;
+    record.matchY = r.matchLoc.y;
+    record.score = r.score;
+    record.flags = r.flags;
+    if(options.tracker && ! r.image.empty()) {
+      ProfileScope tracking(PROFILE_TRACK);
+      if(options.trackerScale > 0 && options.trackerScale < 1) {
+        cv::resize(r.image, analysisScaled, cv::Size(), options.trackerScale, options.trackerScale, cv::INTER_AREA);
+        analysisTracker.update(analysisScaled);
+      } else {
+        analysisTracker.update(r.image);
+      }
+      record.trackedPoints = analysisTracker.getPoints()->size();
+    } else {
+      record.flags |= TRAJECTORY_UNTRACKED;
+    }
+    lastMatchPos = r.matchLoc;
+    lastLatency = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.decodedAt).count();
+    return true;
+  }
+
   // Override >> operator to write frame data to given Mat object
-  // If the list is empty and the algorithm is not completed, waits until a new item is inserted in-order.
+  // If the next frame in order is not finished yet and the algorithm is not completed, waits until it is published.
   //Stabilizer& operator >> (CV_OUT cv::Mat& image)
   void operator >> (CV_OUT cv::Mat& image) {
     Frame r;
-    // Wait until a new frame is available
-    {
-      std::unique_lock<std::mutex> lk(popMutex);
-      while(true) {
-        Frame* f = outputQueue.peek(std::memory_order_relaxed);
-        if(f == nullptr) { // End of stream, or is the output starved, waiting for more data?
-          if(dispatchCount.load(std::memory_order_relaxed) == 0) { // Is there something that's going to put more in, or is it done?
-            image = cv::Mat(); 
-            return; // Write an empty frame if none available
-          }
-        } else if(f->number == retiredCount + 1) { // If the next frame you want is assembled next in the queue
-          break;
-        }
-        popNotify.wait(lk);
-      }
-      ++retiredCount;
-      
-      r = outputQueue.pop();
+    cv::Point2f smoothedLoc;
+    if(! retireSmoothed(r, smoothedLoc)) {
+      image = cv::Mat();
+      return; // Write an empty frame if none available
     }
-    heuristic_refRect = cv::Rect(r.matchLoc, r.image.size());
-    pct.update(r.image);
+    heuristic_refRect = cv::Rect(cv::Point(cvRound(r.matchLoc.x), cvRound(r.matchLoc.y)), refImg.size());
+    tracker.offer(r.image); // Doesn't wait, and does nothing if tracking is off
 
     // The rest of this function is Synchronous post-processing
 
-    // Determine motion based on delta between last match position and current match position
+    // Crop along the motion between the last (smoothed) match position and the current one
     // We must do this synchronously because the last one in the queue may not necessarily be the previous frame in the video since this
     // is being processed in parallel.
-    int motionX = 0;
-    int motionY = 0;
-    //if(lastMatchPos.x != 0 && lastMatchPos.y != 0) {
-      motionX = r.matchLoc.x - lastMatchPos.x;
-      motionY = r.matchLoc.y - lastMatchPos.y;
-    //}
-
-    double stretchMultiplierX = 0;
-    double stretchMultiplierY = 0.25;
-    motionX *= stretchMultiplierX;
-    motionY *= stretchMultiplierY;
-    
-    int offsetX = viewRect.x - refPos.x;
-    int offsetY = viewRect.y - refPos.y;
-    cv::Point viewP1(std::clamp(r.matchLoc.x + offsetX , 0, r.image.cols - viewRect.width), std::clamp(r.matchLoc.y + offsetY , 0, r.image.rows - viewRect.height));
-    cv::Point viewP2(clamp(viewP1.x + viewRect.width + motionX/2, 0, r.image.cols), clamp(viewP1.y + viewRect.height + motionY/2, 0, r.image.rows));
-    //viewP1.x = viewP1.x - motionX/2;
-    //viewP1.y = viewP1.y - motionY/2;
-    cv::Rect stabilizedRect(viewP1, viewP2);
-    heuristic_viewRect = stabilizedRect;
-    // Make view window reference image
-    //cout << r.image.cols << " x " << r.image.rows << ": " << stabilizedRect.x << ", " << stabilizedRect.y << ", " << stabilizedRect.width << ", " << stabilizedRect.height << endl;
-    r.image = r.image(stabilizedRect); // Snip portion of frame to that of stabilizedRect
-    if(r.image.cols != viewRect.width || r.image.rows != viewRect.height) {
-      cv::resize(r.image, r.image, cv::Size(viewRect.width, viewRect.height));
-    }
-    //cout << motionX << ", " << motionY << " | " << r.image.cols << ", " << r.image.rows << " | " << viewRect.width << ", " << viewRect.height << "\n";
-
+    ProfileScope cropping(PROFILE_CROP);
+    cv::Mat cropped = outputPool.acquire(viewRect.size(), r.image.type()); // Never one the caller may still be sharing with the encoder
+    cropView(r.image, smoothedLoc, lastSmoothedPos, cv::Point2d(options.stretchX, options.stretchY), viewRect, refPos, cropped, &heuristic_viewRect);
+    cropping.stop();
 
     lastMatchPos = r.matchLoc;
-    image = r.image;
+    lastSmoothedPos = smoothedLoc;
+    ++outputCount;
+    if(! checkpoints.empty() && checkpoints.front().outputFrames == outputCount) {
+      checkpoints.front().lastMatchPos = lastMatchPos;
+      checkpoints.front().lastSmoothedPos = lastSmoothedPos;
+    } else if(isCheckpointDue(outputCount) && pushedCount == outputCount) { // Nothing held for smoothing (no smoothing window)
+      checkpoints.push_back(makeCheckpoint(r.number + 1));
+    }
+    lastLatency = std::chrono::duration<double>(std::chrono::steady_clock::now() - r.decodedAt).count();
+    image = cropped;
   }
 
-  static void stabilize(unsigned long* frameCount, mutex* frameMtx, cv::VideoCapture* cap, AtomicPriorityQueue<Frame>* outputQueue, std::condition_variable* popNotify, std::atomic<int>* dispatchCount, std::atomic<bool>* emergencyStop, cv::Rect viewRect, cv::Mat refImg, cv::Point refPos) {
-    // Find original offset from the matchRect to the viewRect
-    int offsetX = viewRect.x - refPos.x;
-    int offsetY = viewRect.y - refPos.y;
+  // Crops the view window out of image, for a frame whose (smoothed) match position is matchLoc, when the last frame's was lastLoc.
+  // The window's source region is stretched by stretch times half of the motion between the two, and scaled back to the view size.
+  // Stores the source region, rounded, in sourceRect if given.
+  static void cropView(const cv::Mat& image, cv::Point2f matchLoc, cv::Point2f lastLoc, cv::Point2d stretch, cv::Rect viewRect, cv::Point refPos, cv::Mat& cropped, cv::Rect* sourceRect = nullptr) {
+    float motionX = (matchLoc.x - lastLoc.x) * stretch.x;
+    float motionY = (matchLoc.y - lastLoc.y) * stretch.y;
+
+    // Source region of the view window, at sub-pixel precision. Motion stretches it, and it is scaled back to the view size below.
+    float offsetX = viewRect.x - refPos.x;
+    float offsetY = viewRect.y - refPos.y;
+    float viewX = std::clamp(matchLoc.x + offsetX, 0.0f, (float) (image.cols - viewRect.width));
+    float viewY = std::clamp(matchLoc.y + offsetY, 0.0f, (float) (image.rows - viewRect.height));
+    float viewWidth = std::max(std::clamp(viewX + viewRect.width + motionX/2, 0.0f, (float) image.cols) - viewX, 1.0f);
+    float viewHeight = std::max(std::clamp(viewY + viewRect.height + motionY/2, 0.0f, (float) image.rows) - viewY, 1.0f);
+    if(sourceRect)
+      *sourceRect = cv::Rect(cvRound(viewX), cvRound(viewY), cvRound(viewWidth), cvRound(viewHeight));
+
+    // Extract the view window in one pass: a sub-pixel translation plus the motion stretch, straight into a view-sized image.
+    // The map takes destination pixel centers to source coordinates, the same way cv::resize samples.
+    double scaleX = viewWidth / viewRect.width;
+    double scaleY = viewHeight / viewRect.height;
+    cv::Matx23d toSource(scaleX, 0, viewX + 0.5 * scaleX - 0.5,
+                         0, scaleY, viewY + 0.5 * scaleY - 0.5);
+    cv::warpAffine(image, cropped, toSource, viewRect.size(), cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_REPLICATE);
+  }
+
+  // Takes the checkpoint at the end of the frames cropped so far, if they end on a multiple of options.checkpointFrames. Call after
+  // each ">>"; once the frames before the checkpoint are safely written, Checkpoint::write() it to be able to resume from there.
+  bool takeCheckpoint(Checkpoint& checkpoint) {
+    if(checkpoints.empty() || checkpoints.front().outputFrames > outputCount)
+      return false;
+    checkpoint = std::move(checkpoints.front());
+    checkpoints.pop_front();
+    return true;
+  }
+
+  private:
+  bool isCheckpointDue(long frames) {
+    return options.checkpointFrames > 0 && frames % options.checkpointFrames == 0 && frames > firstOutput;
+  }
+
+  // The checkpoint after the frames pushed into the smoother so far. Frames from nextFrame on will be decoded again when resuming,
+  // so the smoothing resumes from its state before the next one is pushed, with the frames held back for smoothing treated as written.
+  // The positions of the last frame written are filled in by ">>" once it is cropped.
+  Checkpoint makeCheckpoint(long nextFrame) {
+    Checkpoint checkpoint;
+    checkpoint.outputFrames = pushedCount;
+    checkpoint.nextFrame = nextFrame;
+    checkpoint.smoother = smoother;
+    checkpoint.smoother.markTaken();
+    checkpoint.lastMatchPos = lastMatchPos;
+    checkpoint.lastSmoothedPos = lastSmoothedPos;
+    return checkpoint;
+  }
+
+  // Waits until the next frame in order is available, and takes it. Returns false at the end of the stream.
+  bool retire(Frame& r) {
+    {
+      std::scoped_lock lk(popMutex);
+      ProfileScope waiting(PROFILE_RETIRE_WAIT);
+      do {
+        if(! outputQueue.pop(r)) // End of stream: every worker has exited
+          return false;
+      } while(r.image.empty()); // A frame a segment decoder couldn't read
+      ++retiredCount;
+    }
+    return true;
+  }
+
+  // Retires frames into the smoother until it has enough frames after the oldest held one, then takes that one, with its smoothed
+  // match position. Returns false at the end of the stream.
+  bool retireSmoothed(Frame& r, cv::Point2f& smoothedLoc) {
+    while(! smoother.ready() && ! retiredAll) {
+      Frame next;
+      if(! retire(next)) {
+        retiredAll = true;
+        smoother.finish();
+        break;
+      }
+      if(isCheckpointDue(pushedCount) && pushedCount > outputCount) // Otherwise, ">>" made it already
+        checkpoints.push_back(makeCheckpoint(next.number));
+      smoother.push(next.matchLoc.x, next.matchLoc.y);
+      ++pushedCount;
+      pending[(pendingHead + pendingCount++) % pending.size()] = std::move(next);
+    }
+    if(! smoother.ready())
+      return false;
+    double x, y;
+    smoother.next(&x, &y);
+    smoothedLoc = cv::Point2f(x, y);
+    r = std::move(pending[pendingHead]);
+    pendingHead = (pendingHead + 1) % pending.size();
+    --pendingCount;
+    return true;
+  }
+
+  // Producer stage: decodes frames in order into the prefetch ring, waiting whenever the in-flight window is full.
+  // Closes the prefetch ring at the end of the video, so that the workers drain it and exit.
+  static void decode(cv::VideoCapture* cap, unsigned long* frameCount, FramePool* framePool, BoundedQueue<Frame>* prefetchQueue, ReorderBuffer<Frame>* window, std::atomic<bool>* emergencyStop, std::atomic<long>* decodeNanos, WorkerPool* pool) {
+    cv::Size size(cap->get(cv::CAP_PROP_FRAME_WIDTH), cap->get(cv::CAP_PROP_FRAME_HEIGHT));
+    Profiler::nameThread("decoder");
+    while(emergencyStop->load(std::memory_order_relaxed) == false) {
+      Frame frame;
+      frame.number = *frameCount + 1;
+      ProfileScope waiting(PROFILE_DECODE_WAIT);
+      if(! window->reserve(frame.number)) break; // Stopped while waiting for the retire side to catch up
+      waiting.stop();
+      auto start = std::chrono::steady_clock::now();
+      frame.decodedAt = start;
+      ProfileScope decoding(PROFILE_DECODE);
+      frame.image = framePool->acquire(size, CV_8UC3); // Decoding into a buffer of the right size reuses it
+      *cap >> frame.image;
+      decoding.stop();
+      decodeNanos->fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+      if(frame.image.empty()) break; // End of the video
+      size = frame.image.size();
+      *frameCount = frame.number;
+      ProfileScope pushing(PROFILE_PREFETCH_PUSH);
+      if(! prefetchQueue->push(frame)) break; // Stopped while waiting for a free worker
+      if(pool)
+        pool->notify();
+    }
+    prefetchQueue->close();
+    if(pool)
+      pool->notify(true); // So that a worker sees the end of the stream
+  }
+
+  // Producer stage, when decoding in segments: each decoder claims the next unclaimed segment, seeks to it with its own capture, and
+  // decodes it into the prefetch ring, until none are left. The last segment runs on to the end of the video. Frames that can't be
+  // read are still sent on as empty images, so that the reorder buffer sees every number (and skips them) rather than waiting forever.
+  // The last decoder to finish closes the prefetch ring.
+  static void decodeSegments(std::string path, const std::vector<FrameRange>* segments, std::atomic<int>* nextSegment, std::atomic<int>* decodersLeft, FramePool* framePool, BoundedQueue<Frame>* prefetchQueue, ReorderBuffer<Frame>* window, std::atomic<bool>* emergencyStop, std::atomic<long>* decodeNanos, std::atomic<long>* droppedFrames, WorkerPool* pool) {
+    cv::VideoCapture cap(path);
+    cv::Size size(cap.get(cv::CAP_PROP_FRAME_WIDTH), cap.get(cv::CAP_PROP_FRAME_HEIGHT));
+    long position = 0; // Index of the next frame cap reads
+    bool stopped = false;
+    while(! stopped && emergencyStop->load(std::memory_order_relaxed) == false) {
+      int s = nextSegment->fetch_add(1, std::memory_order_relaxed);
+      if(s >= (int) segments->size()) break;
+      const FrameRange& range = (*segments)[s];
+      bool last = s == (int) segments->size() - 1;
+      bool readable = cap.isOpened();
+      if(readable && position != range.start) {
+        readable = seekTo(cap, path, range.start);
+        position = range.start;
+      }
+      for(long index = range.start; last || index < range.end; ++index) {
+        Frame frame;
+        frame.number = index + 1;
+        ProfileScope waiting(PROFILE_DECODE_WAIT);
+        if(! window->reserve(frame.number) || emergencyStop->load(std::memory_order_relaxed)) {
+          stopped = true;
+          break;
+        }
+        waiting.stop();
+        if(readable) {
+          auto start = std::chrono::steady_clock::now();
+          frame.decodedAt = start;
+          ProfileScope decoding(PROFILE_DECODE);
+          frame.image = framePool->acquire(size, CV_8UC3);
+          readable = cap.read(frame.image) && ! frame.image.empty();
+          decoding.stop();
+          decodeNanos->fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+          if(readable) {
+            ++position;
+            size = frame.image.size();
+          }
+        }
+        if(! readable) {
+          if(last) break; // End of the video
+          frame.image = cv::Mat();
+          droppedFrames->fetch_add(1, std::memory_order_relaxed);
+        }
+        ProfileScope pushing(PROFILE_PREFETCH_PUSH);
+        if(! prefetchQueue->push(frame)) {
+          stopped = true;
+          break;
+        }
+        if(pool)
+          pool->notify();
+      }
+    }
+    if(decodersLeft->fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      prefetchQueue->close();
+      if(pool)
+        pool->notify(true);
+    }
+  }
+
+  // Finds the match location of a decoded frame (converting it to grayscale first if options.grayscale), or takes it from the
+  // trajectory if it covers the frame. Counts searches within a predicted window, and the ones that missed, into predictions and misses.
+  static void matchFrame(Frame& frame, MotionEstimator* estimator, MatchHistory* matchHistory, FramePool* grayPool, const StabilizerOptions& options, const TrajectoryReader* trajectory, long* predictions, long* misses) {
+    if(options.grayscale && frame.image.channels() == 3) {
+      ProfileScope converting(PROFILE_GRAYSCALE);
+      cv::Mat gray = grayPool->acquire(frame.image.size(), CV_8UC1); // The colour buffer goes back to its pool once replaced
+      cv::cvtColor(frame.image, gray, cv::COLOR_BGR2GRAY);
+      frame.image = gray;
+    }
+    const TrajectoryRecord* known = trajectory ? trajectory->find(frame.number) : nullptr;
+    if(known) { // Already analyzed
+      frame.matchLoc = cv::Point2f(known->matchX, known->matchY);
+      frame.score = known->score;
+      frame.flags = known->flags;
+      return;
+    }
+    // Locate the reference point to determine view window location, and save it to the frame.
+    // Try a small window around where nearby frames suggest it is first, if enabled.
+    bool matched = false;
+    double score = 0;
+    cv::Point2f predicted;
+    frame.flags = 0;
+    if(options.searchRadius > 0 && matchHistory->predict(frame.number, &predicted)) {
+      ++*predictions;
+      matched = estimator->estimateNear(frame.image, predicted, options.searchRadius, &frame.matchLoc, &score);
+      frame.flags = matched ? TRAJECTORY_WINDOW_HIT : TRAJECTORY_WINDOW_MISS;
+      if(! matched) ++*misses;
+    }
+    if(! matched)
+      frame.matchLoc = estimator->estimate(frame.image, &score);
+    frame.score = score;
+    matchHistory->record(frame.number, frame.matchLoc);
+  }
+
+  static void stabilize(BoundedQueue<Frame>* prefetchQueue, ReorderBuffer<Frame>* outputQueue, std::atomic<int>* dispatchCount, std::atomic<bool>* emergencyStop, MatchHistory* matchHistory, std::atomic<long>* matchFallbacks, std::atomic<long>* windowPredictions, std::atomic<long>* windowFallbacks, FramePool* grayPool, StabilizerOptions options, const TrajectoryReader* trajectory, cv::Mat refImg, cv::Point refPos) {
+    if(options.grayscale && refImg.channels() == 3)
+      cv::cvtColor(refImg, refImg, cv::COLOR_BGR2GRAY);
+    std::unique_ptr<MotionEstimator> estimator = createMotionEstimator(options, refImg, refPos); // Per-thread matching state and scratch images
+    long predictions = 0, misses = 0;
+    Frame frame;
+    Profiler::nameThread("worker");
     while(emergencyStop->load(std::memory_order_relaxed) == false) {
-      Frame frame(frameCount, frameMtx, cap); // Synchronously grab next frame
-      if(frame.image.empty()) break;
-      // Template match reference point to determine view window location
-      cv::Mat diffImg;
-      cv::matchTemplate(frame.image, refImg, diffImg, cv::TM_CCOEFF_NORMED);
-      double minVal, maxVal;
-      cv::Point minLoc, maxLoc;
-      cv::minMaxLoc(diffImg, &minVal, &maxVal, &minLoc, &maxLoc);
-      
-      // Save reference match location to frame
-      frame.matchLoc = maxLoc;
-
-      // Place frame in atomic priority queue (in order)
-      outputQueue->push(frame);
-      popNotify->notify_all(); // Notify popper
-    }
-    dispatchCount->fetch_sub(1, std::memory_order_relaxed); // Decrement number of threads running as it exits
+      ProfileScope waiting(PROFILE_FRAME_WAIT);
+      if(! prefetchQueue->pop(frame)) break; // The decoder has reached the end of the video
+      waiting.stop();
+      if(frame.image.empty()) { // Couldn't be decoded; pass it on to be skipped in order
+        if(! outputQueue->publish(frame.number, frame)) break;
+        continue;
+      }
+      matchFrame(frame, estimator.get(), matchHistory, grayPool, options, trajectory, &predictions, &misses);
+      // Place frame in its slot of the reorder buffer; this only wakes the popper if it is the frame it waits for
+      ProfileScope publishing(PROFILE_PUBLISH);
+      if(! outputQueue->publish(frame.number, frame)) break; // Stopped while waiting for space
+    }
+    matchFallbacks->fetch_add(estimator->getFallbackCount(), std::memory_order_relaxed);
+    windowPredictions->fetch_add(predictions, std::memory_order_relaxed);
+    windowFallbacks->fetch_add(misses, std::memory_order_relaxed);
+    if(dispatchCount->fetch_sub(1, std::memory_order_acq_rel) == 1) // Decrement number of threads running as it exits
+      outputQueue->close(); // The last worker out marks the end of the stream
   }
   
 };
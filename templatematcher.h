@@ -0,0 +1,175 @@
+#ifndef templatematcher_h
+#define templatematcher_h
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <vector>
+#include "motionestimator.h"
+#include "profiler.h"
+#include "nccmatcher.h"
+
+/* Locates a reference image within video frames with cv::matchTemplate (TM_CCOEFF_NORMED).
+ With pyramid levels enabled, the reference is first found in a downscaled copy of the frame, then refined within a small window
+ at each finer level up to full resolution; a full-resolution search over the whole frame is the fallback when the refined match
+ scores poorly. Full-resolution peaks are refined to sub-pixel precision by fitting a parabola through the correlation scores
+ around them. Grayscale references are scored with NccKernel instead of matchTemplate where the search area is small enough for
+ direct correlation to win. Each instance keeps its own scratch images, so use one per thread. */
+class TemplateMatcher : public MotionEstimator {
+private:
+  std::vector<cv::Mat> refPyramid; // refPyramid[0] is the reference itself; each further level is half the size of the last
+  std::vector<cv::Mat> framePyramid; // Scratch: downscaled copies of the current frame
+  std::vector<NccKernel> nccKernels; // For each level of refPyramid, if the reference is 8-bit grayscale
+  cv::Mat diffImg; // Scratch: matchTemplate output
+  double minScore; // Refined matches scoring below this fall back to a full search
+  double nearMinScore; // Search-window matches scoring below this are rejected
+  int searchRadius; // How far (in pixels, at each level) the refinement window extends around the position found one level up
+  long fallbackCount;
+  static constexpr double nccMaxWork = 1 << 25; // Searches needing more multiply-adds than this go to matchTemplate, which uses the DFT
+
+  // Refines an integer peak of diffImg to sub-pixel precision along each axis, with the vertex of the parabola through the peak and
+  // its two neighbours. Peaks on the edge of diffImg are left as they are along that axis.
+  cv::Point2f refinePeak(cv::Point peak) {
+    cv::Point2f refined(peak.x, peak.y);
+    float c = diffImg.at<float>(peak.y, peak.x);
+    if(peak.x > 0 && peak.x < diffImg.cols - 1) {
+      float l = diffImg.at<float>(peak.y, peak.x - 1), r = diffImg.at<float>(peak.y, peak.x + 1);
+      float curvature = l - 2 * c + r;
+      if(curvature < 0) // A real maximum
+        refined.x += std::clamp(0.5f * (l - r) / curvature, -0.5f, 0.5f);
+    }
+    if(peak.y > 0 && peak.y < diffImg.rows - 1) {
+      float u = diffImg.at<float>(peak.y - 1, peak.x), d = diffImg.at<float>(peak.y + 1, peak.x);
+      float curvature = u - 2 * c + d;
+      if(curvature < 0)
+        refined.y += std::clamp(0.5f * (u - d) / curvature, -0.5f, 0.5f);
+    }
+    return refined;
+  }
+
+  // Fills diffImg with the TM_CCOEFF_NORMED score of reference pyramid level "level" at every position in image
+  void scoreAll(const cv::Mat& image, int level) {
+    const cv::Mat& ref = refPyramid[level];
+    NccKernel& kernel = nccKernels[level];
+    ProfileScope matching(PROFILE_MATCH_TEMPLATE);
+    double work = (double) (image.cols - ref.cols + 1) * (image.rows - ref.rows + 1) * ref.total(); // Multiply-adds, done directly
+    if(image.type() == CV_8UC1 && kernel.isReady() && work <= nccMaxWork) {
+      diffImg.create(image.rows - ref.rows + 1, image.cols - ref.cols + 1, CV_32F);
+      kernel.match(image.data, image.step, image.cols, image.rows, (float*) diffImg.data, diffImg.step);
+      return;
+    }
+    cv::matchTemplate(image, ref, diffImg, cv::TM_CCOEFF_NORMED);
+  }
+
+  // Scores reference pyramid level "level" over the given region of image (the whole image if region is empty), and returns the best
+  // top-left position, refined to sub-pixel precision if subpixel is set
+  cv::Point2f matchIn(const cv::Mat& image, int level, cv::Rect region, double* score, bool subpixel = false) {
+    const cv::Mat& ref = refPyramid[level];
+    cv::Point offset(0, 0);
+    cv::Mat searched = image;
+    if(region.area() > 0) {
+      region &= cv::Rect(0, 0, image.cols, image.rows);
+      if(region.width < ref.cols || region.height < ref.rows) // Clipped too small to contain the reference; search everything
+        region = cv::Rect(0, 0, image.cols, image.rows);
+      searched = image(region);
+      offset = region.tl();
+    }
+    scoreAll(searched, level);
+    double minVal, maxVal;
+    cv::Point minLoc, maxLoc;
+    ProfileScope locating(PROFILE_MIN_MAX_LOC);
+    cv::minMaxLoc(diffImg, &minVal, &maxVal, &minLoc, &maxLoc);
+    locating.stop();
+    *score = maxVal;
+    if(subpixel)
+      return refinePeak(maxLoc) + cv::Point2f(offset.x, offset.y);
+    return cv::Point2f(maxLoc.x + offset.x, maxLoc.y + offset.y);
+  }
+
+public:
+  // pyramidLevels is the number of downscaled levels to search through before full resolution (0 always searches the whole frame).
+  // It is reduced if the reference would become too small to match reliably.
+  // nearMinScore is the score below which estimateNear() rejects a match.
+  TemplateMatcher(const cv::Mat& refImg, int pyramidLevels = 0, double minScore = 0.5, double nearMinScore = 0.7, int searchRadius = 4) {
+    this->minScore = minScore;
+    this->nearMinScore = nearMinScore;
+    this->searchRadius = searchRadius;
+    fallbackCount = 0;
+    refPyramid.push_back(refImg);
+    for(int level = 1; level <= pyramidLevels; ++level) {
+      const cv::Mat& prev = refPyramid.back();
+      if(prev.cols / 2 < 8 || prev.rows / 2 < 8) break; // Keep at least 8x8 pixels of reference to correlate against
+      cv::Mat down;
+      cv::pyrDown(prev, down);
+      refPyramid.push_back(down);
+    }
+    framePyramid.resize(refPyramid.size());
+    nccKernels.resize(refPyramid.size());
+    for(size_t level = 0; level < refPyramid.size(); ++level) {
+      const cv::Mat& ref = refPyramid[level];
+      if(ref.type() == CV_8UC1)
+        nccKernels[level].setTemplate(ref.data, ref.step, ref.cols, ref.rows);
+    }
+  }
+
+  int getPyramidLevels() { return refPyramid.size() - 1; }
+
+  // Number of frames where the pyramid search scored too low and the whole frame was searched instead
+  long getFallbackCount() override { return fallbackCount; }
+
+  // Searches for the reference only within radius pixels of the predicted top-left position, at full resolution.
+  // Returns false if the best match there scores below nearMinScore, or lies on the edge of the window (the reference has probably
+  // moved further than the window reaches), in which case the caller should search wider. Otherwise stores it in loc and score.
+  bool estimateNear(const cv::Mat& image, cv::Point2f predicted, int radius, cv::Point2f* loc, double* score = nullptr) override {
+    const cv::Mat& ref = refPyramid[0];
+    cv::Rect window = cv::Rect(cvRound(predicted.x) - radius, cvRound(predicted.y) - radius, ref.cols + 2 * radius, ref.rows + 2 * radius) & cv::Rect(0, 0, image.cols, image.rows);
+    if(window.width < ref.cols || window.height < ref.rows) return false; // Predicted off the frame
+    scoreAll(image(window), 0);
+    double minVal, maxVal;
+    cv::Point minLoc, maxLoc;
+    ProfileScope locating(PROFILE_MIN_MAX_LOC);
+    cv::minMaxLoc(diffImg, &minVal, &maxVal, &minLoc, &maxLoc);
+    locating.stop();
+    if(maxVal < nearMinScore) return false;
+    // A peak on a window edge is only trustworthy where that edge is also the edge of the frame
+    if((maxLoc.x == 0 && window.x > 0) || (maxLoc.y == 0 && window.y > 0) ||
+       (maxLoc.x == diffImg.cols - 1 && window.x + window.width < image.cols) || (maxLoc.y == diffImg.rows - 1 && window.y + window.height < image.rows))
+      return false;
+    *loc = refinePeak(maxLoc) + cv::Point2f(window.x, window.y);
+    if(score) *score = maxVal;
+    return true;
+  }
+
+  // Returns the top-left position of the best match of the reference in image. If score is given, stores the match's score there.
+  cv::Point2f estimate(const cv::Mat& image, double* score = nullptr) override {
+    double maxVal;
+    int levels = refPyramid.size() - 1;
+    if(levels == 0) {
+      cv::Point2f loc = matchIn(image, 0, cv::Rect(), &maxVal, true);
+      if(score) *score = maxVal;
+      return loc;
+    }
+
+    // Build the frame's pyramid, reusing the scratch images
+    framePyramid[0] = image;
+    for(int level = 1; level <= levels; ++level)
+      cv::pyrDown(framePyramid[level - 1], framePyramid[level]);
+
+    // Full search at the coarsest level, then refine around twice the position found at each finer level
+    cv::Point2f loc = matchIn(framePyramid[levels], levels, cv::Rect(), &maxVal);
+    for(int level = levels - 1; level >= 0; --level) {
+      const cv::Mat& ref = refPyramid[level];
+      cv::Rect window(cvRound(loc.x) * 2 - searchRadius, cvRound(loc.y) * 2 - searchRadius, ref.cols + 2 * searchRadius, ref.rows + 2 * searchRadius);
+      loc = matchIn(framePyramid[level], level, window, &maxVal, level == 0);
+    }
+    framePyramid[0] = cv::Mat(); // Don't keep a reference to the caller's frame
+
+    if(maxVal < minScore) { // Low confidence: the coarse levels may have locked onto the wrong feature
+      ++fallbackCount;
+      loc = matchIn(image, 0, cv::Rect(), &maxVal, true);
+    }
+    if(score) *score = maxVal;
+    return loc;
+  }
+};
+
+#endif
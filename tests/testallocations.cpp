@@ -0,0 +1,178 @@
+#ifndef testallocations_h
+#define testallocations_h
+
+#include <opencv2/opencv.hpp>
+#include "../framepool.h"
+#include "../boundedqueue.h"
+#include "../reorderbuffer.h"
+#include "../matchhistory.h"
+#include "../trajectorysmoother.h"
+#include "../templatematcher.h"
+#include "../pointcloudtracker.h"
+#include "../stabilizer.h"
+#include "../bench/syntheticvideo.h"
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Counts every heap allocation made through operator new. cv::Mat buffers are counted too: each one gets a UMatData header
+// allocated with new.
+static std::atomic<long> allocationCount(0);
+
+void* operator new(std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size ? size : 1);
+  if(! p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](std::size_t size) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  void* p = std::malloc(size ? size : 1);
+  if(! p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+class TestAllocations {
+  private:
+  struct TestFrame {
+    long number = 0;
+    cv::Point2f matchLoc;
+    cv::Mat image;
+  };
+
+  public:
+  TestAllocations() {
+  }
+
+  // Buffers come back to the pool once every other reference is dropped, and only then
+  void testRecycling() {
+    FramePool pool(2);
+    cv::Mat a = pool.acquire(cv::Size(64, 48), CV_8UC3);
+    const uchar* aData = a.data;
+    cv::Mat b = pool.acquire(cv::Size(64, 48), CV_8UC3);
+    assert(b.data != aData);
+    cv::Mat shared = a;
+    a.release();
+    cv::Mat c = pool.acquire(cv::Size(64, 48), CV_8UC3); // "shared" still holds a's buffer, and b is in use, so this misses
+    assert(c.data != aData && c.data != b.data);
+    assert(pool.getMissCount() == 1);
+    shared.release();
+    cv::Mat d = pool.acquire(cv::Size(64, 48), CV_8UC3);
+    assert(d.data == aData);
+  }
+
+  // Runs a synthetic clip through the stabilizer's stages, single-threaded, and checks that once warm, none of it allocates. Each frame
+  // is rendered straight into a pooled decode buffer (standing in for the decoder), goes through the prefetch ring, is converted to
+  // grayscale into a pooled buffer and located with a real TemplateMatcher (as Stabilizer::matchFrame does), goes through the match
+  // history, the reorder buffer and the smoothing ring, and is cropped into a pooled buffer with the real Stabilizer::cropView for the
+  // encoder queue. The calls counted are therefore cv::warpAffine (rendering and cropping), cv::cvtColor, TemplateMatcher::estimateNear
+  // (NccKernel and cv::minMaxLoc), and the queues, rings and pools. OpenCV runs single-threaded, as the stabilizer runs it by default:
+  // handing work to its thread pool allocates a job per call.
+  // PointCloudTracker::update runs on every cropped frame too, but outside the count: cv::calcOpticalFlowPyrLK allocates its derivative
+  // buffers afresh on each call, and FAST detection its own scratch. It still has to let go of the cropped frames, which the output
+  // pool's miss count checks.
+  void testSteadyState() {
+    const cv::Size refSize(24, 16);
+    const cv::Rect view(30, 20, 100, 80);
+    const int window = 8, smoothing = 5, writeQueue = 4, searchRadius = 6;
+    const long warmUp = 60, frameCount = 460;
+    cv::setNumThreads(1);
+    SyntheticVideo video(cv::Size(160, 120), frameCount, refSize, 0.5f); // Gentle enough for every frame to be found near its prediction
+    cv::Mat refImg;
+    cv::cvtColor(video.refImg, refImg, cv::COLOR_BGR2GRAY); // Grayscale, so that it is scored with NccKernel
+    TemplateMatcher matcher(refImg);
+    PointCloudTracker tracker;
+    FramePool decodePool(4 + 2);
+    FramePool grayPool(window + 4 + smoothing + 4);
+    FramePool outputPool(writeQueue + 3);
+    BoundedQueue<TestFrame> prefetch(4);
+    ReorderBuffer<TestFrame> reorder(window);
+    MatchHistory history(2 * window);
+    TrajectorySmoother smoother(TrajectorySmoother::KALMAN, smoothing);
+    std::vector<TestFrame> pending(smoothing + 1);
+    size_t pendingHead = 0, pendingCount = 0;
+    BoundedQueue<cv::Mat> encodeQueue(writeQueue);
+    cv::Point2f lastLoc;
+    long retired = 0, trackerAllocations = 0;
+
+    auto runFrames = [&](long first, long last) {
+      for(long n = first; n <= last; ++n) {
+        // Decode
+        TestFrame frame;
+        frame.number = n;
+        assert(reorder.reserve(n));
+        frame.image = decodePool.acquire(video.getSize(), CV_8UC3);
+        video.render(n - 1, frame.image); // Frames are numbered from 1
+        assert(prefetch.push(frame));
+        // Match
+        TestFrame work;
+        assert(prefetch.pop(work));
+        cv::Mat gray = grayPool.acquire(work.image.size(), CV_8UC1);
+        cv::cvtColor(work.image, gray, cv::COLOR_BGR2GRAY);
+        work.image = gray;
+        cv::Point2f predicted;
+        if(! history.predict(work.number, &predicted) || ! matcher.estimateNear(work.image, predicted, searchRadius, &work.matchLoc)) {
+          assert(n == 1); // Only the first frame has nothing to predict from
+          work.matchLoc = matcher.estimate(work.image);
+        }
+        cv::Point2f error = work.matchLoc - video.truth[n - 1];
+        assert(error.dot(error) < 1);
+        history.record(work.number, work.matchLoc);
+        assert(reorder.publish(work.number, work));
+        // Retire, smooth, crop, track and encode
+        TestFrame next;
+        assert(reorder.pop(next));
+        smoother.push(next.matchLoc.x, next.matchLoc.y);
+        pending[(pendingHead + pendingCount++) % pending.size()] = std::move(next);
+        while(smoother.ready()) {
+          double x, y;
+          smoother.next(&x, &y);
+          TestFrame r = std::move(pending[pendingHead]);
+          pendingHead = (pendingHead + 1) % pending.size();
+          --pendingCount;
+          cv::Point2f smoothedLoc(x, y);
+          cv::Mat cropped = outputPool.acquire(view.size(), r.image.type());
+          Stabilizer::cropView(r.image, smoothedLoc, retired > 0 ? lastLoc : smoothedLoc, cv::Point2d(0.5, 0.5), view, video.refPos, cropped);
+          lastLoc = smoothedLoc;
+          long beforeTracking = allocationCount.load();
+          tracker.update(cropped);
+          trackerAllocations += allocationCount.load() - beforeTracking;
+          assert(encodeQueue.push(cropped));
+          cv::Mat encoded;
+          assert(encodeQueue.pop(encoded));
+          ++retired;
+        }
+      }
+    };
+
+    runFrames(1, warmUp); // Warm up: fill the pools and rings, and size the matcher's and tracker's scratch
+    long before = allocationCount.load();
+    trackerAllocations = 0;
+    runFrames(warmUp + 1, frameCount);
+    long allocations = allocationCount.load() - before - trackerAllocations;
+    assert(allocations == 0);
+    assert(decodePool.getMissCount() == 0);
+    assert(grayPool.getMissCount() == 0);
+    assert(outputPool.getMissCount() == 0);
+    assert(retired == frameCount - smoothing);
+  }
+
+  void runtests() {
+    testRecycling();
+    testSteadyState();
+  }
+
+};
+
+int main() {
+  TestAllocations ta;
+  ta.runtests();
+}
+
+#endif
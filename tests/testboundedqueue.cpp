@@ -0,0 +1,133 @@
+#ifndef testboundedqueue_h
+#define testboundedqueue_h
+
+#include "../boundedqueue.h"
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+class TestBoundedQueue {
+  public:
+  TestBoundedQueue() {
+  }
+
+  // Items come out in the order they went in, and a closed queue still drains
+  void testFifoAndDrain() {
+    BoundedQueue<std::vector<int>> queue(3);
+    for(int i = 0; i < 3; ++i) {
+      std::vector<int> item(4, i);
+      assert(queue.push(item));
+    }
+    queue.close();
+    std::vector<int> item(1, 7);
+    assert(! queue.push(item));
+    for(int i = 0; i < 3; ++i) {
+      assert(queue.pop(item));
+      assert(item.size() == 4 && item[0] == i);
+    }
+    assert(! queue.pop(item));
+  }
+
+  // A producer blocked on a full queue accumulates wait time, and is released by close()
+  void testPushWaitsWhileFull() {
+    BoundedQueue<int> queue(1);
+    int item = 1;
+    assert(queue.push(item));
+    std::atomic<bool> returned(false);
+    std::thread producer([&]() {
+      int second = 2;
+      assert(! queue.push(second));
+      returned.store(true);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(! returned.load());
+    queue.close();
+    producer.join();
+    assert(queue.getPushWaitSeconds() > 0);
+  }
+
+  // Several producers and consumers pass every item through exactly once
+  void testManyToMany(int producerCount, int consumerCount, int itemsPerProducer) {
+    BoundedQueue<long> queue(4);
+    std::atomic<int> producersLeft(producerCount);
+    std::atomic<long> total(0);
+    std::atomic<long> popped(0);
+    std::vector<std::thread> threads;
+    for(int p = 0; p < producerCount; ++p) {
+      threads.emplace_back([&]() {
+        for(long i = 1; i <= itemsPerProducer; ++i)
+          assert(queue.push(i));
+        if(producersLeft.fetch_sub(1) == 1)
+          queue.close();
+      });
+    }
+    for(int c = 0; c < consumerCount; ++c) {
+      threads.emplace_back([&]() {
+        long item;
+        while(queue.pop(item)) {
+          total.fetch_add(item);
+          popped.fetch_add(1);
+        }
+      });
+    }
+    for(std::thread& t : threads)
+      t.join();
+    long perProducer = (long) itemsPerProducer * (itemsPerProducer + 1) / 2;
+    assert(popped.load() == (long) producerCount * itemsPerProducer);
+    assert(total.load() == perProducer * producerCount);
+  }
+
+  // tryPush() never waits: it refuses items while the queue is full or closed
+  void testTryPush() {
+    BoundedQueue<int> queue(2);
+    int item = 1;
+    assert(queue.tryPush(item));
+    item = 2;
+    assert(queue.tryPush(item));
+    item = 3;
+    assert(! queue.tryPush(item));
+    assert(item == 3);
+    assert(queue.pop(item) && item == 1);
+    item = 4;
+    assert(queue.tryPush(item));
+    queue.close();
+    assert(! queue.tryPush(item));
+    assert(queue.pop(item) && item == 2);
+    assert(queue.pop(item) && item == 4);
+    assert(! queue.pop(item));
+  }
+
+  void testTryPop() {
+    BoundedQueue<int> queue(2);
+    int item = 0;
+    assert(! queue.tryPop(item) && item == 0);
+    item = 5;
+    queue.push(item);
+    assert(queue.tryPop(item) && item == 5);
+    item = 6;
+    queue.push(item);
+    queue.close();
+    assert(! queue.isDrained());
+    assert(queue.tryPop(item) && item == 6);
+    assert(queue.isDrained());
+    assert(! queue.tryPop(item));
+  }
+
+  void runtests() {
+    testFifoAndDrain();
+    testTryPush();
+    testTryPop();
+    testPushWaitsWhileFull();
+    testManyToMany(1, 8, 20000);
+    testManyToMany(4, 4, 10000);
+  }
+
+};
+
+int main() {
+  TestBoundedQueue tb;
+  tb.runtests();
+}
+
+#endif
@@ -2,39 +2,78 @@
 #define testcalibrator_h
 
 #include "../calibrator.h"
+#include "../bench/syntheticvideo.h"
 #include <cassert>
+#include <cstdio>
+#include <string>
 #include <opencv2/opencv.hpp>
-#include <opencv2/imgproc.hpp>
-#include <opencv2/core/ocl.hpp>
-
-/*
-Mat getNextFrame() {
-    Mat frame;
-    cap >> frame;
-    if frame.empty() {
-      cap.set(CAP_PROP_POS_FRAMES, 0); // rewind to beginning
-      cap >> frame;
-    }
-    return frame;
-  }*/
 
 class TestCalibrator {
+  private:
+  std::string path = "/tmp/testcalibrator.avi";
+  SyntheticVideo video;
+
   public:
-  TestCalibrator() {
+  TestCalibrator(): video(cv::Size(640, 360), 90) {
+    assert(video.write(path));
+  }
+
+  ~TestCalibrator() {
+    std::remove(path.c_str());
   }
-  
+
   void testCalibratorDoesntAffectVideoCapture() {
-    cv::VideoCapture cap("yellowbreastedchat.mov");
-    Calibrator calibrator(cap);
-    assert(cap.get(cv::CAP_PROP_POS_FRAMES) == 0);
-    cv::Mat frame = calibrator.calibrate();
+    cv::VideoCapture cap(path);
+    assert(cap.isOpened());
+    cap.set(cv::CAP_PROP_POS_FRAMES, 7);
+    StabilizerOptions options;
+    Calibrator calibrator(&cap, video.refImg, video.refPos, cv::Rect(160, 90, 320, 180), options);
+    calibrator.sampleRuns = 3;
+    calibrator.runLength = 10;
+    assert(calibrator.calibrate());
+    assert(cap.get(cv::CAP_PROP_POS_FRAMES) == 7);
+  }
+
+  // The stretch found stays within its bounds, and jitters no more than the one started from
+  void testCalibrationImproves() {
+    cv::VideoCapture cap(path);
+    StabilizerOptions options;
+    options.stretchX = 0.5;
+    options.stretchY = 0.5;
+    Calibrator calibrator(&cap, video.refImg, video.refPos, cv::Rect(160, 90, 320, 180), options);
+    calibrator.sampleRuns = 4;
+    calibrator.threads = 2;
+    assert(calibrator.calibrate());
+    assert(calibrator.evaluations > 0);
+    assert(calibrator.loss <= calibrator.initialLoss);
+    assert(calibrator.stretchX >= -2 && calibrator.stretchX <= 2 && calibrator.stretchY >= -2 && calibrator.stretchY <= 2);
+  }
+
+  // Runs reaching the end of the video stop there, rather than wrapping around to its start
+  void testRunsEndWithVideo() {
+    cv::VideoCapture cap(path);
+    StabilizerOptions options;
+    Calibrator calibrator(&cap, video.refImg, video.refPos, cv::Rect(160, 90, 320, 180), options);
+    calibrator.sampleRuns = 2;
+    calibrator.runLength = video.getFrameCount() + 30;
+    assert(calibrator.calibrate());
     assert(cap.get(cv::CAP_PROP_POS_FRAMES) == 0);
+  }
 
-    
+  // Nothing to sample: the parameters are left alone
+  void testUnreadable() {
+    cv::VideoCapture cap;
+    StabilizerOptions options;
+    Calibrator calibrator(&cap, video.refImg, video.refPos, cv::Rect(160, 90, 320, 180), options);
+    assert(! calibrator.calibrate());
+    assert(calibrator.stretchX == options.stretchX && calibrator.stretchY == options.stretchY);
   }
 
   void runtests() {
-    testCalibratorDataGenDoesntAffectVideoCapture();
+    testCalibratorDoesntAffectVideoCapture();
+    testCalibrationImproves();
+    testRunsEndWithVideo();
+    testUnreadable();
   }
 
 };
@@ -44,4 +83,4 @@ int main() {
   tc.runtests();
 }
 
-#endif
\ No newline at end of file
+#endif
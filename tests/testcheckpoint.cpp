@@ -0,0 +1,66 @@
+#ifndef testcheckpoint_h
+#define testcheckpoint_h
+
+#include <opencv2/opencv.hpp>
+#include "../checkpoint.h"
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+class TestCheckpoint {
+  public:
+  TestCheckpoint() {
+  }
+
+  // Everything written is read back, including the smoothing state
+  void testRoundTrip() {
+    std::string path = "/tmp/testcheckpoint.checkpoint";
+    Checkpoint checkpoint;
+    checkpoint.outputFrames = 3600;
+    checkpoint.nextFrame = 3603;
+    checkpoint.lastMatchPos = cv::Point2f(101.25f, 57.5f);
+    checkpoint.lastSmoothedPos = cv::Point2f(100.75f, 58);
+    checkpoint.smoother.reset(TrajectorySmoother::GAUSSIAN, 5);
+    for(int i = 0; i < 8; ++i)
+      checkpoint.smoother.push(i, -i);
+    checkpoint.smoother.markTaken();
+    checkpoint.segmentFrames = 1800;
+    checkpoint.matchRect = cv::Rect(640, 300, 96, 64);
+    checkpoint.viewRect = cv::Rect(200, 100, 1280, 720);
+    assert(checkpoint.write(path));
+
+    Checkpoint read;
+    assert(read.read(path));
+    assert(read.outputFrames == 3600 && read.nextFrame == 3603 && read.segmentFrames == 1800);
+    assert(read.lastMatchPos == checkpoint.lastMatchPos && read.lastSmoothedPos == checkpoint.lastSmoothedPos);
+    assert(read.matchRect == checkpoint.matchRect && read.viewRect == checkpoint.viewRect);
+    assert(read.smoother.getWindow() == 5);
+    read.smoother.push(8, -8);
+    assert(! read.smoother.ready()); // Still waiting for the frames after the first one resumed
+    std::remove(path.c_str());
+  }
+
+  // Missing and corrupt checkpoints aren't read
+  void testInvalid() {
+    Checkpoint checkpoint;
+    assert(! checkpoint.read("/nonexistent/out.mp4.checkpoint"));
+    std::string path = "/tmp/testcheckpoint-corrupt.checkpoint";
+    std::ofstream(path) << "not a checkpoint";
+    assert(! checkpoint.read(path));
+    std::remove(path.c_str());
+  }
+
+  void runtests() {
+    testRoundTrip();
+    testInvalid();
+  }
+
+};
+
+int main() {
+  TestCheckpoint tc;
+  tc.runtests();
+}
+
+#endif
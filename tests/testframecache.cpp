@@ -0,0 +1,98 @@
+#ifndef testframecache_h
+#define testframecache_h
+
+#include <opencv2/opencv.hpp>
+#include "../framecache.h"
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+class TestFrameCache {
+  private:
+  std::string path = "/tmp/testframecache.avi";
+  int frameCount = 60;
+
+  // Brightness of frame i of the test video
+  static int level(int i) { return 20 + 3 * i; }
+
+  public:
+  TestFrameCache() {
+    cv::VideoWriter writer(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 25, cv::Size(640, 360), true);
+    assert(writer.isOpened());
+    for(int i = 0; i < frameCount; ++i)
+      writer.write(cv::Mat(360, 640, CV_8UC3, cv::Scalar(level(i), level(i), level(i))));
+    writer.release();
+  }
+
+  ~TestFrameCache() {
+    std::remove(path.c_str());
+  }
+
+  // Waits up to five seconds for frame pos at full resolution
+  bool waitForExact(FrameCache& cache, long pos, cv::Mat& frame) {
+    long shownPos;
+    for(int tries = 0; tries < 500; ++tries) {
+      if(cache.lookup(pos, frame, &shownPos))
+        return shownPos == pos;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  }
+
+  // Requested frames are decoded at full resolution, including after a newer request replaces an unfinished one
+  void testRequest() {
+    FrameCache cache(path, frameCount);
+    cv::Mat frame;
+    cache.request(10);
+    cache.request(37);
+    assert(waitForExact(cache, 37, frame));
+    assert(frame.size() == cv::Size(640, 360));
+    assert(std::abs(cv::mean(frame)[0] - level(37)) < 2);
+    cache.request(0);
+    assert(waitForExact(cache, 0, frame));
+    assert(std::abs(cv::mean(frame)[0] - level(0)) < 2);
+  }
+
+  // Thumbnails fill in over the whole video, and the nearest one is given for a frame not decoded in full
+  void testThumbnails() {
+    FrameCache cache(path, frameCount, 64, 6);
+    for(int tries = 0; tries < 500 && cache.getThumbnailCount() < 6; ++tries)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(! cache.hasFailed());
+    assert(cache.getThumbnailCount() == 6);
+    cv::Mat frame;
+    long shownPos;
+    assert(! cache.lookup(frameCount - 1, frame, &shownPos));
+    assert(frame.cols == 64 && frame.rows == 36);
+    assert(shownPos >= frameCount / 2 && shownPos < frameCount);
+    assert(std::abs(cv::mean(frame)[0] - level(shownPos)) < 2);
+  }
+
+  // A video that can't be opened is reported, and nothing is ever found
+  void testMissing() {
+    FrameCache cache("/nonexistent/video.mp4", 100);
+    for(int tries = 0; tries < 500 && ! cache.hasFailed(); ++tries)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(cache.hasFailed());
+    cv::Mat frame;
+    long shownPos;
+    assert(! cache.lookup(5, frame, &shownPos) && frame.empty() && shownPos == -1);
+  }
+
+  void runtests() {
+    testRequest();
+    testThumbnails();
+    testMissing();
+  }
+
+};
+
+int main() {
+  TestFrameCache tc;
+  tc.runtests();
+}
+
+#endif
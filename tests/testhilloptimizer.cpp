@@ -0,0 +1,79 @@
+#ifndef testhilloptimizer_h
+#define testhilloptimizer_h
+
+#include "../hilloptimizer.h"
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+class TestHillOptimizer {
+  public:
+  TestHillOptimizer() {
+  }
+
+  static double bowl(double x, double y) {
+    return (x - 1.3) * (x - 1.3) + 2 * (y + 0.7) * (y + 0.7);
+  }
+
+  // Evaluating whole rounds at once finds the minimum of a bowl
+  void testRounds() {
+    double x = 0, y = 0;
+    HillOptimizer<double> optimizer;
+    optimizer.addParam(&x, 0.5, 0.001);
+    optimizer.addParam(&y, 0.5, 0.001);
+    int rounds = 0;
+    while(true) {
+      std::vector<std::vector<double>> candidates = optimizer.getCandidates();
+      std::vector<double> losses;
+      for(const std::vector<double>& point : candidates)
+        losses.push_back(bowl(point[0], point[1]));
+      ++rounds;
+      if(! optimizer.update(candidates, losses))
+        break;
+    }
+    assert(rounds < 100);
+    assert(std::abs(x - 1.3) < 0.01 && std::abs(y + 0.7) < 0.01);
+    assert(optimizer.getBestLoss() == bowl(x, y));
+    assert(optimizer.isConverged());
+  }
+
+  // Evaluating one point at a time, with the parameters set to each in turn, ends on the same minimum
+  void testOneAtATime() {
+    double x = 0, y = 0;
+    HillOptimizer<double> optimizer;
+    optimizer.addParam(&x, 0.5, 0.001);
+    optimizer.addParam(&y, 0.5, 0.001);
+    int evaluations = 0;
+    while(optimizer.update(bowl(x, y)))
+      ++evaluations;
+    assert(evaluations < 500);
+    assert(std::abs(x - 1.3) < 0.01 && std::abs(y + 0.7) < 0.01);
+    assert(optimizer.getEvaluations() == evaluations + 1);
+  }
+
+  // The parameters stay within their bounds, and settle on the bound nearest the minimum
+  void testBounds() {
+    float x = 5, y = 0;
+    HillOptimizer<float> optimizer;
+    optimizer.addParam(&x, 0.25f, 0.001f, -1, 1);
+    optimizer.addParam(&y, 0.25f, 0.001f, -0.5f, 0.5f);
+    assert(x == 1); // Clamped to start with
+    while(optimizer.update(bowl(x, y)))
+      assert(x >= -1 && x <= 1 && y >= -0.5f && y <= 0.5f);
+    assert(x == 1 && y == -0.5f);
+  }
+
+  void runtests() {
+    testRounds();
+    testOneAtATime();
+    testBounds();
+  }
+
+};
+
+int main() {
+  TestHillOptimizer tc;
+  tc.runtests();
+}
+
+#endif
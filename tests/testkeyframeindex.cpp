@@ -0,0 +1,69 @@
+#ifndef testkeyframeindex_h
+#define testkeyframeindex_h
+
+#include "../keyframeindex.h"
+#include <cassert>
+#include <vector>
+
+class TestKeyframeIndex {
+  public:
+  TestKeyframeIndex() {
+  }
+
+  // Ranges are consecutive, cover every frame, and each (except maybe the last) starts on a keyframe and is long enough
+  void checkRanges(const std::vector<FrameRange>& ranges, long frameCount, long minFrames) {
+    assert(! ranges.empty());
+    assert(ranges.front().start == 0);
+    assert(ranges.back().end == frameCount);
+    for(size_t i = 0; i < ranges.size(); ++i) {
+      if(i > 0)
+        assert(ranges[i].start == ranges[i - 1].end);
+      if(i + 1 < ranges.size())
+        assert(ranges[i].end - ranges[i].start >= minFrames);
+    }
+  }
+
+  void testSplitEvenly() {
+    std::vector<FrameRange> ranges = KeyframeIndex::splitEvenly(1000, 60);
+    checkRanges(ranges, 1000, 60);
+    assert(ranges.size() == 17);
+    assert(ranges.back().start == 960);
+    ranges = KeyframeIndex::splitEvenly(0, 60);
+    assert(ranges.size() == 1 && ranges[0].start == 0 && ranges[0].end == 0);
+  }
+
+  // Without ffprobe output, the index is empty, and splitting still covers the (unknown, empty) video
+  void testEmptyIndex() {
+    KeyframeIndex index;
+    assert(! index.probe("/nonexistent/video.mp4"));
+    assert(index.getKeyframes().empty());
+    std::vector<FrameRange> ranges = index.split(60);
+    assert(ranges.size() == 1);
+  }
+
+  // Resuming part way drops the ranges before the resume point and trims the one it falls in; the last range always stays
+  void testStartAt() {
+    std::vector<FrameRange> ranges = KeyframeIndex::splitEvenly(1000, 60);
+    std::vector<FrameRange> kept = KeyframeIndex::startAt(ranges, 130);
+    assert(kept.size() == 15);
+    assert(kept[0].start == 130 && kept[0].end == 180);
+    assert(kept[1].start == 180 && kept.back().end == 1000);
+    kept = KeyframeIndex::startAt(ranges, 5000);
+    assert(kept.size() == 1 && kept[0].start == 5000);
+    assert(KeyframeIndex::startAt(ranges, 0).size() == ranges.size());
+  }
+
+  void runtests() {
+    testSplitEvenly();
+    testStartAt();
+    testEmptyIndex();
+  }
+
+};
+
+int main() {
+  TestKeyframeIndex tk;
+  tk.runtests();
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef testnccmatcher_h
+#define testnccmatcher_h
+
+#include <opencv2/opencv.hpp>
+#include "../nccmatcher.h"
+#include "../templatematcher.h"
+#include <cassert>
+#include <cmath>
+
+class TestNccMatcher {
+  private:
+  cv::Mat image;
+
+  public:
+  TestNccMatcher() {
+    cv::Mat noise(120, 160, CV_8UC1);
+    cv::randu(noise, 0, 256);
+    cv::GaussianBlur(noise, image, cv::Size(0, 0), 1.5); // Textured, but with the local correlation of real frames
+  }
+
+  // Every path scores every position within a small tolerance of matchTemplate, for the unrolled widths and others
+  void testMatchesOpenCV() {
+    for(int width : {5, 8, 16, 23, 24, 32, 48, 64, 70}) {
+      for(int height : {4, 16, 31}) {
+        cv::Mat templ = image(cv::Rect(37, 21, width, height)).clone();
+        templ.at<uchar>(0, 0) = 0; // Not an exact copy of the image anywhere
+        cv::Mat expected;
+        cv::matchTemplate(image, templ, expected, cv::TM_CCOEFF_NORMED);
+        for(NccPath path : {NCC_SCALAR, NCC_SSE41, NCC_AVX2, NCC_NEON}) {
+          if(! NccKernel::isSupported(path)) continue;
+          NccKernel kernel;
+          kernel.setPath(path);
+          assert(kernel.setTemplate(templ.data, templ.step, templ.cols, templ.rows));
+          cv::Mat scores(expected.size(), CV_32F);
+          kernel.match(image.data, image.step, image.cols, image.rows, (float*) scores.data, scores.step);
+          assert(cv::norm(scores, expected, cv::NORM_INF) < 1e-3);
+          cv::Point best;
+          cv::minMaxLoc(scores, nullptr, nullptr, nullptr, &best);
+          assert(best == cv::Point(37, 21));
+        }
+      }
+    }
+  }
+
+  // Searching a region that isn't a whole image (a strided view), and a template with no contrast, both work like matchTemplate
+  void testRegionsAndFlatTemplates() {
+    cv::Mat region = image(cv::Rect(30, 10, 60, 50));
+    cv::Mat templ = image(cv::Rect(41, 17, 16, 12)).clone();
+    cv::Mat expected, scores(region.rows - templ.rows + 1, region.cols - templ.cols + 1, CV_32F);
+    cv::matchTemplate(region, templ, expected, cv::TM_CCOEFF_NORMED);
+    NccKernel kernel;
+    assert(kernel.setTemplate(templ.data, templ.step, templ.cols, templ.rows));
+    kernel.match(region.data, region.step, region.cols, region.rows, (float*) scores.data, scores.step);
+    assert(cv::norm(scores, expected, cv::NORM_INF) < 1e-3);
+
+    cv::Mat flat(8, 8, CV_8UC1, cv::Scalar(100));
+    cv::matchTemplate(region, flat, expected, cv::TM_CCOEFF_NORMED);
+    scores.create(expected.size(), CV_32F);
+    assert(kernel.setTemplate(flat.data, flat.step, flat.cols, flat.rows));
+    kernel.match(region.data, region.step, region.cols, region.rows, (float*) scores.data, scores.step);
+    assert(cv::norm(scores, expected, cv::NORM_INF) < 1e-3);
+
+    cv::Mat huge(200, 200, CV_8UC1);
+    assert(! kernel.setTemplate(huge.data, huge.step, huge.cols, huge.rows));
+    assert(! kernel.isReady());
+  }
+
+  // TemplateMatcher finds a grayscale reference at the same place with the kernel as with matchTemplate on colour
+  void testTemplateMatcher() {
+    cv::Mat colour;
+    cv::cvtColor(image, colour, cv::COLOR_GRAY2BGR);
+    cv::Mat ref = image(cv::Rect(70, 50, 32, 24)).clone();
+    cv::Mat colourRef = colour(cv::Rect(70, 50, 32, 24)).clone();
+    TemplateMatcher gray(ref, 1), bgr(colourRef, 1);
+    cv::Point2f a = gray.estimate(image), b = bgr.estimate(colour);
+    assert(cv::norm(a - b) < 0.05);
+    assert(cv::norm(a - cv::Point2f(70, 50)) < 0.05);
+    cv::Point2f near;
+    assert(gray.estimateNear(image, cv::Point2f(72, 49), 8, &near));
+    assert(cv::norm(near - cv::Point2f(70, 50)) < 0.05);
+  }
+
+  void runtests() {
+    testMatchesOpenCV();
+    testRegionsAndFlatTemplates();
+    testTemplateMatcher();
+  }
+
+};
+
+int main() {
+  TestNccMatcher tn;
+  tn.runtests();
+}
+
+#endif
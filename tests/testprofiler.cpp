@@ -0,0 +1,101 @@
+#ifndef testprofiler_h
+#define testprofiler_h
+
+#include "../profiler.h"
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TestProfiler {
+  public:
+  TestProfiler() {
+  }
+
+  // Every duration lands in a bucket whose limit is at least the duration, and within 25% of it
+  void testBuckets() {
+    int last = -1;
+    for(uint64_t nanos = 0; nanos < 100000; ++nanos) {
+      int bucket = Profiler::getBucket(nanos);
+      assert(bucket >= last && bucket < Profiler::bucketCount);
+      last = bucket;
+      uint64_t limit = Profiler::getBucketLimit(bucket);
+      assert(limit >= nanos);
+      assert(limit <= nanos + nanos / 4);
+    }
+    assert(Profiler::getBucket(~0ULL) < Profiler::bucketCount);
+  }
+
+  void testPercentiles() {
+    Profiler::Histogram h;
+    for(uint64_t nanos = 1; nanos <= 1000; ++nanos)
+      h.add(nanos * 1000);
+    assert(h.count == 1000 && h.maxNanos == 1000000);
+    uint64_t p50 = h.getPercentile(0.5), p99 = h.getPercentile(0.99);
+    assert(p50 >= 500000 && p50 <= 625000);
+    assert(p99 >= 990000 && p99 <= 1000000);
+    assert(h.getPercentile(1) == 1000000);
+  }
+
+  // Nothing is recorded while disabled; once enabled, each thread's stages are counted, and traced on their own track
+  void testRecording() {
+    { ProfileScope scope(PROFILE_DECODE); }
+    assert(Profiler::getHistogram(PROFILE_DECODE).count == 0);
+
+    Profiler::enable(true);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 3; ++t) {
+      threads.emplace_back([]() {
+        Profiler::nameThread("worker");
+        for(int i = 0; i < 100; ++i) {
+          ProfileScope scope(PROFILE_MATCH_TEMPLATE);
+          ProfileScope stopped(PROFILE_MIN_MAX_LOC);
+          stopped.stop();
+          stopped.stop(); // Only counted once
+        }
+      });
+    }
+    for(std::thread& t : threads)
+      t.join();
+    Profiler::disable();
+    { ProfileScope scope(PROFILE_MATCH_TEMPLATE); }
+    assert(Profiler::getHistogram(PROFILE_MATCH_TEMPLATE).count == 300);
+    assert(Profiler::getHistogram(PROFILE_MIN_MAX_LOC).count == 300);
+
+    std::ostringstream table;
+    Profiler::printHistograms(table);
+    assert(table.str().find("matchTemplate") != std::string::npos);
+    assert(table.str().find("decode wait") == std::string::npos); // Stages that never ran are left out
+
+    std::string path = "/tmp/testprofiler-trace.json";
+    assert(Profiler::writeChromeTrace(path));
+    std::ifstream file(path);
+    std::stringstream trace;
+    trace << file.rdbuf();
+    std::string json = trace.str();
+    size_t events = 0;
+    for(size_t at = json.find("\"ph\":\"X\""); at != std::string::npos; at = json.find("\"ph\":\"X\"", at + 1))
+      ++events;
+    assert(events == 600);
+    assert(json.find("\"name\":\"worker ") != std::string::npos);
+    assert(json.rfind("]}") != std::string::npos);
+    std::remove(path.c_str());
+  }
+
+  void runtests() {
+    testBuckets();
+    testPercentiles();
+    testRecording();
+  }
+
+};
+
+int main() {
+  TestProfiler tp;
+  tp.runtests();
+}
+
+#endif
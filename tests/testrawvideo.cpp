@@ -0,0 +1,109 @@
+#ifndef testrawvideo_h
+#define testrawvideo_h
+
+#include <opencv2/opencv.hpp>
+#include "../rawvideo.h"
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class TestRawVideo {
+  private:
+  std::vector<cv::Mat> frames;
+
+  public:
+  TestRawVideo() {
+    for(int i = 0; i < 5; ++i) {
+      cv::Mat frame(48, 64, CV_8UC3);
+      cv::randu(frame, 0, 256);
+      cv::GaussianBlur(frame, frame, cv::Size(0, 0), 2); // Smooth, so that 4:2:0 chroma subsampling barely changes it
+      frames.push_back(frame);
+    }
+  }
+
+  // Writes the frames in a format, and reads them back
+  std::vector<cv::Mat> roundTrip(RawVideoFormat format) {
+    FILE* file = tmpfile();
+    RawVideoWriter writer;
+    assert(writer.open(file, format, frames[0].size(), 29.97));
+    for(const cv::Mat& frame : frames)
+      writer.write(frame);
+    writer.release();
+    rewind(file);
+
+    RawVideoReader reader;
+    assert(reader.open(file, format, frames[0].size(), 25));
+    assert(reader.get(cv::CAP_PROP_FRAME_WIDTH) == 64 && reader.get(cv::CAP_PROP_FRAME_HEIGHT) == 48);
+    if(format == RAW_Y4M)
+      assert(std::abs(reader.get(cv::CAP_PROP_FPS) - 29.97) < 0.001); // From the header, not the 25 given
+    std::vector<cv::Mat> read;
+    cv::Mat frame;
+    while(reader.read(frame))
+      read.push_back(frame.clone());
+    fclose(file);
+    return read;
+  }
+
+  void testRoundTrips() {
+    std::vector<cv::Mat> bgr = roundTrip(RAW_BGR24);
+    assert(bgr.size() == frames.size());
+    for(size_t i = 0; i < frames.size(); ++i)
+      assert(cv::norm(bgr[i], frames[i], cv::NORM_INF) == 0);
+    for(RawVideoFormat format : {RAW_YUV420P, RAW_Y4M}) {
+      std::vector<cv::Mat> yuv = roundTrip(format);
+      assert(yuv.size() == frames.size());
+      for(size_t i = 0; i < frames.size(); ++i)
+        assert(cv::norm(yuv[i], frames[i], cv::NORM_L1) / frames[i].total() / 3 < 4);
+    }
+  }
+
+  // Seeking back to the start replays the frames read so far, then reading continues from the stream; seeking forward skips frames
+  void testSeeking() {
+    FILE* file = tmpfile();
+    RawVideoWriter writer;
+    assert(writer.open(file, RAW_BGR24, frames[0].size(), 30));
+    for(const cv::Mat& frame : frames)
+      writer.write(frame);
+    writer.release();
+    rewind(file);
+
+    RawVideoReader reader;
+    assert(reader.open(file, RAW_BGR24, frames[0].size(), 30));
+    cv::Mat frame;
+    assert(reader.set(cv::CAP_PROP_POS_FRAMES, 2));
+    assert(reader.read(frame) && cv::norm(frame, frames[2], cv::NORM_INF) == 0);
+    assert(reader.set(cv::CAP_PROP_POS_FRAMES, 0));
+    for(size_t i = 0; i < frames.size(); ++i) {
+      assert(reader.get(cv::CAP_PROP_POS_FRAMES) == i);
+      assert(reader.read(frame) && cv::norm(frame, frames[i], cv::NORM_INF) == 0);
+    }
+    assert(! reader.read(frame));
+    assert(! reader.set(cv::CAP_PROP_POS_FRAMES, 0)); // Nothing is kept after the first replay
+    fclose(file);
+  }
+
+  void testFormats() {
+    RawVideoFormat format;
+    assert(parseRawVideoFormat("yuv420p", &format) && format == RAW_YUV420P);
+    assert(! parseRawVideoFormat("nv12", &format));
+    RawVideoWriter writer;
+    assert(! writer.open(stdout, RAW_YUV420P, cv::Size(63, 48), 30)); // Odd sizes can't be 4:2:0
+    RawVideoReader reader;
+    assert(! reader.open(stdin, RAW_BGR24, cv::Size(), 30)); // Headerless input needs a size
+  }
+
+  void runtests() {
+    testRoundTrips();
+    testSeeking();
+    testFormats();
+  }
+
+};
+
+int main() {
+  TestRawVideo tr;
+  tr.runtests();
+}
+
+#endif
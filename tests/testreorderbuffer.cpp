@@ -0,0 +1,157 @@
+#ifndef testreorderbuffer_h
+#define testreorderbuffer_h
+
+#include "../reorderbuffer.h"
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <random>
+#include <chrono>
+
+// A payload that owns heap memory, so that TSan sees any unsynchronized access to a slot's contents
+struct Item {
+  long number = 0;
+  std::vector<long> payload;
+};
+
+class TestReorderBuffer {
+  public:
+  TestReorderBuffer() {
+  }
+
+  // Items published in reverse order are still retired in order
+  void testRetiresInOrder() {
+    ReorderBuffer<Item> buf(8);
+    for(long n = 8; n >= 1; --n) {
+      Item item;
+      item.number = n;
+      assert(buf.publish(n, item));
+    }
+    buf.close();
+    Item out;
+    for(long n = 1; n <= 8; ++n) {
+      assert(buf.pop(out));
+      assert(out.number == n);
+    }
+    assert(! buf.pop(out)); // Closed and drained
+  }
+
+  // A gap in the numbering ends the stream once the buffer is closed, even if later items are present
+  void testCloseWithGap() {
+    ReorderBuffer<Item> buf(4);
+    Item item;
+    item.number = 2;
+    assert(buf.publish(2, item));
+    assert(buf.peek() == nullptr);
+    buf.close();
+    Item out;
+    assert(! buf.pop(out));
+  }
+
+  // A producer more than "capacity" ahead is released by close() without publishing
+  void testCloseReleasesWaitingProducer() {
+    ReorderBuffer<Item> buf(2);
+    std::atomic<bool> returned(false);
+    bool published = true;
+    std::thread producer([&]() {
+      Item item;
+      item.number = 3;
+      published = buf.publish(3, item);
+      returned.store(true);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    assert(! returned.load());
+    buf.close();
+    producer.join();
+    assert(! published);
+  }
+
+  // reserve() holds producers back until the consumer has retired enough items, and the peaks never exceed the capacity
+  void testReserveBoundsInFlight() {
+    const long capacity = 4;
+    const long itemCount = 5000;
+    ReorderBuffer<Item> buf(capacity);
+    std::atomic<long> counter(0);
+    std::atomic<int> running(8);
+    std::vector<std::thread> producers;
+    for(int t = 0; t < 8; ++t) {
+      producers.emplace_back([&]() {
+        while(true) {
+          long n = counter.fetch_add(1) + 1;
+          if(n > itemCount) break;
+          assert(buf.reserve(n));
+          assert(n - buf.getNextNumber() < capacity);
+          Item item;
+          item.number = n;
+          assert(buf.publish(n, item));
+        }
+        if(running.fetch_sub(1) == 1)
+          buf.close();
+      });
+    }
+    Item out;
+    long retired = 0;
+    while(buf.pop(out))
+      ++retired;
+    for(std::thread& t : producers)
+      t.join();
+    assert(retired == itemCount);
+    assert(buf.getPeakInFlight() >= 1 && buf.getPeakInFlight() <= capacity);
+    assert(buf.getPeakQueued() >= 1 && buf.getPeakQueued() <= capacity);
+  }
+
+  // Many producers with random delays and a ring much smaller than the number of items in flight
+  void testStress(int producerCount, long capacity, long itemCount) {
+    ReorderBuffer<Item> buf(capacity);
+    std::atomic<long> counter(0);
+    std::atomic<int> running(producerCount);
+    std::vector<std::thread> producers;
+    for(int t = 0; t < producerCount; ++t) {
+      producers.emplace_back([&, t]() {
+        std::mt19937 rng(t);
+        while(true) {
+          long n = counter.fetch_add(1) + 1;
+          if(n > itemCount) break;
+          Item item;
+          item.number = n;
+          item.payload.assign(rng() % 16 + 1, n);
+          if(rng() % 8 == 0) std::this_thread::yield(); // Shuffle the publish order
+          assert(buf.publish(n, item));
+        }
+        if(running.fetch_sub(1) == 1)
+          buf.close();
+      });
+    }
+    Item out;
+    long expected = 1;
+    while(buf.pop(out)) {
+      assert(out.number == expected);
+      for(long v : out.payload)
+        assert(v == expected);
+      ++expected;
+    }
+    assert(expected == itemCount + 1);
+    for(std::thread& t : producers)
+      t.join();
+  }
+
+  void runtests() {
+    testRetiresInOrder();
+    testCloseWithGap();
+    testCloseReleasesWaitingProducer();
+    testReserveBoundsInFlight();
+    testStress(1, 1, 2000);
+    testStress(4, 3, 20000);
+    testStress(32, 16, 50000);
+    testStress(64, 128, 50000);
+  }
+
+};
+
+int main() {
+  TestReorderBuffer tr;
+  tr.runtests();
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef testsegmentdecoders_h
+#define testsegmentdecoders_h
+
+#include <opencv2/opencv.hpp>
+#include "../stabilizer.h"
+#include "../keyframeindex.h"
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+class TestSegmentDecoders {
+  private:
+  std::string path = "/tmp/testsegmentdecoders.avi";
+  static const int frameCount = 120;
+  static const int segmentFrames = 20;
+  cv::Mat refImg;
+  cv::Point refPos = cv::Point(24, 16);
+  cv::Rect viewRect = cv::Rect(8, 8, 48, 32);
+
+  public:
+  TestSegmentDecoders() {
+    // Motion JPEG: every frame is a keyframe, so the decoders can seek to any segment
+    cv::VideoWriter writer(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 30, cv::Size(64, 48), true);
+    assert(writer.isOpened());
+    cv::Mat frame(48, 64, CV_8UC3);
+    for(int i = 0; i < frameCount; ++i) {
+      cv::randu(frame, 0, 256);
+      if(i == 0)
+        refImg = frame(cv::Rect(refPos, cv::Size(16, 12))).clone();
+      writer.write(frame);
+    }
+    writer.release();
+  }
+
+  ~TestSegmentDecoders() {
+    std::remove(path.c_str());
+  }
+
+  // With nothing retired, every decoder gets through a segment of its own: the default window doesn't make the decoders of later
+  // segments wait for the earlier ones, so they all decode at once
+  void testDecodersRunTogether() {
+    cv::VideoCapture cap(path);
+    assert(cap.isOpened());
+    StabilizerOptions options;
+    options.tracker = false;
+    const int decoders = 4;
+    Stabilizer stabilizer(&cap, viewRect, refPos, refImg, options);
+    stabilizer.setSegments(path, KeyframeIndex::splitEvenly(frameCount, segmentFrames), decoders);
+    stabilizer.run(1);
+    assert(stabilizer.getMaxInFlight() >= decoders * segmentFrames);
+    for(int tries = 0; tries < 500 && stabilizer.getPeakInFlight() < decoders * segmentFrames; ++tries)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(stabilizer.getPeakInFlight() >= decoders * segmentFrames);
+    stabilizer.stop();
+  }
+
+  // Segments longer than the per-decoder cap only get the cap's worth of the window each
+  void testShareCapped() {
+    cv::VideoCapture cap;
+    StabilizerOptions options;
+    Stabilizer stabilizer(&cap, viewRect, refPos, refImg, options);
+    stabilizer.setSegments(path, KeyframeIndex::splitEvenly(100000, 1000), 4);
+    assert(stabilizer.getMaxInFlight() == 4 + 4 * Stabilizer::maxSegmentShare); // Not running: sized for one worker
+  }
+
+  void runtests() {
+    testDecodersRunTogether();
+    testShareCapped();
+  }
+
+};
+
+int main() {
+  TestSegmentDecoders tc;
+  tc.runtests();
+}
+
+#endif
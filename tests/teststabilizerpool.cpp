@@ -0,0 +1,80 @@
+#ifndef teststabilizerpool_h
+#define teststabilizerpool_h
+
+#include <opencv2/opencv.hpp>
+#include "../stabilizer.h"
+#include "../rawvideo.h"
+#include "../workerpool.h"
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+class TestStabilizerPool {
+  private:
+  static const int frameCount = 12;
+  FILE* file; // The clip, as raw BGR frames
+  cv::Mat refImg;
+  cv::Point refPos = cv::Point(24, 16);
+  cv::Rect viewRect = cv::Rect(8, 8, 48, 32);
+
+  public:
+  TestStabilizerPool() {
+    file = tmpfile();
+    RawVideoWriter writer;
+    assert(writer.open(file, RAW_BGR24, cv::Size(64, 48), 30));
+    cv::Mat frame(48, 64, CV_8UC3);
+    for(int i = 0; i < frameCount; ++i) {
+      cv::randu(frame, 0, 256);
+      if(i == 0)
+        refImg = frame(cv::Rect(refPos, cv::Size(16, 12))).clone();
+      writer.write(frame);
+    }
+    writer.release();
+  }
+
+  ~TestStabilizerPool() {
+    fclose(file);
+  }
+
+  // Stabilizes the clip on the pool, and returns the number of frames that came out
+  int countFrames(WorkerPool& pool) {
+    rewind(file);
+    RawVideoReader reader;
+    assert(reader.open(file, RAW_BGR24, cv::Size(64, 48), 30));
+    StabilizerOptions options;
+    options.tracker = false;
+    options.maxInFlight = 6;
+    options.prefetchFrames = 3;
+    Stabilizer stabilizer(&reader, viewRect, refPos, refImg, options);
+    stabilizer.run(pool);
+    int count = 0;
+    cv::Mat frame;
+    while(true) {
+      stabilizer >> frame;
+      if(frame.empty()) break;
+      ++count;
+    }
+    stabilizer.stop();
+    return count;
+  }
+
+  // Every frame comes out, however the workers race at the end of the stream, which is when the last of them closes the output
+  void testEveryFrameOut() {
+    WorkerPool pool(4);
+    for(int run = 0; run < 300; ++run)
+      assert(countFrames(pool) == frameCount);
+  }
+
+  void runtests() {
+    testEveryFrameOut();
+  }
+
+};
+
+int main() {
+  TestStabilizerPool tc;
+  tc.runtests();
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef testtrajectory_h
+#define testtrajectory_h
+
+#include "../trajectory.h"
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+class TestTrajectory {
+  private:
+  std::string path;
+
+  public:
+  TestTrajectory() {
+    path = "testtrajectory_" + std::to_string(getpid()) + ".traj";
+  }
+
+  ~TestTrajectory() {
+    remove(path.c_str());
+  }
+
+  // Records written in frame order read back in place, and can be looked up by frame number
+  void testRoundTrip() {
+    TrajectoryHeader header = TrajectoryHeader();
+    header.refX = 10;
+    header.refY = 20;
+    header.refWidth = 64;
+    header.refHeight = 48;
+    header.frameWidth = 1920;
+    header.frameHeight = 1080;
+    header.fps = 29.97;
+    {
+      TrajectoryWriter writer;
+      assert(writer.open(path, header));
+      for(long n = 1; n <= 500; ++n) {
+        TrajectoryRecord record = TrajectoryRecord();
+        record.number = n;
+        record.matchX = n * 0.5f;
+        record.matchY = 100 - n * 0.25f;
+        record.score = 0.9f;
+        record.trackedPoints = n % 7;
+        record.flags = n % 2 ? (uint32_t) TRAJECTORY_WINDOW_HIT : 0u;
+        assert(writer.append(record));
+      }
+      assert(writer.close());
+    }
+    TrajectoryReader reader;
+    assert(reader.open(path));
+    assert(reader.size() == 500);
+    assert(reader.getHeader().recordCount == 500);
+    assert(reader.getHeader().refX == 10 && reader.getHeader().refHeight == 48);
+    assert(reader.getHeader().frameWidth == 1920 && reader.getHeader().fps == 29.97);
+    for(long n = 1; n <= 500; ++n) {
+      const TrajectoryRecord* record = reader.find(n);
+      assert(record != nullptr);
+      assert(record->number == n && record->matchX == n * 0.5f && record->matchY == 100 - n * 0.25f);
+      assert(record->trackedPoints == n % 7);
+      assert(record->flags == (n % 2 ? (uint32_t) TRAJECTORY_WINDOW_HIT : 0u));
+    }
+    assert(reader.find(0) == nullptr);
+    assert(reader.find(501) == nullptr);
+  }
+
+  // Files that aren't trajectories, or don't exist, are rejected
+  void testRejectsOtherFiles() {
+    FILE* file = fopen(path.c_str(), "wb");
+    assert(file);
+    char junk[128] = "not a trajectory";
+    fwrite(junk, sizeof(junk), 1, file);
+    fclose(file);
+    TrajectoryReader reader;
+    assert(! reader.open(path));
+    assert(! reader.isOpened());
+    assert(! reader.open(path + ".missing"));
+  }
+
+  void runtests() {
+    testRoundTrip();
+    testRejectsOtherFiles();
+  }
+
+};
+
+int main() {
+  TestTrajectory tt;
+  tt.runtests();
+}
+
+#endif
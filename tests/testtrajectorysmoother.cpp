@@ -0,0 +1,151 @@
+#ifndef testtrajectorysmoother_h
+#define testtrajectorysmoother_h
+
+#include "../trajectorysmoother.h"
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+class TestTrajectorySmoother {
+  public:
+  TestTrajectorySmoother() {
+  }
+
+  // Feeds the positions through the smoother, taking outputs as soon as they are ready, and checks the output lags by exactly the window
+  std::vector<double> smoothX(TrajectorySmoother& smoother, const std::vector<double>& xs) {
+    std::vector<double> out;
+    for(size_t i = 0; i < xs.size(); ++i) {
+      smoother.push(xs[i], -xs[i]);
+      while(smoother.ready()) {
+        double x, y;
+        smoother.next(&x, &y);
+        assert(std::abs(x + y) < 1e-9); // Both axes are smoothed the same way
+        out.push_back(x);
+      }
+      assert(out.size() == (i + 1 > (size_t) smoother.getWindow() ? i + 1 - smoother.getWindow() : 0));
+    }
+    smoother.finish();
+    while(smoother.ready()) {
+      double x, y;
+      smoother.next(&x, &y);
+      out.push_back(x);
+    }
+    assert(out.size() == xs.size());
+    return out;
+  }
+
+  void testNonePassesThrough() {
+    TrajectorySmoother smoother(TrajectorySmoother::NONE, 10);
+    assert(smoother.getWindow() == 0);
+    std::vector<double> xs = {1, 5, -3, 8};
+    assert(smoothX(smoother, xs) == xs);
+  }
+
+  // Steady motion is left alone (away from the ends of the stream, for the averages)
+  void testLinearMotionIsKept(TrajectorySmoother::Method method, double tolerance) {
+    TrajectorySmoother smoother(method, 8);
+    std::vector<double> xs;
+    for(int i = 0; i < 200; ++i)
+      xs.push_back(3 + 0.75 * i);
+    std::vector<double> out = smoothX(smoother, xs);
+    for(int i = 8; i < 192; ++i)
+      assert(std::abs(out[i] - xs[i]) < tolerance);
+  }
+
+  // Jitter around slow motion is reduced
+  void testNoiseIsReduced(TrajectorySmoother::Method method) {
+    std::mt19937 rng(7);
+    std::normal_distribution<double> noise(0, 2);
+    std::vector<double> truth, xs;
+    for(int i = 0; i < 600; ++i) {
+      truth.push_back(40 * std::sin(i / 60.0));
+      xs.push_back(truth.back() + noise(rng));
+    }
+    TrajectorySmoother smoother(method, 10);
+    std::vector<double> out = smoothX(smoother, xs);
+    double rawError = 0, smoothedError = 0;
+    for(int i = 0; i < 600; ++i) {
+      rawError += (xs[i] - truth[i]) * (xs[i] - truth[i]);
+      smoothedError += (out[i] - truth[i]) * (out[i] - truth[i]);
+    }
+    assert(smoothedError < rawError / 3);
+  }
+
+  // A single mismatched frame is left out, but a lasting jump is followed
+  void testOutliers(TrajectorySmoother::Method method) {
+    TrajectorySmoother smoother(method, 4, 0.01, 20);
+    std::vector<double> xs(100, 10.0);
+    xs[30] = 200;
+    for(int i = 60; i < 100; ++i)
+      xs[i] = 100;
+    std::vector<double> out = smoothX(smoother, xs);
+    for(int i = 0; i < 50; ++i)
+      assert(std::abs(out[i] - 10) < 0.5);
+    assert(std::abs(out[99] - 100) < 1);
+    assert(smoother.getRejectedCount() == 1 + 4);
+  }
+
+  // A smoother saved just before a position is pushed, with the positions it hadn't smoothed yet marked taken, then restored, smooths
+  // the rest of the stream (from that position) exactly as the original did
+  void testCheckpoint(TrajectorySmoother::Method method) {
+    std::mt19937 rng(3);
+    std::normal_distribution<double> noise(0, 2);
+    std::vector<double> xs;
+    for(int i = 0; i < 300; ++i)
+      xs.push_back(20 * std::sin(i / 30.0) + noise(rng) + (i == 140 ? 80 : 0));
+    TrajectorySmoother whole(method, 6, 0.01, 20);
+    std::vector<double> expected = smoothX(whole, xs);
+
+    const size_t resumeAt = 150;
+    TrajectorySmoother original(method, 6, 0.01, 20), snapshot;
+    double x, y;
+    for(size_t i = 0; i < resumeAt; ++i) {
+      original.push(xs[i], -xs[i]);
+      while(original.ready())
+        original.next(&x, &y);
+    }
+    snapshot = original;
+    snapshot.markTaken();
+    FILE* file = tmpfile();
+    assert(snapshot.save(file));
+    rewind(file);
+    TrajectorySmoother restored;
+    assert(restored.load(file));
+    fclose(file);
+    assert(restored.getWindow() == whole.getWindow() && restored.getRejectedCount() == snapshot.getRejectedCount());
+    std::vector<double> rest(xs.begin() + resumeAt, xs.end());
+    std::vector<double> out = smoothX(restored, rest);
+    for(size_t i = 0; i < rest.size(); ++i)
+      assert(std::abs(out[i] - expected[resumeAt + i]) < 1e-9);
+
+    FILE* empty = tmpfile();
+    assert(! restored.load(empty));
+    fclose(empty);
+  }
+
+  void runtests() {
+    testNonePassesThrough();
+    testLinearMotionIsKept(TrajectorySmoother::AVERAGE, 1e-9);
+    testLinearMotionIsKept(TrajectorySmoother::GAUSSIAN, 1e-9);
+    testLinearMotionIsKept(TrajectorySmoother::KALMAN, 0.05);
+    for(TrajectorySmoother::Method method : {TrajectorySmoother::AVERAGE, TrajectorySmoother::GAUSSIAN, TrajectorySmoother::KALMAN}) {
+      testNoiseIsReduced(method);
+      testOutliers(method);
+      testCheckpoint(method);
+    }
+    testCheckpoint(TrajectorySmoother::NONE);
+    TrajectorySmoother::Method method;
+    assert(TrajectorySmoother::parseMethod("kalman", &method) && method == TrajectorySmoother::KALMAN);
+    assert(! TrajectorySmoother::parseMethod("median", &method));
+  }
+
+};
+
+int main() {
+  TestTrajectorySmoother ts;
+  ts.runtests();
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef testworkerpool_h
+#define testworkerpool_h
+
+#include "../workerpool.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TestWorkerPool {
+  private:
+  // A source with a fixed number of units of work, made ready all at once or one at a time
+  class CountingSource : public WorkerPool::Source {
+    public:
+    std::atomic<long> ready;
+    std::atomic<long> ran;
+    std::atomic<long> finished;
+    std::atomic<bool> closed;
+    std::vector<long>* order; // Which source ran, in order (shared between sources)
+    std::mutex* orderMutex;
+    long id;
+
+    CountingSource(long id, std::vector<long>* order, std::mutex* orderMutex): ready(0), ran(0), finished(0), closed(false), order(order), orderMutex(orderMutex), id(id) {
+    }
+
+    int tryRun(int worker) override {
+      (void) worker;
+      long available = ready.load();
+      while(available > 0 && ! ready.compare_exchange_weak(available, available - 1)) {
+      }
+      if(available <= 0) {
+        if(closed.load()) {
+          finished.fetch_add(1);
+          return -1;
+        }
+        return 0;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+      {
+        std::scoped_lock lk(*orderMutex);
+        order->push_back(id);
+      }
+      ran.fetch_add(1);
+      return 1;
+    }
+  };
+
+  public:
+  TestWorkerPool() {
+  }
+
+  // Work made ready over time is all run, and sources that finish are let go of
+  void testRunsEverything() {
+    std::vector<long> order;
+    std::mutex orderMutex;
+    CountingSource a(0, &order, &orderMutex), b(1, &order, &orderMutex);
+    {
+      WorkerPool pool(4);
+      assert(pool.getSize() == 4);
+      pool.attach(&a);
+      pool.attach(&b);
+      for(int i = 0; i < 200; ++i) {
+        a.ready.fetch_add(1);
+        pool.notify();
+        if(i % 2 == 0) {
+          b.ready.fetch_add(1);
+          pool.notify();
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+      }
+      a.closed.store(true);
+      b.closed.store(true);
+      pool.notify(true);
+      while(pool.getSourceCount() > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      pool.detach(&a); // Already finished; only waits for any worker still inside it
+      pool.detach(&b);
+    }
+    assert(a.ran.load() == 200 && b.ran.load() == 100);
+    assert(a.finished.load() >= 1 && b.finished.load() >= 1);
+  }
+
+  // Sources that always have work are served in turn, so none is starved
+  void testFairness() {
+    std::vector<long> order;
+    std::mutex orderMutex;
+    CountingSource a(0, &order, &orderMutex), b(1, &order, &orderMutex), c(2, &order, &orderMutex);
+    a.ready.store(100000);
+    b.ready.store(100000);
+    c.ready.store(100000);
+    WorkerPool pool(3);
+    pool.attach(&a);
+    pool.attach(&b);
+    pool.attach(&c);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    pool.detach(&a);
+    pool.detach(&b);
+    pool.detach(&c);
+    long runs[3] = {a.ran.load(), b.ran.load(), c.ran.load()};
+    long least = std::min({runs[0], runs[1], runs[2]}), most = std::max({runs[0], runs[1], runs[2]});
+    assert(least > 0 && most <= least + least / 4 + 3);
+    long before = a.ran.load();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    assert(a.ran.load() == before); // Detached sources aren't run anymore
+  }
+
+  void runtests() {
+    testRunsEverything();
+    testFairness();
+  }
+
+};
+
+int main() {
+  TestWorkerPool tw;
+  tw.runtests();
+}
+
+#endif
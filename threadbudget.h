@@ -0,0 +1,78 @@
+#ifndef threadbudget_h
+#define threadbudget_h
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* How the cores are shared out between the worker threads, which each match whole frames, and OpenCV's internal thread pool, which
+ parallelizes within a single call (matchTemplate, cvtColor, warpAffine...). The pool is process-wide, shared by every worker and the
+ retire thread, so the threads competing for cores are the workers plus the pool. With one worker per core, an OpenCV pool of a thread
+ per core on top of them only oversubscribes the cores, so by default OpenCV runs single-threaded inside each caller instead. */
+struct ThreadBudget {
+  int workers = 0; // Worker threads matching frames; 0 picks one per core
+  int cvThreads = 1; // Threads in OpenCV's internal pool; 1 runs every OpenCV call on its caller's thread; 0 leaves OpenCV's own default
+  bool pin = false; // Pin each worker thread to its own core (Linux only)
+
+  static int getCoreCount() {
+    return std::max((int) std::thread::hardware_concurrency(), 1);
+  }
+
+  int getWorkers() const {
+    return workers > 0 ? workers : getCoreCount();
+  }
+
+  // Sizes OpenCV's thread pool. Call before starting any threads that use OpenCV.
+  void apply() const {
+    if(cvThreads > 0)
+      cv::setNumThreads(cvThreads);
+  }
+
+  std::string describe() const {
+    std::string cv = cvThreads > 0 ? std::to_string(cvThreads) : std::to_string(cv::getNumThreads()) + " (OpenCV's default)";
+    return std::to_string(getWorkers()) + " workers, " + cv + " OpenCV threads" + (pin ? ", pinned" : "") + ", on " + std::to_string(getCoreCount()) + " cores";
+  }
+
+  // Worker and OpenCV pool sizes worth trying on this machine: from one worker per core with OpenCV single-threaded, to fewer workers
+  // with a pool covering the cores between them
+  static std::vector<ThreadBudget> getCandidates() {
+    std::vector<ThreadBudget> candidates;
+    int cores = getCoreCount();
+    for(int workers = cores; workers >= 1; workers /= 2) {
+      for(int cvThreads : {1, std::max(cores / workers, 1), cores}) {
+        ThreadBudget budget;
+        budget.workers = workers;
+        budget.cvThreads = cvThreads;
+        bool seen = false;
+        for(const ThreadBudget& other : candidates)
+          seen = seen || (other.workers == workers && other.cvThreads == cvThreads);
+        if(! seen)
+          candidates.push_back(budget);
+      }
+      if(workers <= 2 || candidates.size() >= 8) break;
+    }
+    return candidates;
+  }
+
+  // Pins a thread to a core (counting from 0, wrapping around). Returns false where pinning isn't supported.
+  static bool pinThread(std::thread& thread, int core) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % getCoreCount(), &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) thread;
+    (void) core;
+    return false;
+#endif
+  }
+};
+
+#endif
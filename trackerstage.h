@@ -0,0 +1,122 @@
+#ifndef trackerstage_h
+#define trackerstage_h
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "boundedqueue.h"
+#include "pointcloudtracker.h"
+#include "profiler.h"
+
+/* Runs a PointCloudTracker on its own thread, off the in-order retire path. The retire thread offers it every decimation-th frame,
+ in order; a frame is dropped rather than waited for if the tracker is still busy with earlier ones, so tracking never slows down
+ retirement. Frames are tracked at a reduced scale, and the latest tracked points are kept, in full-resolution coordinates, for
+ display. */
+class TrackerStage {
+private:
+  PointCloudTracker tracker;
+  BoundedQueue<cv::Mat> queue; // Frames offered but not yet tracked
+  std::thread thread;
+  double scale;
+  int decimation;
+  long offered; // Frames seen by offer(); only touched by the retire thread
+  std::mutex pointsMutex;
+  std::vector<cv::Point2f> points; // The latest tracked points, in full-resolution coordinates
+  std::atomic<long> framesTracked;
+  std::atomic<long> framesDropped; // Frames offered while the tracker was busy
+
+  static void track(TrackerStage* stage) {
+    cv::Mat frame;
+    cv::Mat scaled;
+    Profiler::nameThread("tracker");
+    while(stage->queue.pop(frame)) {
+      ProfileScope tracking(PROFILE_TRACK);
+      if(stage->scale != 1) {
+        cv::resize(frame, scaled, cv::Size(), stage->scale, stage->scale, cv::INTER_AREA);
+        stage->tracker.update(scaled);
+      } else {
+        stage->tracker.update(frame);
+      }
+      frame.release(); // Let the frame's buffer go back to its pool while waiting for the next one
+      tracking.stop();
+      const std::vector<cv::Point2f>& tracked = *stage->tracker.getPoints();
+      {
+        std::scoped_lock lk(stage->pointsMutex);
+        stage->points.resize(tracked.size());
+        for(size_t i = 0; i < tracked.size(); ++i)
+          stage->points[i] = tracked[i] * (1 / stage->scale);
+      }
+      stage->framesTracked.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+public:
+  TrackerStage(): queue(2) {
+    scale = 1;
+    decimation = 1;
+    offered = 0;
+    framesTracked.store(0, std::memory_order_relaxed);
+    framesDropped.store(0, std::memory_order_relaxed);
+  }
+
+  ~TrackerStage() {
+    stop();
+  }
+
+  // Starts the tracker thread, tracking every decimation-th frame offered, scaled by scale. queueFrames is how many offered frames
+  // may wait for the tracker before more are dropped.
+  void start(double scale, int decimation, long queueFrames = 2) {
+    stop();
+    this->scale = scale > 0 && scale < 1 ? scale : 1;
+    this->decimation = std::max(decimation, 1);
+    offered = 0;
+    tracker.reset();
+    queue.reset(queueFrames);
+    framesTracked.store(0, std::memory_order_relaxed);
+    framesDropped.store(0, std::memory_order_relaxed);
+    {
+      std::scoped_lock lk(pointsMutex);
+      points.clear();
+    }
+    thread = std::thread(track, this);
+  }
+
+  // Tracks whatever has been offered already, and stops the tracker thread
+  void stop() {
+    queue.close();
+    if(thread.joinable())
+      thread.join();
+  }
+
+  bool isRunning() { return thread.joinable(); }
+
+  // Offers the next frame in order. Never waits. The frame's pixels must not be modified afterwards (it is shared, not copied).
+  void offer(const cv::Mat& frame) {
+    if(! thread.joinable() || offered++ % decimation != 0) return;
+    cv::Mat item = frame;
+    if(! queue.tryPush(item))
+      framesDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Copies the latest tracked points, in full-resolution coordinates
+  void getPoints(std::vector<cv::Point2f>& out) {
+    std::scoped_lock lk(pointsMutex);
+    out = points;
+  }
+
+  long getPointCount() {
+    std::scoped_lock lk(pointsMutex);
+    return points.size();
+  }
+
+  // Maximum number of offered frames the tracker holds on to at once
+  long getQueueCapacity() { return queue.getCapacity() + 1; }
+
+  long getTrackedCount() { return framesTracked.load(std::memory_order_relaxed); }
+
+  long getDroppedCount() { return framesDropped.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef trajectory_h
+#define trajectory_h
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* The trajectory file written by an analysis pass: a fixed-size header, then one fixed-size record per frame, in frame order.
+ Everything is stored in the machine's native byte order and layout, so that a render pass can map the file and use the records
+ in place, without parsing. */
+
+// Flags describing how a frame's match location was found
+enum TrajectoryFlags : uint32_t {
+  TRAJECTORY_WINDOW_HIT = 1, // Found within the search window predicted from nearby frames
+  TRAJECTORY_WINDOW_MISS = 2, // The search window missed, and a wider search was done
+  TRAJECTORY_UNTRACKED = 4, // The point cloud tracker didn't run, so trackedPoints is meaningless
+};
+
+struct TrajectoryHeader {
+  char magic[8]; // "CVSTRAJ" plus a terminating null
+  uint32_t version;
+  uint32_t recordSize; // sizeof(TrajectoryRecord) when written, checked when read
+  uint64_t recordCount; // Filled in when the writer is closed; 0 if the analysis was interrupted
+  int32_t refX, refY, refWidth, refHeight; // The reference rectangle within its original frame
+  int32_t frameWidth, frameHeight;
+  double fps;
+  uint8_t reserved[8];
+};
+
+struct TrajectoryRecord {
+  int64_t number; // Frame number, starting from 1
+  float matchX, matchY; // Top-left position of the reference in the frame, at sub-pixel precision
+  float score; // The estimator's confidence in the match; the scale depends on the estimator
+  int32_t trackedPoints; // Number of points the point cloud tracker was following at this frame (0 if TRAJECTORY_UNTRACKED)
+  uint32_t flags; // TrajectoryFlags
+  uint32_t reserved;
+};
+
+static_assert(sizeof(TrajectoryHeader) == 64, "Trajectory header layout changed");
+static_assert(sizeof(TrajectoryRecord) == 32, "Trajectory record layout changed");
+
+static const char trajectoryMagic[8] = "CVSTRAJ";
+static const uint32_t trajectoryVersion = 1;
+
+/* Writes a trajectory file sequentially. Records must be appended in frame order. */
+class TrajectoryWriter {
+private:
+  FILE* file;
+  TrajectoryHeader header;
+
+public:
+  TrajectoryWriter() {
+    file = nullptr;
+  }
+
+  ~TrajectoryWriter() {
+    close();
+  }
+
+  // Creates (or truncates) the file and writes the header. Returns false if it can't be written.
+  bool open(const std::string& path, const TrajectoryHeader& header) {
+    close();
+    this->header = header;
+    memcpy(this->header.magic, trajectoryMagic, sizeof(trajectoryMagic));
+    this->header.version = trajectoryVersion;
+    this->header.recordSize = sizeof(TrajectoryRecord);
+    this->header.recordCount = 0;
+    file = fopen(path.c_str(), "wb");
+    if(! file)
+      return false;
+    if(fwrite(&this->header, sizeof(this->header), 1, file) != 1) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  bool isOpened() { return file != nullptr; }
+
+  bool append(const TrajectoryRecord& record) {
+    if(! file || fwrite(&record, sizeof(record), 1, file) != 1)
+      return false;
+    ++header.recordCount;
+    return true;
+  }
+
+  // Rewrites the header with the final record count, and closes the file
+  bool close() {
+    if(! file)
+      return true;
+    bool ok = fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+  }
+};
+
+/* Maps a trajectory file read-only, and looks up its records in place. */
+class TrajectoryReader {
+private:
+  void* mapping;
+  size_t mappedSize;
+  const TrajectoryHeader* header;
+  const TrajectoryRecord* records;
+  long count;
+
+public:
+  TrajectoryReader() {
+    mapping = nullptr;
+    mappedSize = 0;
+    header = nullptr;
+    records = nullptr;
+    count = 0;
+  }
+
+  ~TrajectoryReader() {
+    close();
+  }
+
+  // Returns false if the file can't be mapped, or isn't a trajectory file of this version and layout
+  bool open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+      return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TrajectoryHeader)) {
+      ::close(fd);
+      return false;
+    }
+    mappedSize = st.st_size;
+    mapping = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // The mapping stays valid
+    if(mapping == MAP_FAILED) {
+      mapping = nullptr;
+      return false;
+    }
+    header = (const TrajectoryHeader*) mapping;
+    if(memcmp(header->magic, trajectoryMagic, sizeof(trajectoryMagic)) != 0 || header->version != trajectoryVersion || header->recordSize != sizeof(TrajectoryRecord)) {
+      close();
+      return false;
+    }
+    records = (const TrajectoryRecord*) ((const char*) mapping + sizeof(TrajectoryHeader));
+    count = (mappedSize - sizeof(TrajectoryHeader)) / sizeof(TrajectoryRecord);
+    if(header->recordCount != 0 && (long) header->recordCount < count) // Ignore anything past the records the writer finished
+      count = header->recordCount;
+    return true;
+  }
+
+  void close() {
+    if(mapping)
+      munmap(mapping, mappedSize);
+    mapping = nullptr;
+    mappedSize = 0;
+    header = nullptr;
+    records = nullptr;
+    count = 0;
+  }
+
+  bool isOpened() const { return mapping != nullptr; }
+
+  const TrajectoryHeader& getHeader() const { return *header; }
+
+  long size() const { return count; }
+
+  const TrajectoryRecord& operator[](long index) const { return records[index]; }
+
+  // Returns the record of the given frame number, or nullptr if the trajectory doesn't cover it
+  const TrajectoryRecord* find(long number) const {
+    if(number < 1 || number > count || records[number - 1].number != number)
+      return nullptr;
+    return &records[number - 1];
+  }
+};
+
+#endif
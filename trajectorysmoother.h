@@ -0,0 +1,265 @@
+#ifndef trajectorysmoother_h
+#define trajectorysmoother_h
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+
+/* Smooths a stream of 2D positions (one per frame, in order) using up to "window" frames on either side of each one.
+ Positions are pushed as they arrive, and each smoothed position can be taken once the window frames after it have arrived (or the
+ stream has finished), so the output lags the input by exactly window frames, and at most 2 * window + 1 positions are kept.
+ Methods:
+   average: the mean of the positions within the window
+   gaussian: a mean weighted by a Gaussian with a standard deviation of a third of the window
+   kalman: a constant-velocity Kalman filter, run forward over every position, then smoothed backward (Rauch-Tung-Striebel) from
+           the newest position in the window
+ Positions further than the outlier limit from the last accepted one are left out of the smoothing (as if missing), unless the
+ position has stayed there for longer than the window, in which case it has really moved. */
+class TrajectorySmoother {
+public:
+  enum Method { NONE, AVERAGE, GAUSSIAN, KALMAN };
+
+private:
+  struct AxisState { // Kalman state along one axis: position and velocity, and their covariance
+    double pos = 0, vel = 0;
+    double p00 = 0, p01 = 0, p11 = 0;
+  };
+  struct Sample {
+    double pos[2];
+    bool accepted;
+    AxisState predicted[2], filtered[2]; // Kalman state before and after taking this position into account
+  };
+
+  std::vector<Sample> ring; // Fixed ring holding up to window positions already taken, then the ones waiting to be taken
+  size_t first; // Ring index of the oldest position held
+  size_t count; // Number of positions held
+  size_t cursor; // Index (counting from the oldest position held) of the next position to take
+  Method method;
+  int window;
+  double processNoise; // Kalman process noise (variance of the acceleration per frame, in square pixels), relative to a measurement noise of 1
+  double outlierLimit; // 0 accepts every position
+  bool finished;
+  double lastAccepted[2];
+  bool haveAccepted;
+  int rejectedRun; // Number of consecutive positions rejected as outliers
+  long rejectedCount;
+
+  inline Sample& at(size_t index) {
+    return ring[(first + index) % ring.size()];
+  }
+
+  // Forgets taken positions that have left the window
+  void forget() {
+    while(cursor > (size_t) window) {
+      first = (first + 1) % ring.size();
+      --count;
+      --cursor;
+    }
+  }
+
+  void predict(const AxisState& from, AxisState& to) {
+    to.pos = from.pos + from.vel;
+    to.vel = from.vel;
+    to.p00 = from.p00 + 2 * from.p01 + from.p11 + processNoise / 4;
+    to.p01 = from.p01 + from.p11 + processNoise / 2;
+    to.p11 = from.p11 + processNoise;
+  }
+
+  void correct(AxisState& state, double measured) {
+    double s = state.p00 + 1; // Innovation variance, with a measurement noise of 1
+    double k0 = state.p00 / s, k1 = state.p01 / s;
+    double residual = measured - state.pos;
+    state.pos += k0 * residual;
+    state.vel += k1 * residual;
+    state.p11 -= k1 * state.p01;
+    state.p01 *= 1 - k0;
+    state.p00 *= 1 - k0;
+  }
+
+  // Runs the forward Kalman filter over the newest sample
+  void filter(size_t index) {
+    Sample& sample = at(index);
+    for(int axis = 0; axis < 2; ++axis) {
+      if(index == 0) { // Start of the stream: start from this position, with an unknown velocity
+        sample.predicted[axis].pos = sample.pos[axis];
+        sample.predicted[axis].p00 = 1;
+        sample.predicted[axis].p11 = 100;
+      } else {
+        predict(at(index - 1).filtered[axis], sample.predicted[axis]);
+      }
+      sample.filtered[axis] = sample.predicted[axis];
+      if(sample.accepted)
+        correct(sample.filtered[axis], sample.pos[axis]);
+    }
+  }
+
+  // Backward (Rauch-Tung-Striebel) pass from the newest sample down to the given one; only the means are needed
+  double smoothKalman(size_t index, int axis) {
+    double pos = at(count - 1).filtered[axis].pos, vel = at(count - 1).filtered[axis].vel;
+    for(size_t k = count - 1; k > index; --k) {
+      const AxisState& f = at(k - 1).filtered[axis];
+      const AxisState& p = at(k).predicted[axis];
+      double det = p.p00 * p.p11 - p.p01 * p.p01;
+      // C = Pf * F^T * Pp^-1
+      double a00 = f.p00 + f.p01, a01 = f.p01, a10 = f.p01 + f.p11, a11 = f.p11;
+      double i00 = p.p11 / det, i01 = -p.p01 / det, i11 = p.p00 / det;
+      double c00 = a00 * i00 + a01 * i01, c01 = a00 * i01 + a01 * i11;
+      double c10 = a10 * i00 + a11 * i01, c11 = a10 * i01 + a11 * i11;
+      double dPos = pos - p.pos, dVel = vel - p.vel;
+      pos = f.pos + c00 * dPos + c01 * dVel;
+      vel = f.vel + c10 * dPos + c11 * dVel;
+    }
+    return pos;
+  }
+
+  double smoothWeighted(size_t index, int axis) {
+    double sigma = window / 3.0;
+    double total = 0, weightTotal = 0;
+    size_t first = index >= (size_t) window ? index - window : 0;
+    size_t last = std::min(index + window, count - 1);
+    for(size_t k = first; k <= last; ++k) {
+      if(! at(k).accepted) continue;
+      double d = (double) k - (double) index;
+      double weight = method == GAUSSIAN ? std::exp(-d * d / (2 * sigma * sigma)) : 1;
+      total += weight * at(k).pos[axis];
+      weightTotal += weight;
+    }
+    if(weightTotal == 0) // Every position in the window was rejected; use the last accepted one
+      return haveAccepted ? lastAccepted[axis] : at(index).pos[axis];
+    return total / weightTotal;
+  }
+
+public:
+  TrajectorySmoother(Method method = NONE, int window = 0, double processNoise = 0.01, double outlierLimit = 0) {
+    reset(method, window, processNoise, outlierLimit);
+  }
+
+  void reset(Method method, int window, double processNoise = 0.01, double outlierLimit = 0) {
+    this->method = method;
+    this->window = method == NONE ? 0 : std::max(window, 1);
+    this->processNoise = processNoise;
+    this->outlierLimit = outlierLimit;
+    ring.assign(2 * this->window + 2, Sample());
+    first = 0;
+    count = 0;
+    cursor = 0;
+    finished = false;
+    haveAccepted = false;
+    rejectedRun = 0;
+    rejectedCount = 0;
+  }
+
+  // Parses a method name ("none", "average", "gaussian" or "kalman"). Returns false if it isn't one.
+  static bool parseMethod(const std::string& name, Method* method) {
+    if(name == "none") *method = NONE;
+    else if(name == "average") *method = AVERAGE;
+    else if(name == "gaussian") *method = GAUSSIAN;
+    else if(name == "kalman") *method = KALMAN;
+    else return false;
+    return true;
+  }
+
+  int getWindow() { return window; }
+
+  // Number of positions left out of the smoothing as outliers
+  long getRejectedCount() { return rejectedCount; }
+
+  // Adds the position of the next frame. Take every position that is ready() before pushing another, so the ring can't overflow.
+  void push(double x, double y) {
+    Sample sample;
+    sample.pos[0] = x;
+    sample.pos[1] = y;
+    sample.accepted = true;
+    if(outlierLimit > 0 && haveAccepted && std::hypot(x - lastAccepted[0], y - lastAccepted[1]) > outlierLimit) {
+      if(rejectedRun < window) { // Otherwise, it has stayed there too long to be a mismatch
+        sample.accepted = false;
+        ++rejectedRun;
+        ++rejectedCount;
+      }
+    }
+    at(count++) = sample;
+    if(method == KALMAN)
+      filter(count - 1);
+    if(sample.accepted) {
+      lastAccepted[0] = x;
+      lastAccepted[1] = y;
+      haveAccepted = true;
+      rejectedRun = 0;
+    }
+  }
+
+  // Marks the end of the stream, so that the remaining positions can be taken without waiting for more
+  void finish() { finished = true; }
+
+  // Whether the next smoothed position can be taken
+  bool ready() {
+    if(cursor >= count) return false;
+    return finished || count - cursor > (size_t) window;
+  }
+
+  // Takes the smoothed position of the next frame. Only call this when ready().
+  void next(double* x, double* y) {
+    double smoothed[2];
+    for(int axis = 0; axis < 2; ++axis) {
+      if(method == NONE)
+        smoothed[axis] = at(cursor).pos[axis];
+      else if(method == KALMAN)
+        smoothed[axis] = smoothKalman(cursor, axis);
+      else
+        smoothed[axis] = smoothWeighted(cursor, axis);
+    }
+    *x = smoothed[0];
+    *y = smoothed[1];
+    ++cursor;
+    forget();
+  }
+
+  // Treats every position held as already taken, keeping only the window of them that later positions are smoothed with. This is the
+  // state to resume from if the frames not taken yet are lost (when stopping at a checkpoint), and will be pushed again.
+  void markTaken() {
+    cursor = count;
+    forget();
+  }
+
+  // Writes the whole state to file, in the machine's native layout (like the trajectory file). Returns false on a write error.
+  bool save(FILE* file) const {
+    uint64_t fields[6] = {(uint64_t) method, (uint64_t) window, ring.size(), first, count, cursor};
+    int64_t counters[2] = {rejectedRun, rejectedCount};
+    uint8_t flags[2] = {finished, haveAccepted};
+    return fwrite(fields, sizeof(fields), 1, file) == 1 && fwrite(&processNoise, sizeof(double), 1, file) == 1 && fwrite(&outlierLimit, sizeof(double), 1, file) == 1
+      && fwrite(lastAccepted, sizeof(lastAccepted), 1, file) == 1 && fwrite(counters, sizeof(counters), 1, file) == 1 && fwrite(flags, sizeof(flags), 1, file) == 1
+      && fwrite(ring.data(), sizeof(Sample), ring.size(), file) == ring.size();
+  }
+
+  // Reads a state written by save(). Returns false (leaving the smoother reset) if it is truncated or inconsistent.
+  bool load(FILE* file) {
+    uint64_t fields[6];
+    int64_t counters[2];
+    uint8_t flags[2];
+    double noise, limit;
+    reset(NONE, 0);
+    if(fread(fields, sizeof(fields), 1, file) != 1 || fread(&noise, sizeof(double), 1, file) != 1 || fread(&limit, sizeof(double), 1, file) != 1)
+      return false;
+    if(fields[0] > KALMAN || fields[1] > (1 << 20) || fields[2] != 2 * fields[1] + 2 || fields[3] >= fields[2] || fields[4] > fields[2] || fields[5] > fields[4])
+      return false;
+    reset((Method) fields[0], (int) fields[1], noise, limit);
+    if(window != (int) fields[1] || fread(lastAccepted, sizeof(lastAccepted), 1, file) != 1 || fread(counters, sizeof(counters), 1, file) != 1
+      || fread(flags, sizeof(flags), 1, file) != 1 || fread(ring.data(), sizeof(Sample), ring.size(), file) != ring.size()) {
+      reset(NONE, 0);
+      return false;
+    }
+    first = fields[3];
+    count = fields[4];
+    cursor = fields[5];
+    rejectedRun = counters[0];
+    rejectedCount = counters[1];
+    finished = flags[0];
+    haveAccepted = flags[1];
+    return true;
+  }
+};
+
+#endif
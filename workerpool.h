@@ -0,0 +1,170 @@
+#ifndef workerpool_h
+#define workerpool_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "profiler.h"
+#include "threadbudget.h"
+
+/* A persistent set of worker threads shared by any number of work sources (one Stabilizer per video, say), so that several videos can
+ be processed at once without each starting its own threads, and the cores stay busy while one video starts up or drains.
+ Workers take one unit of work at a time from the attached sources in turn (round-robin), so every source gets an equal share of the
+ workers whenever it has work ready. Sources call notify() whenever they make work ready, so idle workers sleep instead of polling. */
+class WorkerPool {
+public:
+  class Source {
+  public:
+    virtual ~Source() {}
+
+    // Runs one unit of work on the calling worker thread, if any is ready. worker is the thread's index within the pool (0 to
+    // getSize() - 1), for keeping per-thread state. Returns 1 if it ran something, 0 if nothing was ready, or -1 once the source
+    // is finished for good, which detaches it. May be called by several workers at once.
+    virtual int tryRun(int worker) = 0;
+  };
+
+private:
+  struct Entry {
+    Source* source;
+    int running = 0; // Number of workers currently inside source->tryRun()
+    bool attached = true;
+  };
+
+  std::vector<std::thread> threads;
+  std::vector<std::shared_ptr<Entry>> entries; // The attached sources
+  std::vector<std::shared_ptr<Entry>> draining; // Sources no longer attached, that workers are still running
+  size_t nextEntry; // Where the round-robin picks up
+  long generation; // Incremented by notify(), so that workers can tell whether new work may have turned up while they looked
+  bool stopping;
+  std::mutex mtx;
+  std::condition_variable workNotify; // Notified by notify()
+  std::condition_variable doneNotify; // Notified when a worker leaves a source's tryRun(), for detach()
+  std::atomic<long> idleNanos; // Total time workers spent with no work from any source
+
+  void work(int worker) {
+    Profiler::nameThread("worker");
+    std::unique_lock<std::mutex> lk(mtx);
+    long misses = 0; // Sources tried in a row without finding work
+    long seenGeneration = generation;
+    while(! stopping) {
+      if(entries.empty() || misses >= (long) entries.size()) { // Nothing ready anywhere: sleep until more work is announced
+        if(generation == seenGeneration) {
+          auto start = std::chrono::steady_clock::now();
+          workNotify.wait(lk, [&]() { return stopping || generation != seenGeneration; });
+          idleNanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+        }
+        seenGeneration = generation;
+        misses = 0;
+        continue;
+      }
+      std::shared_ptr<Entry> entry = entries[nextEntry++ % entries.size()];
+      ++entry->running;
+      lk.unlock();
+      int result = entry->source->tryRun(worker);
+      lk.lock();
+      --entry->running;
+      if(result < 0 && entry->attached)
+        remove(entry);
+      if(result > 0)
+        misses = 0;
+      else
+        ++misses;
+      if(! entry->attached && entry->running == 0) {
+        draining.erase(std::remove(draining.begin(), draining.end(), entry), draining.end());
+        doneNotify.notify_all();
+      }
+    }
+  }
+
+  // Only call this while holding mtx
+  void remove(std::shared_ptr<Entry> entry) {
+    entry->attached = false;
+    entries.erase(std::remove(entries.begin(), entries.end(), entry), entries.end());
+    if(entry->running > 0)
+      draining.push_back(entry);
+  }
+
+public:
+  // Starts "size" worker threads, pinning them to cores if pin is set
+  WorkerPool(int size, bool pin = false) {
+    nextEntry = 0;
+    generation = 0;
+    stopping = false;
+    idleNanos.store(0, std::memory_order_relaxed);
+    for(int i = 0; i < std::max(size, 1); ++i) {
+      threads.emplace_back(&WorkerPool::work, this, i);
+      if(pin)
+        ThreadBudget::pinThread(threads.back(), i);
+    }
+  }
+
+  // Stops the workers once they finish what they are running. Sources still attached are simply no longer served.
+  ~WorkerPool() {
+    {
+      std::scoped_lock lk(mtx);
+      stopping = true;
+    }
+    workNotify.notify_all();
+    for(std::thread& t : threads)
+      t.join();
+  }
+
+  int getSize() { return threads.size(); }
+
+  // Starts serving source. It must stay valid until it finishes (tryRun() returns -1) or is detached.
+  void attach(Source* source) {
+    {
+      std::scoped_lock lk(mtx);
+      std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+      entry->source = source;
+      entries.push_back(entry);
+      ++generation;
+    }
+    workNotify.notify_all();
+  }
+
+  // Stops serving source, and waits until no worker is running it anymore, so that it can be destroyed. Safe to call whether or not
+  // the source is still attached.
+  void detach(Source* source) {
+    std::unique_lock<std::mutex> lk(mtx);
+    std::shared_ptr<Entry> held;
+    for(const std::shared_ptr<Entry>& entry : entries)
+      if(entry->source == source)
+        held = entry;
+    if(held)
+      remove(held);
+    for(const std::shared_ptr<Entry>& entry : draining)
+      if(entry->source == source)
+        held = entry;
+    if(held)
+      doneNotify.wait(lk, [&]() { return held->running == 0; });
+  }
+
+  // Announces that a source has work ready (or has just finished), waking one idle worker, or every one if all is set
+  void notify(bool all = false) {
+    {
+      std::scoped_lock lk(mtx);
+      ++generation;
+    }
+    if(all)
+      workNotify.notify_all();
+    else
+      workNotify.notify_one();
+  }
+
+  // Number of sources attached
+  int getSourceCount() {
+    std::scoped_lock lk(mtx);
+    return entries.size();
+  }
+
+  // Total seconds the workers spent idle, with no work ready from any source (summed over all workers)
+  double getIdleSeconds() { return idleNanos.load(std::memory_order_relaxed) / 1e9; }
+};
+
+#endif